@@ -0,0 +1,669 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include "synthetic_map.hpp"
+#include <valve-bsp-parser/bsp_map.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <thread>
+
+using namespace rn;
+
+namespace {
+/// <summary>
+/// Rays the batched queries are handed at once
+/// </summary>
+constexpr std::size_t BATCH_SIZE = 256;
+
+/// <summary>
+/// Box trace_hull sweeps, a standing player
+/// </summary>
+const vector3 HULL_MINS( -16.f, -16.f, 0.f );
+const vector3 HULL_MAXS( 16.f, 16.f, 72.f );
+
+struct bench_options
+{
+    std::size_t                  rays     = 1000000;
+    std::size_t                  repeat   = 3;
+    std::vector<std::size_t>     threads;
+    std::vector<trace_backend>   backends = { trace_backend::bsp_tree, trace_backend::brush_bvh };
+    std::string                  map_file;
+    bool                         keep     = false;
+    /// <summary>
+    /// Compare the backends instead of timing them
+    /// </summary>
+    bool                         check    = false;
+    bench::synthetic_map_options map;
+};
+
+/// <summary>
+/// Fills origins and destinations from seed. Half the rays stay in their
+/// room, the others end up to two rooms away, so there's a mix of short,
+/// long, open and blocked rays.
+/// </summary>
+void make_rays(
+    const std::vector<valve::aabb_t>& rooms,
+    const std::uint32_t               rooms_x,
+    const std::uint32_t               seed,
+    const std::size_t                 count,
+    std::vector<vector3>&             origins,
+    std::vector<vector3>&             destinations
+)
+{
+    std::mt19937                          random( seed );
+    std::uniform_real_distribution<float> unit( 0.f, 1.f );
+    std::uniform_int_distribution<int>    offset( -2, 2 );
+
+    const auto rooms_y = static_cast<std::uint32_t>( rooms.size() ) / rooms_x;
+
+    auto point_in = [&]( const valve::aabb_t& room )
+    {
+        vector3 point;
+        for( std::size_t k = 0; k < 3; ++k ) {
+            point( k ) = room.mins( k ) + unit( random ) * ( room.maxs( k ) - room.mins( k ) );
+        }
+        return point;
+    };
+
+    origins.resize( count );
+    destinations.resize( count );
+    for( std::size_t i = 0; i < count; ++i ) {
+        const auto from = static_cast<std::uint32_t>( random() % rooms.size() );
+        auto       to   = from;
+        if( unit( random ) < 0.5f ) {
+            const auto x = std::clamp<int>( static_cast<int>( from % rooms_x ) + offset( random ), 0, static_cast<int>( rooms_x ) - 1 );
+            const auto y = std::clamp<int>( static_cast<int>( from / rooms_x ) + offset( random ), 0, static_cast<int>( rooms_y ) - 1 );
+            to           = static_cast<std::uint32_t>( y ) * rooms_x + static_cast<std::uint32_t>( x );
+        }
+
+        origins.at( i )      = point_in( rooms.at( from ) );
+        destinations.at( i ) = point_in( rooms.at( to ) );
+    }
+}
+
+/// <summary>
+/// Runs fn( first, last ) over count rays split evenly across threads and
+/// returns the seconds the slowest thread took together with the summed hits
+/// </summary>
+template<typename callback>
+std::pair<double, std::size_t> run_threads(
+    const std::size_t count,
+    const std::size_t threads,
+    callback&&        fn
+)
+{
+    std::vector<std::size_t> hits( threads, 0 );
+    std::vector<std::thread> workers;
+    workers.reserve( threads );
+
+    const auto start = std::chrono::steady_clock::now();
+    for( std::size_t t = 0; t < threads; ++t ) {
+        workers.emplace_back( [&, t]
+        {
+            hits.at( t ) = fn( count * t / threads, count * ( t + 1 ) / threads );
+        } );
+    }
+    for( auto& worker : workers ) {
+        worker.join();
+    }
+    const auto elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+    std::size_t total = 0;
+    for( const auto value : hits ) {
+        total += value;
+    }
+    return { elapsed, total };
+}
+
+/// <summary>
+/// Best of options.repeat runs, reported as rays per second over all
+/// threads and nanoseconds one thread spends on a ray
+/// </summary>
+template<typename callback>
+void report(
+    const char*          name,
+    const char*          backend,
+    const bench_options& options,
+    const std::size_t    threads,
+    callback&&           fn
+)
+{
+    auto        best = std::numeric_limits<double>::max();
+    std::size_t hits = 0;
+    for( std::size_t run = 0; run < std::max<std::size_t>( options.repeat, 1 ); ++run ) {
+        const auto result = run_threads( options.rays, threads, fn );
+        best = std::min( best, result.first );
+        hits = result.second;
+    }
+
+    const auto rays = static_cast<double>( options.rays );
+    std::printf( "%-20s %-10s %7zu %10zu %12.3f %10.1f %8.2f%%\n",
+                 name,
+                 backend,
+                 threads,
+                 options.rays,
+                 rays / best / 1e6,
+                 best * 1e9 * static_cast<double>( threads ) / rays,
+                 100.0 * static_cast<double>( hits ) / rays );
+}
+
+void run_benchmarks(
+    const bsp_map&              map,
+    const char*                 backend,
+    const bench_options&        options,
+    const std::vector<vector3>& origins,
+    const std::vector<vector3>& destinations
+)
+{
+    for( const auto threads : options.threads ) {
+        report( "trace_ray", backend, options, threads, [&]( const std::size_t first, const std::size_t last )
+        {
+            std::size_t    hits = 0;
+            valve::trace_t trace;
+            for( auto i = first; i < last; ++i ) {
+                map.trace_ray( origins.at( i ), destinations.at( i ), &trace );
+                hits += trace.fraction < 1.f;
+            }
+            return hits;
+        } );
+
+        report( "trace_rays", backend, options, threads, [&]( const std::size_t first, const std::size_t last )
+        {
+            std::size_t                            hits = 0;
+            std::array<valve::trace_t, BATCH_SIZE> traces;
+            for( auto i = first; i < last; i += BATCH_SIZE ) {
+                const auto count = std::min( BATCH_SIZE, last - i );
+                map.trace_rays( origins.data() + i, destinations.data() + i, count, traces.data() );
+                for( std::size_t j = 0; j < count; ++j ) {
+                    hits += traces.at( j ).fraction < 1.f;
+                }
+            }
+            return hits;
+        } );
+
+        report( "is_visible", backend, options, threads, [&]( const std::size_t first, const std::size_t last )
+        {
+            std::size_t hits = 0;
+            for( auto i = first; i < last; ++i ) {
+                hits += !map.is_visible( origins.at( i ), destinations.at( i ) );
+            }
+            return hits;
+        } );
+
+        report( "is_visible_batch", backend, options, threads, [&]( const std::size_t first, const std::size_t last )
+        {
+            std::size_t                  hits = 0;
+            std::array<bool, BATCH_SIZE> visible;
+            for( auto i = first; i < last; i += BATCH_SIZE ) {
+                const auto count = std::min( BATCH_SIZE, last - i );
+                map.is_visible_batch( origins.data() + i, destinations.data() + i, count, visible.data() );
+                for( std::size_t j = 0; j < count; ++j ) {
+                    hits += !visible.at( j );
+                }
+            }
+            return hits;
+        } );
+
+        report( "trace_hull", backend, options, threads, [&]( const std::size_t first, const std::size_t last )
+        {
+            std::size_t    hits = 0;
+            valve::trace_t trace;
+            for( auto i = first; i < last; ++i ) {
+                map.trace_hull( origins.at( i ), destinations.at( i ), HULL_MINS, HULL_MAXS, valve::MASK_PLAYERSOLID, &trace );
+                hits += trace.fraction < 1.f;
+            }
+            return hits;
+        } );
+    }
+}
+
+/// <summary>
+/// Fraction at which the ray comes down through the top of a pool, 1 when
+/// it doesn't
+/// </summary>
+float water_crossing(
+    const std::vector<valve::aabb_t>& pools,
+    const vector3&                    origin,
+    const vector3&                    destination
+)
+{
+    auto first = 1.f;
+    for( const auto& pool : pools ) {
+        const auto top = pool.maxs( 2 );
+        if( !( origin( 2 ) > top ) || destination( 2 ) > top ) {
+            continue;
+        }
+        const auto t = ( top - origin( 2 ) ) / ( destination( 2 ) - origin( 2 ) );
+        const auto x = origin( 0 ) + ( destination( 0 ) - origin( 0 ) ) * t;
+        const auto y = origin( 1 ) + ( destination( 1 ) - origin( 1 ) ) * t;
+        if( x > pool.mins( 0 ) && x < pool.maxs( 0 ) && y > pool.mins( 1 ) && y < pool.maxs( 1 ) ) {
+            first = std::min( first, t );
+        }
+    }
+    return first;
+}
+
+bool same_trace(
+    const valve::trace_t& lhs,
+    const valve::trace_t& rhs
+)
+{
+    return lhs.fraction == rhs.fraction
+        && lhs.start_solid == rhs.start_solid
+        && lhs.all_solid == rhs.all_solid
+        && lhs.contents == rhs.contents
+        && lhs.static_prop == rhs.static_prop
+        && lhs.displacement == rhs.displacement
+        && lhs.end_pos( 0 ) == rhs.end_pos( 0 )
+        && lhs.end_pos( 1 ) == rhs.end_pos( 1 )
+        && lhs.end_pos( 2 ) == rhs.end_pos( 2 );
+}
+
+/// <summary>
+/// How far a probe box has to overlap a brush, or stay away from every brush,
+/// for check_hulls to know whether it starts in solid. Boxes closer to a
+/// side than this are touching it and skipped.
+/// </summary>
+constexpr float HULL_CHECK_MARGIN = 1.f;
+
+/// <summary>
+/// Sweeps the player box from every ray origin to its destination, and a
+/// small box standing still at the center of every solid brush. Boxes
+/// starting clear of every solid brush have to report neither start_solid
+/// nor all_solid, boxes starting inside one both start_solid and, when they
+/// don't move, all_solid at fraction 0.
+/// </summary>
+bool check_hulls(
+    const bsp_map&                    map,
+    const std::vector<valve::aabb_t>& brushes,
+    const std::vector<std::int32_t>&  contents,
+    const std::vector<vector3>&       origins,
+    const std::vector<vector3>&       destinations
+)
+{
+    std::size_t probes     = 0;
+    std::size_t in_solid   = 0;
+    std::size_t mismatches = 0;
+
+    auto mismatch = [&]( const char* what, const vector3& origin, const valve::trace_t& trace )
+    {
+        if( mismatches++ < 10 ) {
+            std::printf( "[!] %s box at (%.9g %.9g %.9g): fraction %.9g, start_solid %d, all_solid %d\n",
+                         what,
+                         origin( 0 ), origin( 1 ), origin( 2 ),
+                         trace.fraction,
+                         trace.start_solid,
+                         trace.all_solid );
+        }
+    };
+
+    /// 1 inside a solid brush, -1 clear of every one, 0 touching one
+    auto classify = [&]( const vector3& mins, const vector3& maxs )
+    {
+        auto clear = true;
+        for( std::size_t i = 0; i < brushes.size(); ++i ) {
+            if( !( contents.at( i ) & valve::MASK_PLAYERSOLID ) ) {
+                continue;
+            }
+
+            const auto& brush   = brushes.at( i );
+            auto        overlap = std::numeric_limits<float>::max();
+            for( std::size_t k = 0; k < 3; ++k ) {
+                overlap = std::min( overlap, std::min( maxs( k ) - brush.mins( k ), brush.maxs( k ) - mins( k ) ) );
+            }
+            if( overlap > HULL_CHECK_MARGIN ) {
+                return 1;
+            }
+            clear &= overlap < -HULL_CHECK_MARGIN;
+        }
+        return clear ? -1 : 0;
+    };
+
+    for( std::size_t i = 0; i < origins.size(); ++i ) {
+        const auto& origin = origins.at( i );
+        const auto  inside = classify( origin + HULL_MINS, origin + HULL_MAXS );
+        if( !inside ) {
+            continue;
+        }
+
+        valve::trace_t trace;
+        map.trace_hull( origin, destinations.at( i ), HULL_MINS, HULL_MAXS, valve::MASK_PLAYERSOLID, &trace );
+        ++probes;
+        in_solid += inside > 0;
+        if( inside < 0 ? trace.start_solid || trace.all_solid : !trace.start_solid ) {
+            mismatch( inside < 0 ? "open space" : "start solid", origin, trace );
+        }
+    }
+
+    const vector3 extents( 1.f, 1.f, 1.f );
+    for( std::size_t i = 0; i < brushes.size(); ++i ) {
+        if( !( contents.at( i ) & valve::MASK_PLAYERSOLID ) ) {
+            continue;
+        }
+
+        const auto& brush  = brushes.at( i );
+        const auto  center = ( brush.mins + brush.maxs ) * 0.5f;
+
+        valve::trace_t trace;
+        map.trace_hull( center, center, extents * -1.f, extents, valve::MASK_PLAYERSOLID, &trace );
+        ++probes;
+        ++in_solid;
+        if( !trace.start_solid || !trace.all_solid || trace.fraction != 0.f ) {
+            mismatch( "brush center", center, trace );
+        }
+    }
+
+    std::printf( "hulls    %zu boxes, %zu started in solid, %zu mismatches\n", probes, in_solid, mismatches );
+    return !mismatches && in_solid < probes;
+}
+
+/// <summary>
+/// Runs every ray through trace_ray, trace_rays, is_visible and
+/// is_visible_batch of both backends and reports where they disagree. Every
+/// trace has to match exactly, across the backends and between trace_ray
+/// and trace_rays.
+/// Rays coming down onto the top of a pool have to stop at it, there's a
+/// face but no brush that stops them. false on any mismatch, on a ray that
+/// passes a pool's top or if none stopped at one while the map has pools.
+/// </summary>
+bool check_backends(
+    const bsp_map&                    tree,
+    const bsp_map&                    bvh,
+    const std::vector<valve::aabb_t>& pools,
+    const std::vector<vector3>&       origins,
+    const std::vector<vector3>&       destinations
+)
+{
+    std::size_t mismatches = 0;
+    std::size_t crossings  = 0;
+
+    auto mismatch = [&]( const char* what, const std::size_t i )
+    {
+        if( mismatches++ < 10 ) {
+            std::printf( "[!] %s differs for ray %zu (%.9g %.9g %.9g) -> (%.9g %.9g %.9g)\n",
+                         what,
+                         i,
+                         origins.at( i )( 0 ), origins.at( i )( 1 ), origins.at( i )( 2 ),
+                         destinations.at( i )( 0 ), destinations.at( i )( 1 ), destinations.at( i )( 2 ) );
+        }
+    };
+
+    std::array<valve::trace_t, BATCH_SIZE> tree_batch, bvh_batch;
+    std::array<bool, BATCH_SIZE>           tree_visible, bvh_visible;
+    for( std::size_t first = 0; first < origins.size(); first += BATCH_SIZE ) {
+        const auto count = std::min( BATCH_SIZE, origins.size() - first );
+        tree.trace_rays( origins.data() + first, destinations.data() + first, count, tree_batch.data() );
+        bvh.trace_rays( origins.data() + first, destinations.data() + first, count, bvh_batch.data() );
+        tree.is_visible_batch( origins.data() + first, destinations.data() + first, count, tree_visible.data() );
+        bvh.is_visible_batch( origins.data() + first, destinations.data() + first, count, bvh_visible.data() );
+
+        for( std::size_t j = 0; j < count; ++j ) {
+            const auto     i = first + j;
+            valve::trace_t tree_trace, bvh_trace;
+            tree.trace_ray( origins.at( i ), destinations.at( i ), &tree_trace );
+            bvh.trace_ray( origins.at( i ), destinations.at( i ), &bvh_trace );
+
+            const auto visible = tree.is_visible( origins.at( i ), destinations.at( i ) );
+            if( !same_trace( tree_trace, tree_batch.at( j ) ) || !same_trace( bvh_trace, bvh_batch.at( j ) ) ) {
+                mismatch( "trace_rays", i );
+            }
+            else if( !same_trace( tree_trace, bvh_trace ) ) {
+                mismatch( "trace_ray", i );
+            }
+            else if( visible != bvh.is_visible( origins.at( i ), destinations.at( i ) )
+                     || visible != tree_visible.at( j )
+                     || visible != bvh_visible.at( j ) ) {
+                mismatch( "is_visible", i );
+            }
+
+            /// a ray starting in a pillar may pass the top of the pool it stands in before it got out
+            const auto crossing = water_crossing( pools, origins.at( i ), destinations.at( i ) );
+            if( crossing > tree_trace.fraction_left_solid && crossing < tree_trace.fraction && tree_trace.surface < 0 ) {
+                mismatch( "water surface", i );
+            }
+            crossings += tree_trace.surface >= 0;
+        }
+    }
+
+    std::printf( "check    %zu rays, %zu stopped at a water surface, %zu mismatches\n",
+                 origins.size(),
+                 crossings,
+                 mismatches );
+    return !mismatches && ( pools.empty() || crossings );
+}
+
+void print_usage()
+{
+    std::printf(
+        "usage: bsp-bench [options]\n"
+        "  --rays N          rays per benchmark (1000000)\n"
+        "  --threads A,B,... thread counts to run with (1 and every hardware thread)\n"
+        "  --repeat N        runs per benchmark, the fastest is reported (3)\n"
+        "  --backend NAME    bsp, bvh or both (both)\n"
+        "  --rooms N         synthetic map with N x N rooms (8)\n"
+        "  --pillars N       pillars per room (4)\n"
+        "  --seed N          seed of the map layout and the rays (1)\n"
+        "  --lzma            LZMA compress the synthetic map's lumps\n"
+        "  --keep            write the synthetic map to the working directory and keep it\n"
+        "  --check           compare the backends' results on every ray instead of timing them\n"
+        "  --map FILE        trace an existing .bsp, rays span its world model\n" );
+}
+
+bool parse_arguments(
+    const int      argc,
+    char**         argv,
+    bench_options& options
+)
+{
+    for( auto i = 1; i < argc; ++i ) {
+        const std::string argument = argv[ i ];
+        const auto*       value    = i + 1 < argc ? argv[ i + 1 ] : nullptr;
+
+        auto number = [&]( std::size_t& out )
+        {
+            if( !value ) {
+                return false;
+            }
+            out = std::strtoull( value, nullptr, 10 );
+            ++i;
+            return true;
+        };
+
+        std::size_t parsed = 0;
+        if( argument == "--rays" && number( options.rays ) ) {
+            continue;
+        }
+        if( argument == "--repeat" && number( options.repeat ) ) {
+            continue;
+        }
+        if( argument == "--rooms" && number( parsed ) ) {
+            options.map.rooms_x = static_cast<std::uint32_t>( parsed );
+            options.map.rooms_y = static_cast<std::uint32_t>( parsed );
+            continue;
+        }
+        if( argument == "--pillars" && number( parsed ) ) {
+            options.map.pillars = static_cast<std::uint32_t>( parsed );
+            continue;
+        }
+        if( argument == "--seed" && number( parsed ) ) {
+            options.map.seed = static_cast<std::uint32_t>( parsed );
+            continue;
+        }
+        if( argument == "--threads" && value ) {
+            options.threads.clear();
+            for( const auto* text = value; *text; ) {
+                char* end = nullptr;
+                options.threads.push_back( std::max<std::size_t>( std::strtoull( text, &end, 10 ), 1 ) );
+                text = *end ? end + 1 : end;
+            }
+            ++i;
+            continue;
+        }
+        if( argument == "--backend" && value ) {
+            const std::string name = value;
+            if( name == "bsp" ) {
+                options.backends = { trace_backend::bsp_tree };
+            }
+            else if( name == "bvh" ) {
+                options.backends = { trace_backend::brush_bvh };
+            }
+            else if( name != "both" ) {
+                return false;
+            }
+            ++i;
+            continue;
+        }
+        if( argument == "--map" && value ) {
+            options.map_file = value;
+            ++i;
+            continue;
+        }
+        if( argument == "--lzma" ) {
+            options.map.compress_lumps = true;
+            continue;
+        }
+        if( argument == "--keep" ) {
+            options.keep = true;
+            continue;
+        }
+        if( argument == "--check" ) {
+            options.check = true;
+            continue;
+        }
+        return false;
+    }
+
+    if( options.threads.empty() ) {
+        options.threads.push_back( 1 );
+        const auto hardware = static_cast<std::size_t>( std::thread::hardware_concurrency() );
+        if( hardware > 1 ) {
+            options.threads.push_back( hardware );
+        }
+    }
+    return options.rays > 0;
+}
+}
+
+int main(
+    int    argc,
+    char** argv
+)
+{
+    bench_options options;
+    if( !parse_arguments( argc, argv, options ) ) {
+        print_usage();
+        return 1;
+    }
+
+    std::vector<valve::aabb_t> rooms;
+    std::vector<valve::aabb_t> brushes, pools;
+    std::vector<std::int32_t>  contents;
+    std::uint32_t              rooms_x = 1;
+    std::filesystem::path      map_file;
+
+    if( options.map_file.empty() ) {
+        map_file = options.keep
+            ? std::filesystem::current_path() / "bsp-bench.bsp"
+            : std::filesystem::temp_directory_path() / "bsp-bench.bsp";
+
+        bench::synthetic_map_info info;
+        const auto                start = std::chrono::steady_clock::now();
+        if( !bench::write_synthetic_map( map_file.string(), options.map, &info ) ) {
+            std::printf( "[!] failed to write the synthetic map to %s\n", map_file.string().data() );
+            return 1;
+        }
+        const auto elapsed = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+        std::printf( "map      %ux%u rooms, %zu brushes, %zu nodes, %zu leaves, %zu faces, %zu bytes%s, generated in %.1f ms\n",
+                     options.map.rooms_x,
+                     options.map.rooms_y,
+                     info.num_brushes,
+                     info.num_nodes,
+                     info.num_leaves,
+                     info.num_faces,
+                     info.file_size,
+                     options.map.compress_lumps ? " lzma" : "",
+                     elapsed );
+
+        rooms    = std::move( info.rooms );
+        brushes  = std::move( info.brushes );
+        pools    = std::move( info.pools );
+        contents = std::move( info.contents );
+        rooms_x  = options.map.rooms_x;
+    }
+    else {
+        map_file = options.map_file;
+    }
+
+    auto remove_map = [&options, &map_file]
+    {
+        if( options.map_file.empty() && !options.keep ) {
+            std::error_code error;
+            std::filesystem::remove( map_file, error );
+        }
+    };
+
+    auto load_map = [&]( const trace_backend backend, bsp_map& map, std::vector<vector3>& origins, std::vector<vector3>& destinations )
+    {
+        load_options load;
+        load.backend = backend;
+
+        const auto start = std::chrono::steady_clock::now();
+        if( !map.load( map_file.parent_path().string(), map_file.filename().string(), load ) ) {
+            std::printf( "[!] failed to load %s\n", map_file.string().data() );
+            return -1.0;
+        }
+        const auto elapsed = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+        /// existing maps get their rays anywhere inside the world model
+        if( rooms.empty() ) {
+            if( map.models.empty() ) {
+                std::printf( "[!] %s has no world model to place rays in\n", map_file.string().data() );
+                return -1.0;
+            }
+            valve::aabb_t world;
+            world.mins = map.models.front().mins;
+            world.maxs = map.models.front().maxs;
+            rooms.push_back( world );
+        }
+
+        make_rays( rooms, rooms_x, options.map.seed, options.rays, origins, destinations );
+        return elapsed;
+    };
+
+    if( options.check ) {
+        bsp_map              tree, bvh;
+        std::vector<vector3> origins, destinations;
+        const auto           loaded = load_map( trace_backend::bsp_tree, tree, origins, destinations ) >= 0.0
+            && load_map( trace_backend::brush_bvh, bvh, origins, destinations ) >= 0.0;
+        const auto           agree  = loaded
+            && check_backends( tree, bvh, pools, origins, destinations )
+            && ( brushes.empty() || check_hulls( tree, brushes, contents, origins, destinations ) );
+        remove_map();
+        return agree ? 0 : 1;
+    }
+
+    for( const auto backend : options.backends ) {
+        bsp_map              map;
+        std::vector<vector3> origins, destinations;
+        const auto           elapsed = load_map( backend, map, origins, destinations );
+        if( elapsed < 0.0 ) {
+            remove_map();
+            return 1;
+        }
+        const auto* const name = backend == trace_backend::brush_bvh ? "bvh" : "bsp";
+
+        std::printf( "load     %s backend in %.2f ms, %zu bytes resident\n\n", name, elapsed, map.memory_usage() );
+        std::printf( "%-20s %-10s %7s %10s %12s %10s %9s\n", "benchmark", "backend", "threads", "rays", "Mrays/s", "ns/ray", "hits" );
+        run_benchmarks( map, name, options, origins, destinations );
+        std::printf( "\n" );
+    }
+
+    remove_map();
+    return 0;
+}
@@ -0,0 +1,772 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include "synthetic_map.hpp"
+#include <LzmaLib.h>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <random>
+
+using namespace rn;
+
+namespace {
+/// <summary>
+/// How far past a face it is probed for open space
+/// </summary>
+constexpr float FACE_PROBE_DISTANCE = 1.f;
+
+/// <summary>
+/// Encoder settings of the compressed lumps, what the engine's own
+/// compressed maps use
+/// </summary>
+constexpr int      LZMA_LEVEL     = 5;
+constexpr unsigned LZMA_DICT_SIZE = 1u << 24;
+
+/// <summary>
+/// true if the boxes share some volume, not just a side
+/// </summary>
+bool overlaps_volume(
+    const valve::aabb_t& lhs,
+    const valve::aabb_t& rhs
+)
+{
+    for( std::size_t k = 0; k < 3; ++k ) {
+        if( lhs.mins( k ) >= rhs.maxs( k ) || lhs.maxs( k ) <= rhs.mins( k ) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// <summary>
+/// true if the flat face covers some area of the region's boundary or
+/// inside, touching it with an edge doesn't count
+/// </summary>
+bool overlaps_face(
+    const valve::aabb_t& face,
+    const valve::aabb_t& region
+)
+{
+    for( std::size_t k = 0; k < 3; ++k ) {
+        if( face.mins( k ) == face.maxs( k ) ) {
+            if( face.mins( k ) < region.mins( k ) || face.mins( k ) > region.maxs( k ) ) {
+                return false;
+            }
+        }
+        else if( face.mins( k ) >= region.maxs( k ) || face.maxs( k ) <= region.mins( k ) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool contains(
+    const valve::aabb_t& outer,
+    const valve::aabb_t& inner
+)
+{
+    for( std::size_t k = 0; k < 3; ++k ) {
+        if( inner.mins( k ) < outer.mins( k ) || inner.maxs( k ) > outer.maxs( k ) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+valve::aabb_t make_box(
+    const float min_x,
+    const float min_y,
+    const float min_z,
+    const float max_x,
+    const float max_y,
+    const float max_z
+)
+{
+    valve::aabb_t box;
+    box.mins = vector3( min_x, min_y, min_z );
+    box.maxs = vector3( max_x, max_y, max_z );
+    return box;
+}
+
+std::array<std::int16_t, 3> to_short(
+    const vector3& value
+)
+{
+    std::array<std::int16_t, 3> out{};
+    for( std::size_t k = 0; k < 3; ++k ) {
+        out.at( k ) = static_cast<std::int16_t>( std::clamp( value( k ), -32768.f, 32767.f ) );
+    }
+    return out;
+}
+
+/// <summary>
+/// Collects the lumps of one synthetic map, every brush is an axis aligned box
+/// </summary>
+class map_builder
+{
+public:
+    explicit map_builder(
+        const rn::bench::synthetic_map_options& options
+    )
+        : _options( options )
+    { }
+
+    bool build(
+        rn::bench::synthetic_map_info& info
+    )
+    {
+        const auto size      = _options.room_size;
+        const auto height    = _options.room_height;
+        const auto half_wall = _options.wall_thickness * 0.5f;
+        const auto rooms_x   = _options.rooms_x;
+        const auto rooms_y   = _options.rooms_y;
+
+        info.bounds = make_box( -half_wall,
+                                -half_wall,
+                                -_options.wall_thickness,
+                                static_cast<float>( rooms_x ) * size + half_wall,
+                                static_cast<float>( rooms_y ) * size + half_wall,
+                                height + _options.wall_thickness );
+        for( std::size_t k = 0; k < 3; ++k ) {
+            if( info.bounds.mins( k ) < -32768.f || info.bounds.maxs( k ) > 32767.f ) {
+                return false;
+            }
+        }
+
+        std::mt19937                          random( _options.seed );
+        std::uniform_real_distribution<float> unit( 0.f, 1.f );
+
+        /// floors, ceilings and the open space they enclose
+        for( std::uint32_t y = 0; y < rooms_y; ++y ) {
+            for( std::uint32_t x = 0; x < rooms_x; ++x ) {
+                const auto left   = static_cast<float>( x ) * size;
+                const auto bottom = static_cast<float>( y ) * size;
+                add_box( make_box( left, bottom, -_options.wall_thickness, left + size, bottom + size, 0.f ) );
+                add_box( make_box( left, bottom, height, left + size, bottom + size, height + _options.wall_thickness ) );
+                info.rooms.push_back( make_box( left + half_wall, bottom + half_wall, 0.f, left + size - half_wall, bottom + size - half_wall, height ) );
+            }
+        }
+
+        /// walls along both axes, inner ones maybe with a doorway in the middle
+        for( std::size_t axis = 0; axis < 2; ++axis ) {
+            const auto lines    = axis ? rooms_y : rooms_x;
+            const auto segments = axis ? rooms_x : rooms_y;
+            for( std::uint32_t line = 0; line <= lines; ++line ) {
+                for( std::uint32_t segment = 0; segment < segments; ++segment ) {
+                    const auto across = static_cast<float>( line ) * size;
+                    const auto first  = static_cast<float>( segment ) * size - half_wall;
+                    const auto last   = static_cast<float>( segment + 1 ) * size + half_wall;
+                    const auto inner  = line > 0 && line < lines;
+
+                    if( !inner || unit( random ) >= _options.door_chance ) {
+                        add_wall( axis, across, first, last, 0.f, height );
+                        continue;
+                    }
+
+                    const auto center = ( static_cast<float>( segment ) + 0.5f ) * size;
+                    const auto door   = _options.door_width * 0.5f;
+                    add_wall( axis, across, first, center - door, 0.f, height );
+                    add_wall( axis, across, center + door, last, 0.f, height );
+                    add_wall( axis, across, center - door, center + door, _options.door_height, height );
+                }
+            }
+        }
+
+        /// pillars, some up to the ceiling and some free standing
+        for( const auto& room : info.rooms ) {
+            for( std::uint32_t i = 0; i < _options.pillars; ++i ) {
+                const auto width = 32.f + unit( random ) * 64.f;
+                const auto top   = unit( random ) < 0.5f ? height : height * ( 0.25f + unit( random ) * 0.5f );
+                const auto x     = room.mins( 0 ) + 16.f + unit( random ) * ( room.maxs( 0 ) - room.mins( 0 ) - 32.f - width );
+                const auto y     = room.mins( 1 ) + 16.f + unit( random ) * ( room.maxs( 1 ) - room.mins( 1 ) - 32.f - width );
+                add_box( make_box( std::floor( x ), std::floor( y ), 0.f, std::floor( x + width ), std::floor( y + width ), std::floor( top ) ) );
+            }
+        }
+
+        /// pools filling the floor of a room, the pillars stand in them
+        for( const auto& room : info.rooms ) {
+            if( unit( random ) < _options.water_chance ) {
+                const auto pool = make_box( room.mins( 0 ), room.mins( 1 ), 0.f, room.maxs( 0 ), room.maxs( 1 ), _options.water_depth );
+                add_box( pool, valve::CONTENTS_WATER );
+                info.pools.push_back( pool );
+            }
+        }
+
+        /// brushes and planes are referenced by 16 bit indices
+        if( _boxes.size() > std::numeric_limits<std::uint16_t>::max()
+            || planes.size() > std::numeric_limits<std::uint16_t>::max() ) {
+            return false;
+        }
+
+        build_faces();
+
+        std::vector<std::uint32_t> all_brushes( _boxes.size() ), all_faces( faces.size() );
+        std::iota( all_brushes.begin(), all_brushes.end(), 0u );
+        std::iota( all_faces.begin(), all_faces.end(), 0u );
+
+        nodes.emplace_back();
+        if( build_node( 0, info.bounds, all_brushes, all_faces ) < 0 || _overflow ) {
+            return false;
+        }
+
+        build_visibility();
+        build_entities( info );
+
+        valve::dmodel_t world{};
+        world.mins      = info.bounds.mins;
+        world.maxs      = info.bounds.maxs;
+        world.origin    = vector3( 0.f, 0.f, 0.f );
+        world.num_faces = static_cast<std::int32_t>( faces.size() );
+        models.push_back( world );
+
+        /// texinfo 0 is left unused, faces referencing it aren't traced
+        tex_infos.resize( 2 );
+
+        info.brushes     = _boxes;
+        info.contents    = _contents;
+        info.num_brushes = brushes.size();
+        info.num_nodes   = nodes.size();
+        info.num_leaves  = leaves.size();
+        info.num_faces   = faces.size();
+        return true;
+    }
+
+private:
+    /// <summary>
+    /// The positive plane of an axis, its flipped twin follows right after it
+    /// </summary>
+    std::uint16_t axial_plane(
+        const std::size_t axis,
+        const float       distance
+    )
+    {
+        const auto key = std::make_pair( axis, distance );
+        const auto it  = _plane_ids.find( key );
+        if( it != _plane_ids.end() ) {
+            return it->second;
+        }
+
+        valve::dplane_t plane{};
+        plane.normal         = vector3( 0.f, 0.f, 0.f );
+        plane.normal( axis ) = 1.f;
+        plane.distance       = distance;
+        plane.type           = static_cast<std::int32_t>( axis );
+        planes.push_back( plane );
+
+        plane.normal( axis ) = -1.f;
+        plane.distance       = -distance;
+        planes.push_back( plane );
+
+        const auto index = static_cast<std::uint16_t>( planes.size() - 2 );
+        _plane_ids.emplace( key, index );
+        return index;
+    }
+
+    void add_box(
+        const valve::aabb_t& box,
+        const std::int32_t   contents = valve::CONTENTS_SOLID
+    )
+    {
+        valve::dbrush_t brush{};
+        brush.first_side = static_cast<std::int32_t>( brush_sides.size() );
+        brush.num_sides  = 6;
+        brush.contents   = contents;
+
+        for( std::size_t k = 0; k < 3; ++k ) {
+            valve::dbrushside_t side{};
+            side.tex_info  = 1;
+            side.disp_info = -1;
+
+            side.plane_num = axial_plane( k, box.maxs( k ) );
+            brush_sides.push_back( side );
+            side.plane_num = static_cast<std::uint16_t>( axial_plane( k, box.mins( k ) ) + 1 );
+            brush_sides.push_back( side );
+        }
+
+        brushes.push_back( brush );
+        _boxes.push_back( box );
+        _contents.push_back( contents );
+    }
+
+    void add_wall(
+        const std::size_t axis,
+        const float       across,
+        const float       first,
+        const float       last,
+        const float       bottom,
+        const float       top
+    )
+    {
+        const auto half_wall = _options.wall_thickness * 0.5f;
+        if( axis ) {
+            add_box( make_box( first, across - half_wall, bottom, last, across + half_wall, top ) );
+        }
+        else {
+            add_box( make_box( across - half_wall, first, bottom, across + half_wall, last, top ) );
+        }
+    }
+
+    /// <summary>
+    /// true if a single solid box covers all of probe, a pillar standing on
+    /// part of a side leaves the rest of it in open space
+    /// </summary>
+    bool solid_over(
+        const valve::aabb_t& probe
+    ) const
+    {
+        for( std::size_t i = 0; i < _boxes.size(); ++i ) {
+            if( _contents.at( i ) == valve::CONTENTS_SOLID && contains( _boxes.at( i ), probe ) ) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// <summary>
+    /// One face per brush side that looks into open space (water counts as open), wound clockwise
+    /// seen from its front like the engine's
+    /// </summary>
+    void build_faces()
+    {
+        /// edge 0 can't be told apart from its reverse, the engine never uses it
+        edges.push_back( { { 0, 0 } } );
+
+        for( std::size_t brush = 0; brush < _boxes.size(); ++brush ) {
+            const auto& box = _boxes.at( brush );
+            for( std::size_t k = 0; k < 3; ++k ) {
+                for( std::size_t side = 0; side < 2; ++side ) {
+                    const auto u = ( k + 1 ) % 3;
+                    const auto v = ( k + 2 ) % 3;
+
+                    valve::aabb_t probe = box;
+                    probe.mins( k )     = side ? box.mins( k ) - FACE_PROBE_DISTANCE : box.maxs( k );
+                    probe.maxs( k )     = side ? box.mins( k ) : box.maxs( k ) + FACE_PROBE_DISTANCE;
+                    if( solid_over( probe ) || vertices.size() + 4 > std::numeric_limits<std::uint16_t>::max() ) {
+                        continue;
+                    }
+
+                    /// u x v points along +k, so counter-clockwise around +k is clockwise around -k
+                    std::array<std::array<float, 2>, 4> corners = { {
+                        { box.mins( u ), box.mins( v ) }, { box.mins( u ), box.maxs( v ) },
+                        { box.maxs( u ), box.maxs( v ) }, { box.maxs( u ), box.mins( v ) }
+                    } };
+                    if( side ) {
+                        std::reverse( corners.begin(), corners.end() );
+                    }
+
+                    valve::dface_t face{};
+                    face.plane_num             = static_cast<std::uint16_t>( axial_plane( k, side ? box.mins( k ) : box.maxs( k ) ) + side );
+                    face.side                  = static_cast<std::uint8_t>( side );
+                    face.first_edge            = static_cast<std::int32_t>( surf_edges.size() );
+                    face.num_edges             = 4;
+                    face.tex_info              = 1;
+                    face.disp_info             = -1;
+                    face.surface_fog_volume_id = -1;
+                    face.styles                = { 0, 255, 255, 255 };
+                    face.light_offset          = -1;
+                    face.area                  = ( box.maxs( u ) - box.mins( u ) ) * ( box.maxs( v ) - box.mins( v ) );
+                    face.orig_face             = -1;
+
+                    const auto first_vertex = static_cast<std::uint16_t>( vertices.size() );
+                    for( std::size_t i = 0; i < corners.size(); ++i ) {
+                        valve::mvertex_t vertex{};
+                        vertex.position( k ) = side ? box.mins( k ) : box.maxs( k );
+                        vertex.position( u ) = corners.at( i ).at( 0 );
+                        vertex.position( v ) = corners.at( i ).at( 1 );
+                        vertices.push_back( vertex );
+
+                        edges.push_back( { { static_cast<std::uint16_t>( first_vertex + i ),
+                                             static_cast<std::uint16_t>( first_vertex + ( i + 1 ) % corners.size() ) } } );
+                        surf_edges.push_back( static_cast<std::int32_t>( edges.size() - 1 ) );
+                    }
+
+                    valve::aabb_t bounds = box;
+                    bounds.mins( k )     = vertices.back().position( k );
+                    bounds.maxs( k )     = bounds.mins( k );
+
+                    faces.push_back( face );
+                    _face_bounds.push_back( bounds );
+                }
+            }
+        }
+    }
+
+    /// <summary>
+    /// Splits region at the brush side that keeps the children smallest until
+    /// no side cuts through it anymore, returns the child index of node or
+    /// leaf it became
+    /// </summary>
+    std::int32_t build_node(
+        const std::size_t                 depth,
+        const valve::aabb_t&              region,
+        const std::vector<std::uint32_t>& candidate_brushes,
+        const std::vector<std::uint32_t>& candidate_faces
+    )
+    {
+        /// like vbsp's, a leaf only lists the brushes it's inside of and the faces on its sides
+        std::vector<std::uint32_t> inside;
+        for( const auto brush : candidate_brushes ) {
+            if( overlaps_volume( _boxes.at( brush ), region ) ) {
+                inside.push_back( brush );
+            }
+        }
+
+        std::vector<std::uint32_t> faces_here;
+        for( const auto face : candidate_faces ) {
+            if( overlaps_face( _face_bounds.at( face ), region ) ) {
+                faces_here.push_back( face );
+            }
+        }
+
+        auto solid = false, water = false;
+        for( const auto brush : inside ) {
+            const auto inside_brush = contains( _boxes.at( brush ), region );
+            solid |= inside_brush && _contents.at( brush ) == valve::CONTENTS_SOLID;
+            water |= inside_brush && _contents.at( brush ) == valve::CONTENTS_WATER;
+        }
+
+        auto        best_cost  = std::numeric_limits<std::size_t>::max();
+        auto        best_value = 0.f;
+        std::size_t best_axis  = 0;
+        if( !solid ) {
+            for( std::size_t k = 0; k < 3; ++k ) {
+                std::vector<float> mins, maxs, values;
+                for( const auto brush : inside ) {
+                    const auto& box = _boxes.at( brush );
+                    mins.push_back( box.mins( k ) );
+                    maxs.push_back( box.maxs( k ) );
+                    for( const auto value : { box.mins( k ), box.maxs( k ) } ) {
+                        if( value > region.mins( k ) && value < region.maxs( k ) ) {
+                            values.push_back( value );
+                        }
+                    }
+                }
+                std::sort( mins.begin(), mins.end() );
+                std::sort( maxs.begin(), maxs.end() );
+                std::sort( values.begin(), values.end() );
+                values.erase( std::unique( values.begin(), values.end() ), values.end() );
+
+                const auto middle = ( region.mins( k ) + region.maxs( k ) ) * 0.5f;
+                for( const auto value : values ) {
+                    /// boxes reaching below and above value, the ones in both get split
+                    const auto back  = static_cast<std::size_t>( std::lower_bound( mins.begin(), mins.end(), value ) - mins.begin() );
+                    const auto front = static_cast<std::size_t>( maxs.end() - std::upper_bound( maxs.begin(), maxs.end(), value ) );
+                    const auto cost  = std::max( back, front ) + ( back + front - inside.size() );
+                    if( cost < best_cost
+                        || ( cost == best_cost && std::abs( value - middle ) < std::abs( best_value - ( region.mins( best_axis ) + region.maxs( best_axis ) ) * 0.5f ) ) ) {
+                        best_cost  = cost;
+                        best_value = value;
+                        best_axis  = k;
+                    }
+                }
+            }
+        }
+
+        if( best_cost == std::numeric_limits<std::size_t>::max() ) {
+            return -1 - add_leaf( region, solid ? valve::CONTENTS_SOLID : water ? valve::CONTENTS_WATER : valve::CONTENTS_EMPTY, inside, faces_here );
+        }
+
+        const auto node_index = depth ? nodes.size() : 0;
+        if( depth ) {
+            nodes.emplace_back();
+        }
+
+        auto front_region = region, back_region = region;
+        front_region.mins( best_axis ) = best_value;
+        back_region.maxs( best_axis )  = best_value;
+
+        const auto front = build_node( depth + 1, front_region, inside, faces_here );
+        const auto back  = build_node( depth + 1, back_region, inside, faces_here );
+
+        auto& node      = nodes.at( node_index );
+        node            = valve::dnode_t{};
+        node.plane_num  = axial_plane( best_axis, best_value );
+        node.children   = { front, back };
+        node.mins       = to_short( region.mins );
+        node.maxs       = to_short( region.maxs );
+        return static_cast<std::int32_t>( node_index );
+    }
+
+    std::int32_t add_leaf(
+        const valve::aabb_t&              region,
+        const std::int32_t                contents,
+        const std::vector<std::uint32_t>& brush_list,
+        const std::vector<std::uint32_t>& face_list
+    )
+    {
+        const auto solid = contents == valve::CONTENTS_SOLID;
+
+        valve::dleaf_t leaf{};
+        leaf.contents           = contents;
+        leaf.cluster            = solid ? -1 : static_cast<std::int16_t>( room_at( region ) );
+        leaf.mins               = to_short( region.mins );
+        leaf.maxs               = to_short( region.maxs );
+        leaf.leaf_water_data_id = -1;
+
+        /// the indices of a leaf have to start below 65536 and fit their count into 16 bits,
+        /// only open leaves see faces
+        const auto num_faces = solid ? std::size_t{ 0 } : face_list.size();
+        if( leaf_brushes.size() > std::numeric_limits<std::uint16_t>::max()
+            || leaf_faces.size() > std::numeric_limits<std::uint16_t>::max()
+            || brush_list.size() > std::numeric_limits<std::uint16_t>::max()
+            || num_faces > std::numeric_limits<std::uint16_t>::max() ) {
+            _overflow = true;
+            return 0;
+        }
+
+        leaf.first_leafbrush = static_cast<std::uint16_t>( leaf_brushes.size() );
+        leaf.num_leafbrushes = static_cast<std::uint16_t>( brush_list.size() );
+        for( const auto brush : brush_list ) {
+            leaf_brushes.push_back( static_cast<std::uint16_t>( brush ) );
+        }
+
+        leaf.first_leafface = static_cast<std::uint16_t>( leaf_faces.size() );
+        leaf.num_leaffaces  = static_cast<std::uint16_t>( num_faces );
+        for( std::size_t i = 0; i < num_faces; ++i ) {
+            leaf_faces.push_back( static_cast<std::uint16_t>( face_list.at( i ) ) );
+        }
+
+        leaves.push_back( leaf );
+        return static_cast<std::int32_t>( leaves.size() - 1 );
+    }
+
+    std::uint32_t room_at(
+        const valve::aabb_t& region
+    ) const
+    {
+        std::array<std::uint32_t, 2> cell{};
+        const std::array<std::uint32_t, 2> rooms = { _options.rooms_x, _options.rooms_y };
+        for( std::size_t k = 0; k < 2; ++k ) {
+            const auto center = ( region.mins( k ) + region.maxs( k ) ) * 0.5f / _options.room_size;
+            cell.at( k )      = static_cast<std::uint32_t>( std::clamp( center, 0.f, static_cast<float>( rooms.at( k ) - 1 ) ) );
+        }
+        return cell.at( 1 ) * _options.rooms_x + cell.at( 0 );
+    }
+
+    /// <summary>
+    /// dvis_t with run length encoded rows, a room sees its row, its column
+    /// and its neighbours
+    /// </summary>
+    void build_visibility()
+    {
+        const auto num_clusters = _options.rooms_x * _options.rooms_y;
+        const auto row_size     = ( num_clusters + 7 ) / 8;
+
+        auto write_i32 = [this]( const std::int32_t value, const std::size_t offset )
+        {
+            std::memcpy( visibility.data() + offset, &value, sizeof( value ) );
+        };
+
+        visibility.resize( sizeof( std::int32_t ) * ( 1 + 2 * num_clusters ) );
+        write_i32( static_cast<std::int32_t>( num_clusters ), 0 );
+
+        std::vector<std::uint8_t> row( row_size );
+        for( std::uint32_t from = 0; from < num_clusters; ++from ) {
+            std::fill( row.begin(), row.end(), std::uint8_t{ 0 } );
+            const auto from_x = static_cast<std::int32_t>( from % _options.rooms_x );
+            const auto from_y = static_cast<std::int32_t>( from / _options.rooms_x );
+            for( std::uint32_t to = 0; to < num_clusters; ++to ) {
+                const auto to_x = static_cast<std::int32_t>( to % _options.rooms_x );
+                const auto to_y = static_cast<std::int32_t>( to / _options.rooms_x );
+                if( from_x == to_x || from_y == to_y || ( std::abs( from_x - to_x ) <= 1 && std::abs( from_y - to_y ) <= 1 ) ) {
+                    row.at( to >> 3 ) |= static_cast<std::uint8_t>( 1u << ( to & 7 ) );
+                }
+            }
+
+            /// the pvs and pas share one row
+            const auto offset = static_cast<std::int32_t>( visibility.size() );
+            write_i32( offset, sizeof( std::int32_t ) * ( 1 + 2 * from ) );
+            write_i32( offset, sizeof( std::int32_t ) * ( 2 + 2 * from ) );
+
+            for( std::size_t i = 0; i < row.size(); ) {
+                if( row.at( i ) ) {
+                    visibility.push_back( row.at( i++ ) );
+                    continue;
+                }
+                std::size_t run = 0;
+                while( i < row.size() && !row.at( i ) && run < 255 ) {
+                    ++run;
+                    ++i;
+                }
+                visibility.push_back( 0 );
+                visibility.push_back( static_cast<std::uint8_t>( run ) );
+            }
+        }
+    }
+
+    void build_entities(
+        const rn::bench::synthetic_map_info& info
+    )
+    {
+        auto origin_of = []( const valve::aabb_t& room )
+        {
+            return std::to_string( ( room.mins( 0 ) + room.maxs( 0 ) ) * 0.5f ) + " "
+                + std::to_string( ( room.mins( 1 ) + room.maxs( 1 ) ) * 0.5f ) + " "
+                + std::to_string( room.mins( 2 ) + 1.f );
+        };
+
+        entities = "{\n\"classname\" \"worldspawn\"\n\"mapversion\" \"1\"\n}\n";
+        entities += "{\n\"classname\" \"info_player_start\"\n\"origin\" \"" + origin_of( info.rooms.front() ) + "\"\n}\n";
+        for( std::size_t i = 0; i < info.rooms.size(); ++i ) {
+            entities += "{\n\"classname\" \"info_target\"\n\"targetname\" \"room_" + std::to_string( i ) + "\"\n";
+            entities += "\"origin\" \"" + origin_of( info.rooms.at( i ) ) + "\"\n}\n";
+        }
+        entities.push_back( '\0' );
+    }
+
+public:
+    std::vector<valve::dplane_t>     planes;
+    std::vector<valve::dbrush_t>     brushes;
+    std::vector<valve::dbrushside_t> brush_sides;
+    std::vector<valve::dnode_t>      nodes;
+    std::vector<valve::dleaf_t>      leaves;
+    std::vector<std::uint16_t>       leaf_brushes;
+    std::vector<std::uint16_t>       leaf_faces;
+    std::vector<valve::mvertex_t>    vertices;
+    std::vector<valve::dedge_t>      edges;
+    std::vector<std::int32_t>        surf_edges;
+    std::vector<valve::dface_t>      faces;
+    std::vector<valve::texinfo_t>    tex_infos;
+    std::vector<valve::dmodel_t>     models;
+    std::vector<std::uint8_t>        visibility;
+    std::string                      entities;
+
+private:
+    const rn::bench::synthetic_map_options&                 _options;
+    std::map<std::pair<std::size_t, float>, std::uint16_t> _plane_ids;
+    std::vector<valve::aabb_t>                              _boxes;
+    std::vector<std::int32_t>                               _contents;
+    std::vector<valve::aabb_t>                              _face_bounds;
+    bool                                                    _overflow = false;
+};
+
+/// <summary>
+/// Appends data as lump index of header, LZMA compressed with the
+/// uncompressed size in its fourCC when compress is set and it pays off
+/// </summary>
+void write_lump(
+    std::vector<std::uint8_t>& file,
+    valve::dheader_t&          header,
+    const valve::lump_index    index,
+    const void*                data,
+    const std::size_t          size,
+    const bool                 compress
+)
+{
+    while( file.size() % 4 ) {
+        file.push_back( 0 );
+    }
+
+    auto& lump       = header.lumps.at( static_cast<std::size_t>( index ) );
+    lump.file_offset = static_cast<std::int32_t>( file.size() );
+    lump.file_size   = static_cast<std::int32_t>( size );
+    if( !size ) {
+        return;
+    }
+
+    const auto* bytes = static_cast<const std::uint8_t*>( data );
+    if( compress ) {
+        std::vector<std::uint8_t> compressed( size + size / 3 + 128 );
+        std::array<std::uint8_t, LZMA_PROPS_SIZE> properties{};
+
+        auto compressed_size  = compressed.size();
+        auto properties_size  = properties.size();
+        const auto result     = LzmaCompress( compressed.data(), &compressed_size, bytes, size,
+                                              properties.data(), &properties_size,
+                                              LZMA_LEVEL, LZMA_DICT_SIZE, 3, 0, 2, 32, 1 );
+        if( result == SZ_OK && compressed_size + sizeof( valve::lzma_header_t ) < size ) {
+            valve::lzma_header_t lzma_header{};
+            lzma_header.id         = ( 'A' << 24 ) + ( 'M' << 16 ) + ( 'Z' << 8 ) + 'L';
+            lzma_header.actualSize = static_cast<std::int32_t>( size );
+            lzma_header.lzmaSize   = static_cast<std::int32_t>( compressed_size );
+            std::memcpy( lzma_header.properties.data(), properties.data(), properties.size() );
+
+            const auto uncompressed_size = static_cast<std::int32_t>( size );
+            std::memcpy( lump.four_cc.data(), &uncompressed_size, sizeof( uncompressed_size ) );
+            lump.file_size = static_cast<std::int32_t>( sizeof( lzma_header ) + compressed_size );
+
+            const auto* header_bytes = reinterpret_cast<const std::uint8_t*>( &lzma_header );
+            file.insert( file.end(), header_bytes, header_bytes + sizeof( lzma_header ) );
+            file.insert( file.end(), compressed.begin(), compressed.begin() + static_cast<std::ptrdiff_t>( compressed_size ) );
+            return;
+        }
+    }
+
+    file.insert( file.end(), bytes, bytes + size );
+}
+
+template<typename type>
+void write_lump(
+    std::vector<std::uint8_t>& file,
+    valve::dheader_t&          header,
+    const valve::lump_index    index,
+    const std::vector<type>&   values,
+    const bool                 compress
+)
+{
+    write_lump( file, header, index, values.data(), values.size() * sizeof( type ), compress );
+}
+}
+
+bool bench::write_synthetic_map(
+    const std::string&           file_path,
+    const synthetic_map_options& options,
+    synthetic_map_info*          info
+)
+{
+    if( !options.rooms_x || !options.rooms_y
+        || options.rooms_x * options.rooms_y > valve::MAX_MAP_CLUSTERS
+        || options.wall_thickness <= 0.f
+        || options.room_size <= options.wall_thickness + 2.f * 16.f + 96.f
+        || options.door_height >= options.room_height
+        || ( options.water_chance > 0.f && ( options.water_depth <= 0.f || options.water_depth >= options.room_height ) ) ) {
+        return false;
+    }
+
+    synthetic_map_info local_info;
+    auto&              out = info ? *info : local_info;
+    out                    = {};
+
+    map_builder builder( options );
+    if( !builder.build( out ) ) {
+        return false;
+    }
+
+    valve::dheader_t header{};
+    header.ident        = ( 'P' << 24 ) + ( 'S' << 16 ) + ( 'B' << 8 ) + 'V';
+    header.version      = valve::BSPVERSION;
+    header.map_revision = 1;
+
+    std::vector<std::uint8_t> file( sizeof( header ) );
+
+    const auto compress = options.compress_lumps;
+    write_lump( file, header, valve::lump_index::entities, builder.entities.data(), builder.entities.size(), compress );
+    write_lump( file, header, valve::lump_index::planes, builder.planes, compress );
+    write_lump( file, header, valve::lump_index::vertices, builder.vertices, compress );
+    write_lump( file, header, valve::lump_index::visibility, builder.visibility, compress );
+    write_lump( file, header, valve::lump_index::nodes, builder.nodes, compress );
+    write_lump( file, header, valve::lump_index::tex_info, builder.tex_infos, compress );
+    write_lump( file, header, valve::lump_index::faces, builder.faces, compress );
+    write_lump( file, header, valve::lump_index::leafs, builder.leaves, compress );
+    write_lump( file, header, valve::lump_index::edges, builder.edges, compress );
+    write_lump( file, header, valve::lump_index::surfedges, builder.surf_edges, compress );
+    write_lump( file, header, valve::lump_index::models, builder.models, compress );
+    write_lump( file, header, valve::lump_index::leaf_faces, builder.leaf_faces, compress );
+    write_lump( file, header, valve::lump_index::leaf_brushes, builder.leaf_brushes, compress );
+    write_lump( file, header, valve::lump_index::brushes, builder.brushes, compress );
+    write_lump( file, header, valve::lump_index::brush_sides, builder.brush_sides, compress );
+    std::memcpy( file.data(), &header, sizeof( header ) );
+
+    std::ofstream stream( file_path, std::ios::binary | std::ios::trunc );
+    if( !stream.write( reinterpret_cast<const char*>( file.data() ), static_cast<std::streamsize>( file.size() ) ) ) {
+        return false;
+    }
+
+    out.file_size = file.size();
+    return true;
+}
@@ -0,0 +1,86 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#pragma once
+
+#include <valve-bsp-parser/core/valve_structs.hpp>
+
+namespace rn::bench {
+/// <summary>
+/// Layout of a synthetic map: a grid of rooms with floors, ceilings and
+/// walls between them, doorways through the walls and pillars inside
+/// </summary>
+struct synthetic_map_options
+{
+    std::uint32_t rooms_x        = 8;
+    std::uint32_t rooms_y        = 8;
+    float         room_size      = 512.f;
+    float         room_height    = 256.f;
+    /// <summary>
+    /// Also how long the corridor through a doorway is
+    /// </summary>
+    float         wall_thickness = 32.f;
+    float         door_width     = 96.f;
+    float         door_height    = 128.f;
+    /// <summary>
+    /// Share of the inner walls that get a doorway, 0 to 1
+    /// </summary>
+    float         door_chance    = 0.75f;
+    std::uint32_t pillars        = 4;
+    /// <summary>
+    /// Share of the rooms with a pool of water on the floor, 0 to 1. Water
+    /// brushes don't stop rays, rays coming from above stop at the face on
+    /// top of the pool.
+    /// </summary>
+    float         water_chance   = 0.25f;
+    float         water_depth    = 48.f;
+    std::uint32_t seed           = 1;
+    /// <summary>
+    /// Store every lump LZMA compressed like the engine's compressed maps
+    /// </summary>
+    bool          compress_lumps = false;
+};
+
+/// <summary>
+/// What write_synthetic_map produced, for picking ray end points
+/// </summary>
+struct synthetic_map_info
+{
+    valve::aabb_t              bounds;
+    /// <summary>
+    /// Open space of every room, rooms_x * rooms_y boxes row by row
+    /// </summary>
+    std::vector<valve::aabb_t> rooms;
+    /// <summary>
+    /// Box of every brush, in brush order
+    /// </summary>
+    std::vector<valve::aabb_t> brushes;
+    /// <summary>
+    /// Contents of every brush, in brush order
+    /// </summary>
+    std::vector<std::int32_t>  contents;
+    /// <summary>
+    /// Water brushes, their tops are faces with no solid brush behind
+    /// </summary>
+    std::vector<valve::aabb_t> pools;
+    std::size_t                num_brushes = 0;
+    std::size_t                num_nodes   = 0;
+    std::size_t                num_leaves  = 0;
+    std::size_t                num_faces   = 0;
+    std::size_t                file_size   = 0;
+};
+
+/// <summary>
+/// Writes a .bsp laid out like options to file_path. The tree is cut along
+/// the brush sides until every leaf is solid, water or empty, the visibility
+/// lump gives every room a cluster that sees its row, column and neighbours.
+/// false if the layout exceeds the .bsp limits or the file can't be written.
+/// </summary>
+bool write_synthetic_map(
+    const std::string&           file_path,
+    const synthetic_map_options& options,
+    synthetic_map_info*          info = nullptr
+);
+}
@@ -0,0 +1,988 @@
+﻿///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#pragma once
+
+#include <valve-bsp-parser/core/valve_structs.hpp>
+#include <valve-bsp-parser/core/entity_reader.hpp>
+#include <valve-bsp-parser/core/file_view.hpp>
+#include <valve-bsp-parser/core/load_profile.hpp>
+#include <valve-bsp-parser/core/thread_pool.hpp>
+#include <LzmaLib.h>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <cassert>
+#include <optional>
+
+namespace rn {
+/// <summary>
+/// How trace_ray and the batched traces find the brushes a ray crosses
+/// </summary>
+enum class trace_backend
+{
+    /// <summary>
+    /// Walk the BSP nodes and test the brushes of every leaf the ray passes
+    /// </summary>
+    bsp_tree,
+    /// <summary>
+    /// Walk a SAH BVH over the brush bounds, built at load. Cheaper for long
+    /// rays through open areas where the BSP walk visits many leaves.
+    /// </summary>
+    brush_bvh
+};
+
+struct load_options
+{
+    /// <summary>
+    /// How the .bsp and .lmp files are read, see file_access
+    /// </summary>
+    file_access  access   = file_access::memory_mapped;
+    /// <summary>
+    /// Decode independent lumps concurrently instead of one after another
+    /// </summary>
+    bool         parallel = true;
+    /// <summary>
+    /// Pool the lumps are decoded on, nullptr uses thread_pool::shared()
+    /// </summary>
+    thread_pool* pool     = nullptr;
+    /// <summary>
+    /// Directory baked maps are read from and written to, empty disables the
+    /// cache. A cache hit only restores the query structures, the raw vertices,
+    /// edges, surfedges, faces and texinfo lumps stay empty.
+    /// </summary>
+    std::string  cache_directory;
+    /// <summary>
+    /// Polled between load steps, the load gives up (and fails) once it
+    /// reads true. nullptr never cancels.
+    /// </summary>
+    const std::atomic<bool>* cancelled = nullptr;
+    /// <summary>
+    /// Collision bounds of a static prop model (models/props/....mdl), false
+    /// if the model shouldn't block traces. The .bsp doesn't carry model
+    /// bounds, without this props are parsed but never collide.
+    /// </summary>
+    std::function<bool( const std::string& model, vector3& mins, vector3& maxs )> prop_bounds;
+    /// <summary>
+    /// Tells map_registry which prop_bounds it is, loads with the same
+    /// non-empty key share a map. Without a key only a plain function
+    /// pointer is recognized, by its address, maps built with any other
+    /// callback aren't shared.
+    /// </summary>
+    std::string  prop_bounds_key;
+    /// <summary>
+    /// Ray trace backend of the loaded map, both report the same traces
+    /// </summary>
+    trace_backend backend = trace_backend::bsp_tree;
+    /// <summary>
+    /// Receives the per-lump sizes and timings and the load stages, nullptr
+    /// skips the bookkeeping. Overwritten by every load it is passed to,
+    /// bsp_parser::load_map leaves it alone if the map is already current.
+    /// </summary>
+    load_profile* profile = nullptr;
+};
+
+/// <summary>
+/// Lumps that are converted after decoding land here first. Each lump has
+/// its own buffer so they can be decoded concurrently, and the buffers keep
+/// their capacity when one scratch is handed to several loads.
+/// </summary>
+struct load_scratch
+{
+    std::vector<valve::dplane_t>    planes;
+    std::vector<valve::dnode_t>     nodes;
+    std::vector<std::uint8_t>       visibility;
+    std::vector<valve::ddispinfo_t> disp_infos;
+    std::vector<valve::dispvert_t>  disp_verts;
+};
+
+/// <summary>
+/// One parsed map. It is filled once by load and only read afterwards, so
+/// any number of threads can query it at the same time without locking.
+/// bsp_parser publishes maps as immutable snapshots of this.
+/// </summary>
+class bsp_map final
+{
+    /// <summary>
+    /// Box swept by trace_hull, as half extents around the segment start to
+    /// end its center travels. Brushes are clipped against the whole segment
+    /// so fractions stay relative to the full trace.
+    /// </summary>
+    struct hull_t
+    {
+        vector3      start;
+        vector3      end;
+        vector3      extents;
+        std::int32_t mask;
+    };
+
+    /// <summary>
+    /// Mailbox entry of one brush, the rays of the trace stamped into it
+    /// that already tested the brush
+    /// </summary>
+    struct brush_mark_t
+    {
+        std::uint32_t stamp;
+        std::uint32_t lanes;
+    };
+
+    /// <summary>
+    /// Ray walked by trace_ray and trace_packet. Like hull_t, brushes are
+    /// clipped against the whole ray. The rays of a packet share stamp and
+    /// tell their marks apart by lane.
+    /// </summary>
+    struct ray_t
+    {
+        vector3       start;
+        vector3       end;
+        std::uint32_t stamp;
+        std::uint32_t lane;
+        brush_mark_t* brush_marks;
+    };
+
+public:
+    bsp_map() = default;
+
+    ~bsp_map() = default;
+
+    bsp_map(
+        const bsp_map& rhs
+    ) = delete;
+
+    bsp_map& operator = (
+        const bsp_map& rhs
+    ) = delete;
+
+    bsp_map(
+        bsp_map&& rhs
+    ) noexcept = default;
+
+    bsp_map& operator = (
+        bsp_map&& rhs
+    ) noexcept = default;
+
+private:
+    bool load_file(
+        const std::string&  directory,
+        const std::string&  map_name,
+        const load_options& options
+    );
+
+    bool set_current_map(
+        const std::string& directory,
+        const std::string& map_name,
+        std::string&       file_path
+    );
+
+
+    bool parse_planes(
+        const file_view& file,
+        std::optional<valve::lumpfileheader_t> lumpFileHeader
+    );
+    /// <summary>
+    /// Reads the entity lump into entity_text and leaves the current
+    /// entities alone if that fails
+    /// </summary>
+    bool parse_entities(
+        const file_view& file,
+        std::optional<valve::lumpfileheader_t> lumpFileHeader
+    );
+
+    /// <summary>
+    /// Takes over text and the keyvalues viewing into it, entity i owns the
+    /// keyvalues up to entity_ends[ i ]
+    /// </summary>
+    void store_entities(
+        std::vector<char>&&                     text,
+        std::vector<valve::entity_keyvalue_t>&& keyvalues,
+        const std::vector<std::size_t>&         entity_ends
+    );
+
+    /// <summary>
+    /// Rebuilds entity_index from entities and models
+    /// </summary>
+    void build_entity_index();
+
+    bool parse_nodes(
+        const file_view& file,
+        std::optional<valve::lumpfileheader_t> lumpFileHeader
+    );
+
+    void build_nodes(
+        const std::vector<valve::dnode_t>& nodes
+    );
+
+    void link_nodes();
+
+    /// <summary>
+    /// Rebuilds brush_planes and brush_aabbs from brushes, brush_sides and
+    /// planes
+    /// </summary>
+    void build_brush_planes();
+
+    bool parse_leaffaces(
+        const file_view& file,
+        std::optional<valve::lumpfileheader_t> lumpFileHeader
+    );
+
+    bool parse_leafbrushes(
+        const file_view& file,
+        std::optional<valve::lumpfileheader_t> lumpFileHeader
+    ); 
+
+    /// <summary>
+    /// Reads the game lump directory into game_lumps
+    /// </summary>
+    bool parse_game_lump(
+        const file_view& file
+    );
+
+    /// <summary>
+    /// Copies the game lump with the given id into out, decompressing it when
+    /// it's flagged GAMELUMP_COMPRESSED. false if it's missing or broken.
+    /// </summary>
+    bool read_game_lump(
+        const file_view&           file,
+        std::int32_t               id,
+        std::vector<std::uint8_t>& out
+    ) const;
+
+    /// <summary>
+    /// Parses the sprp game lump and builds the prop boxes and their BVH
+    /// from options.prop_bounds
+    /// </summary>
+    bool parse_static_props(
+        const file_view&    file,
+        const load_options& options
+    );
+
+    void build_prop_bvh();
+
+    /// <summary>
+    /// Builds a BVH over the boxes [mins, maxs] into nodes and returns the
+    /// box order the leaves refer to. Splits at the median unless
+    /// surface_area_heuristic picks the cheapest of a few binned planes,
+    /// which it only does while the tree stays within valve::MAX_BVH_DEPTH.
+    /// </summary>
+    static std::vector<std::size_t> build_bvh(
+        const std::vector<vector3>&     mins,
+        const std::vector<vector3>&     maxs,
+        std::vector<valve::bvh_node_t>& nodes,
+        bool                            surface_area_heuristic = false
+    );
+
+    /// <summary>
+    /// Narrows [enter, leave] to the part of origin + t * delta that lies in
+    /// [mins - extents, maxs + extents], false once nothing is left
+    /// </summary>
+    static bool clip_to_box(
+        const vector3& origin,
+        const vector3& delta,
+        const vector3& extents,
+        const vector3& mins,
+        const vector3& maxs,
+        float&         enter,
+        float&         leave
+    );
+
+    /// <summary>
+    /// Turns the disp_info and disp_verts lumps into displacement meshes with
+    /// a quadtree each and builds the BVH over their bounds
+    /// </summary>
+    bool build_displacements();
+
+    void build_disp_bvh();
+
+    /// <summary>
+    /// Stops out at the first displacement triangle the ray hits before
+    /// out->fraction, only displacements whose bounds it crosses are tested
+    /// </summary>
+    void clip_to_displacements(
+        const vector3&  origin,
+        const vector3&  destination,
+        valve::trace_t* out
+    ) const;
+
+    void ray_cast_displacement(
+        std::size_t     disp_index,
+        const vector3&  origin,
+        const vector3&  delta,
+        valve::trace_t* out
+    ) const;
+
+    /// <summary>
+    /// Stops out at the first prop box the segment (swept by extents, zero
+    /// for rays) enters before out->fraction. Segments starting inside a
+    /// box pass through it.
+    /// </summary>
+    void clip_to_props(
+        const vector3&  origin,
+        const vector3&  destination,
+        const vector3&  extents,
+        valve::trace_t* out
+    ) const;
+
+    bool parse_visibility(
+        const file_view& file,
+        std::optional<valve::lumpfileheader_t> lumpFileHeader
+    );
+    
+    //bool parse_entities(
+    //    std::ifstream& file
+    //);
+
+    /// <summary>
+    /// Builds the polygons and their edge planes, the edge planes are spread
+    /// over pool (inline when nullptr). Displacement faces are left empty,
+    /// their base quads would occlude where the displaced surface doesn't.
+    /// </summary>
+    bool parse_polygons(
+        thread_pool* pool = nullptr
+    );
+
+    void build_edge_planes(
+        const valve::polygon& polygon
+    );
+
+    /// <summary>
+    /// Walks the trace nodes front to back with an explicit stack. Define
+    /// RN_BSP_PARSER_RECURSIVE_TRAVERSAL to build the recursive walk instead,
+    /// both produce identical traces.
+    /// </summary>
+    void ray_cast_node(
+        std::int32_t    node_index,
+        float           start_fraction,
+        float           end_fraction,
+        const vector3&  origin,
+        const vector3&  destination,
+        const ray_t&    ray,
+        valve::trace_t* out
+    ) const;
+
+    /// <summary>
+    /// Starts a ray from start to end with a fresh stamp in this thread's
+    /// brush mailbox
+    /// </summary>
+    NODISCARD
+    ray_t begin_ray(
+        const vector3& start,
+        const vector3& end
+    ) const;
+
+    /// <summary>
+    /// Index of the leaf point lies in, -1 without a tree
+    /// </summary>
+    NODISCARD
+    std::int32_t find_leaf(
+        const vector3& point
+    ) const;
+
+    NODISCARD
+    std::int32_t cluster_at(
+        const vector3& point
+    ) const;
+
+    void ray_cast_leaf(
+        std::size_t     leaf_index,
+        const ray_t&    ray,
+        valve::trace_t* out
+    ) const;
+
+    /// <summary>
+    /// Stops out where the ray crosses the polygon of surface_index from its
+    /// front, if that lies past fraction_left_solid and before out->fraction
+    /// </summary>
+    void ray_cast_surface(
+        std::size_t     surface_index,
+        const vector3&  origin,
+        const vector3&  destination,
+        valve::trace_t* out
+    ) const;
+
+    /// <summary>
+    /// Traces up to simd::float_v::width rays together, see trace_rays
+    /// </summary>
+    void trace_packet(
+        const vector3*  origins,
+        const vector3*  destinations,
+        std::size_t     count,
+        valve::trace_t* out
+    ) const;
+
+    /// <summary>
+    /// Bounds of the brush padded by BRUSH_BOUNDS_MARGIN, false if it has no
+    /// volume
+    /// </summary>
+    bool brush_bounds(
+        const valve::dbrush_t& brush,
+        vector3&               mins,
+        vector3&               maxs
+    ) const;
+
+    /// <summary>
+    /// Builds the SAH BVH over the brushes the BSP walk tests, for
+    /// trace_backend::brush_bvh
+    /// </summary>
+    void build_brush_bvh();
+
+    /// <summary>
+    /// Builds the BVH over the polygons some leaf lists, for
+    /// trace_backend::brush_bvh
+    /// </summary>
+    void build_face_bvh();
+
+    /// <summary>
+    /// Switches trace_ray to backend, building or dropping the brush and
+    /// face BVH
+    /// </summary>
+    void select_backend(
+        trace_backend backend
+    );
+
+    /// <summary>
+    /// The brush_bvh backend's counterpart of ray_cast_node( 0, ... )
+    /// </summary>
+    void ray_cast_bvh(
+        const vector3&  origin,
+        const vector3&  destination,
+        valve::trace_t* out
+    ) const;
+
+    /// <summary>
+    /// Face pass of ray_cast_bvh, tests the polygons whose bounds the ray
+    /// crosses before out->fraction
+    /// </summary>
+    void clip_to_faces(
+        const vector3&  origin,
+        const vector3&  destination,
+        valve::trace_t* out
+    ) const;
+
+    /// <summary>
+    /// Brush and face pass of trace_ray with the selected backend. A ray
+    /// starting in solid gets out where the brushes it started in, and every
+    /// brush it enters before leaving those, end. clip_to_brush only learns
+    /// that point as brushes come in and brushes seen earlier miss it, so the
+    /// pass is repeated from the grown fraction_left_solid until it stops
+    /// growing. That makes the result independent of the order the backends
+    /// visit brushes and faces in.
+    /// </summary>
+    void ray_cast_brushes(
+        const vector3&  origin,
+        const vector3&  destination,
+        valve::trace_t* out
+    ) const;
+
+    void ray_cast_brush(
+        const valve::dbrush_t* brush,
+        const vector3&         origin,
+        const vector3&         destination,
+        valve::trace_t*        out
+    ) const;
+
+    /// <summary>
+    /// Folds one brush's enter and leave fractions into out, shared by the
+    /// ray and the hull brush tests
+    /// </summary>
+    static void clip_to_brush(
+        const valve::dbrush_t* brush,
+        float                  fraction_to_enter,
+        float                  fraction_to_leave,
+        bool                   starts_out,
+        bool                   ends_out,
+        valve::trace_t*        out
+    );
+
+    void hull_cast_node(
+        std::int32_t    node_index,
+        float           start_fraction,
+        float           end_fraction,
+        const vector3&  origin,
+        const vector3&  destination,
+        const hull_t&   hull,
+        valve::trace_t* out
+    ) const;
+
+    void hull_cast_leaf(
+        std::size_t     leaf_index,
+        const hull_t&   hull,
+        valve::trace_t* out
+    ) const;
+
+    /// <summary>
+    /// Scalar brush test with every side pushed out by the box's support
+    /// distance. Unlike rays, boxes collide with the bevel sides too.
+    /// </summary>
+    void hull_cast_brush(
+        const valve::dbrush_t* brush,
+        const hull_t&          hull,
+        valve::trace_t*        out
+    ) const;
+
+    template<typename type>
+    NODISCARD
+    bool parse_lump(
+        const file_view&        file,
+        const valve::lump_index lump_index,
+        std::vector<type>&      out,
+        std::optional<valve::lumpfileheader_t> fileLump = std::nullopt
+    ) const
+    {
+        using rn::valve::lzma_header_t;
+        using rn::valve::has_valid_lzma_ident;
+        const auto index = static_cast<std::underlying_type_t<valve::lump_index>>( lump_index );
+
+
+
+        if( index >= bsp_header.lumps.size() ) {
+            return false;
+        }
+        //Default behavior is casting data to underlying types.
+
+
+        //There are two exceptions though: Game lumps (35) (yes, multiple; compressed individually), and PAK Lump (40) (basically a zip file)
+
+
+        const auto& lump = bsp_header.lumps.at( index );
+
+        std::size_t lumpOffset,lumpSize;
+
+        valve::lumpfileheader_t lumpPatch;
+        if (fileLump.has_value()) {
+               lumpPatch = fileLump.value();
+               lumpOffset = static_cast<std::size_t>( lumpPatch.file_offset );
+               lumpSize = static_cast<std::size_t>( lumpPatch.file_size );
+        } else {
+
+            lumpOffset = static_cast<std::size_t>( lump.file_offset );
+            lumpSize = static_cast<std::size_t>( lump.file_size );
+        }
+
+        if( !lumpSize ) {
+            out.clear();
+            return true;
+        }
+
+        //Read and decompress time go to the lump profiled on this thread, if any.
+        auto* const profiled  = lump_timer::current();
+        auto        timestamp = profiled ? load_profile::clock::now() : load_profile::clock::time_point{};
+
+        lzma_header_t lzma_header{};
+        if( lumpSize >= sizeof( lzma_header ) && !file.read_object( lumpOffset, lzma_header ) ) {
+            return false;
+        }
+
+        if (has_valid_lzma_ident(lzma_header.id))
+        {
+            assert(lump_index != valve::lump_index::game_lump && lump_index != valve::lump_index::pak_file); //Those have special rules regarding compression.
+
+            //Validate the header before anything gets allocated, a broken lump must not make us reserve gigabytes.
+            if( lzma_header.actualSize <= 0 || lzma_header.lzmaSize <= 0 ) {
+                return false;
+            }
+
+            const auto compressedSize = static_cast<std::size_t>( lzma_header.lzmaSize );
+            const auto actualSize     = static_cast<std::size_t>( lzma_header.actualSize );
+            if( compressedSize > lumpSize - sizeof( lzma_header_t )
+                || actualSize > valve::MAX_LUMP_UNCOMPRESSED_SIZE
+                || actualSize % sizeof( type ) != 0 ) {
+                return false;
+            }
+
+            //Compressed lumps in the .bsp carry their uncompressed size in the fourCC field.
+            if( !fileLump.has_value() ) {
+                std::int32_t expectedSize;
+                std::memcpy( &expectedSize, lump.four_cc.data(), sizeof( expectedSize ) );
+                if( expectedSize && expectedSize != lzma_header.actualSize ) {
+                    return false;
+                }
+            }
+
+            //Mapped files decompress straight out of the mapping, buffered reads go through a reused per-thread scratch.
+            auto& compressedBuffer = read_scratch();
+            const auto* compressed = file.read( lumpOffset + sizeof( lzma_header_t ), compressedSize, compressedBuffer );
+            if( !compressed ) {
+                return false;
+            }
+            if( profiled ) {
+                profiled->compressed_bytes += lumpSize;
+                profiled->read_ns          += load_profile::lap( timestamp );
+            }
+
+            //Decode directly into the lump storage, no intermediate buffer and no second copy.
+            out.resize( actualSize / sizeof( type ) );
+
+            std::size_t srcLen  = compressedSize;
+            std::size_t destLen = actualSize;
+            const auto result   = LzmaUncompress( static_cast<unsigned char*>( static_cast<void*>( out.data() ) ),
+                                                  &destLen,
+                                                  compressed,
+                                                  &srcLen,
+                                                  reinterpret_cast<const unsigned char*>( lzma_header.properties.data() ),
+                                                  LZMA_PROPS_SIZE );
+            if( result != SZ_OK || destLen != actualSize ) {
+                out.clear();
+                return false;
+            }
+            if( profiled ) {
+                profiled->uncompressed_bytes += actualSize;
+                profiled->decompress_ns      += load_profile::lap( timestamp );
+            }
+        }
+        else
+        {
+            //Single copy straight out of the file into the lump storage.
+            out.resize( lumpSize / sizeof( type ) );
+            if( !file.copy( lumpOffset, out.size() * sizeof( type ), static_cast<void*>( out.data() ) ) ) {
+                out.clear();
+                return false;
+            }
+            if( profiled ) {
+                profiled->compressed_bytes   += lumpSize;
+                profiled->uncompressed_bytes += lumpSize;
+                profiled->read_ns            += load_profile::lap( timestamp );
+            }
+        }
+
+        return true;
+    }
+
+    /// <summary>
+    /// Per-thread buffer compressed lumps are read into when the file isn't
+    /// mapped, reused across lumps and map loads
+    /// </summary>
+    static std::vector<std::uint8_t>& read_scratch();
+
+    /// <summary>
+    /// Path of the index-th standalone lump file (maps/de_dust2_l_0.lmp, ...)
+    /// </summary>
+    static std::string lump_patch_path(
+        const std::string& file_path,
+        std::size_t        index
+    );
+
+    NODISCARD
+    std::uint64_t compute_content_hash(
+        const file_view&   file,
+        const std::string& file_path,
+        file_access        access
+    ) const;
+
+    /// <summary>
+    /// <map stem>-<hash of the absolute map path>.baked in cache_directory,
+    /// maps of the same name in different directories get their own file
+    /// </summary>
+    NODISCARD
+    static std::string baked_path(
+        const std::string& cache_directory,
+        const std::string& file_path
+    );
+
+    bool load_baked(
+        const std::string& file_path,
+        std::uint64_t      content_hash,
+        file_access        access
+    );
+
+public:
+    /// <summary>
+    /// Parses map_name from directory (or restores it from the baked cache).
+    /// scratch is reused for the intermediate lump buffers, nullptr uses a
+    /// temporary one. Must not be called while the map is being queried.
+    /// </summary>
+    bool load(
+        const std::string&  directory,
+        const std::string&  map_name,
+        const load_options& options = {},
+        load_scratch*       scratch = nullptr
+    );
+
+    /// <summary>
+    /// Rays whose end points sit in clusters that can't see each other are
+    /// rejected through the PVS without being traced
+    /// </summary>
+    bool is_visible(
+        const vector3& origin,
+        const vector3& destination
+    ) const;
+
+    /// <summary>
+    /// Visibility cluster the point lies in, -1 when it's in no cluster
+    /// (solid, outside the map) or no map is loaded
+    /// </summary>
+    std::int32_t point_cluster(
+        const vector3& point
+    ) const;
+
+    /// <summary>
+    /// Index into leaves of the leaf point lies in, -1 without a tree
+    /// </summary>
+    NODISCARD
+    std::int32_t point_leaf(
+        const vector3& point
+    ) const;
+
+    /// <summary>
+    /// Contents of the leaf point lies in, masked with mask. 0 without a tree.
+    /// </summary>
+    NODISCARD
+    std::int32_t point_contents(
+        const vector3& point,
+        std::int32_t   mask = valve::MASK_ALL
+    ) const;
+
+    /// <summary>
+    /// point_leaf for count points. Several points walk the tree in turns, a
+    /// point that reaches its leaf hands its slot to the next one, so the
+    /// node fetches of different points overlap.
+    /// </summary>
+    void point_leaf_batch(
+        const vector3* points,
+        std::size_t    count,
+        std::int32_t*  out
+    ) const;
+
+    /// <summary>
+    /// point_contents for count points, see point_leaf_batch
+    /// </summary>
+    void point_contents_batch(
+        const vector3* points,
+        std::size_t    count,
+        std::int32_t   mask,
+        std::int32_t*  out
+    ) const;
+
+    void trace_ray(
+        const vector3&  origin,
+        const vector3&  final,
+        valve::trace_t* out
+    ) const;
+
+    /// <summary>
+    /// Sweeps the box mins..maxs (relative to origin) from origin to final
+    /// against the brushes whose contents match mask, like the engine's box
+    /// TraceRay. end_pos is where origin ends up.
+    /// </summary>
+    void trace_hull(
+        const vector3&  origin,
+        const vector3&  final,
+        const vector3&  mins,
+        const vector3&  maxs,
+        std::int32_t    mask,
+        valve::trace_t* out
+    ) const;
+
+    /// <summary>
+    /// Traces count rays, origins[i] to destinations[i] into out[i]. Rays go
+    /// through the tree in SIMD packets that share node fetches, each trace
+    /// equals what trace_ray returns for the same ray.
+    /// </summary>
+    void trace_rays(
+        const vector3*  origins,
+        const vector3*  destinations,
+        std::size_t     count,
+        valve::trace_t* out
+    ) const;
+
+    /// <summary>
+    /// Batched is_visible, out[i] is set for every unobstructed ray
+    /// </summary>
+    void is_visible_batch(
+        const vector3* origins,
+        const vector3* destinations,
+        std::size_t    count,
+        bool*          out
+    ) const;
+
+    /// <summary>
+    /// Indices into entities of every entity with classname, a trailing *
+    /// matches every classname that starts with what comes before it. out
+    /// is overwritten and comes back sorted.
+    /// </summary>
+    void find_entities_by_class(
+        std::string_view            classname,
+        std::vector<std::uint32_t>& out
+    ) const;
+
+    /// <summary>
+    /// find_entities_by_class for targetnames
+    /// </summary>
+    void find_entities_by_name(
+        std::string_view            targetname,
+        std::vector<std::uint32_t>& out
+    ) const;
+
+    /// <summary>
+    /// Indices into entities of every entity whose bounds come within radius
+    /// of center. Point entities are bounded by their origin, brush entities
+    /// by their model moved to their origin. Entities with neither are never
+    /// found. out is overwritten and comes back sorted.
+    /// </summary>
+    void find_entities_in_radius(
+        const vector3&              center,
+        float                       radius,
+        std::vector<std::uint32_t>& out
+    ) const;
+
+    /// <summary>
+    /// find_entities_in_radius for entities whose bounds touch [mins, maxs]
+    /// </summary>
+    void find_entities_in_box(
+        const vector3&              mins,
+        const vector3&              maxs,
+        std::vector<std::uint32_t>& out
+    ) const;
+
+    /// <summary>
+    /// Writes the query-ready map to file_path, load picks it up again
+    /// through load_options::cache_directory
+    /// </summary>
+    bool save_baked(
+        const std::string& file_path
+    ) const;
+
+    /// <summary>
+    /// Bytes held by the map's containers, what keeping it loaded costs
+    /// </summary>
+    NODISCARD
+    std::size_t memory_usage() const;
+
+    /// <summary>
+    /// Backend trace_ray runs on, picked by load_options::backend
+    /// </summary>
+    NODISCARD
+    trace_backend backend() const;
+
+    /// <summary>
+    /// Path load opens for map_name in directory, empty if either is empty
+    /// </summary>
+    NODISCARD
+    static std::string map_path(
+        const std::string& directory,
+        const std::string& map_name
+    );
+
+    /// <summary>
+    /// file_path plus every load option that changes the map load builds, the
+    /// pool, profile and cancellation only change how it gets there. Two loads
+    /// with the same key build the same map. nullopt if prop_bounds can't be
+    /// told apart from other callbacks, see load_options::prop_bounds_key.
+    /// </summary>
+    NODISCARD
+    static std::optional<std::string> load_key(
+        const std::string&  file_path,
+        const load_options& options
+    );
+
+    /// <summary>
+    /// Cheap revision of the .bsp at file_path and its .lmp patches, made up
+    /// of their sizes and write times. 0 if the .bsp doesn't exist.
+    /// </summary>
+    NODISCARD
+    static std::uint64_t file_revision(
+        const std::string& file_path
+    );
+
+    /// <summary>
+    /// Streams the entities of entity lump text to fn( const valve::entity_t& )
+    /// without storing them, fn returns false to stop early. Each entity's
+    /// views are only valid during its call, and escapes are decoded into
+    /// text in place. False if the text is malformed.
+    /// </summary>
+    template<typename callback>
+    static bool for_each_entity(
+        char*       text,
+        std::size_t size,
+        callback&&  fn
+    )
+    {
+        entity_reader                         reader( text, size );
+        std::vector<valve::entity_keyvalue_t> keyvalues;
+
+        while( reader.read_entity( keyvalues ) ) {
+            valve::entity_t entity;
+            entity.first_keyvalue = keyvalues.data();
+            entity.last_keyvalue  = keyvalues.data() + keyvalues.size();
+            if( !fn( static_cast<const valve::entity_t&>( entity ) ) ) {
+                return true;
+            }
+            keyvalues.clear();
+        }
+
+        return !reader.failed();
+    }
+
+
+
+
+    //TODO: Cannot remove leading underscores as some code relies on it.
+public:
+    std::string                           map_name;
+    valve::dheader_t                      bsp_header;
+    //entities go here
+    std::vector<valve::mvertex_t>         vertices;
+    std::vector<valve::cplane_t>          planes;
+    std::vector<valve::dedge_t>           edges;
+    std::vector<std::int32_t>             surf_edges;
+    std::vector<valve::dleaf_t>           leaves;
+    std::vector<valve::snode_t>           nodes;
+    std::vector<valve::trace_node_t>      trace_nodes;
+    std::vector<valve::dface_t>           surfaces;
+    std::vector<valve::texinfo_t>         tex_infos;
+    std::vector<valve::dbrush_t>          brushes;
+    std::vector<valve::dbrushside_t>      brush_sides;
+    valve::brush_planes_t                 brush_planes;
+    std::vector<valve::aabb_t>            brush_aabbs;
+    std::vector<std::uint16_t>            leaf_faces;
+    std::vector<std::uint16_t>            leaf_brushes;
+    std::vector<valve::polygon>           polygons;
+    std::vector<vector3>                  polygon_verts;
+    std::vector<valve::VPlane>            polygon_edge_planes;
+    std::vector<char>                     entity_text;
+    std::vector<valve::entity_keyvalue_t> entity_keyvalues;
+    std::vector<valve::entity_t>          entities;
+    valve::entity_index_t                 entity_index;
+    std::vector<valve::dmodel_t>          models;
+    valve::visibility_t                   visibility;
+    std::vector<valve::dgamelump_t>       game_lumps;
+    std::vector<std::string>              static_prop_models;
+    std::vector<valve::static_prop_t>     static_props;
+    std::vector<valve::prop_box_t>        prop_boxes;
+    std::vector<valve::bvh_node_t>        prop_bvh;
+    std::vector<valve::displacement_t>    displacements;
+    std::vector<vector3>                  disp_positions;
+    std::vector<valve::disp_node_t>       disp_nodes;
+    std::vector<valve::bvh_node_t>        disp_bvh;
+    std::vector<valve::bvh_node_t>        brush_bvh;
+    std::vector<std::uint16_t>            brush_bvh_brushes;
+    std::vector<valve::bvh_node_t>        face_bvh;
+    std::vector<std::uint16_t>            face_bvh_faces;
+private:
+    /// <summary>
+    /// Every lump load reads from the .bsp
+    /// </summary>
+    static constexpr std::array<valve::lump_index, 18> parsed_lumps = {
+        valve::lump_index::vertices, valve::lump_index::planes, valve::lump_index::edges,
+        valve::lump_index::surfedges, valve::lump_index::leafs, valve::lump_index::nodes,
+        valve::lump_index::faces, valve::lump_index::tex_info, valve::lump_index::brushes,
+        valve::lump_index::brush_sides, valve::lump_index::leaf_faces,
+        valve::lump_index::leaf_brushes, valve::lump_index::entities,
+        valve::lump_index::visibility, valve::lump_index::game_lump,
+        valve::lump_index::disp_info, valve::lump_index::disp_verts,
+        valve::lump_index::models
+    };
+
+    /// <summary>
+    /// Only set while load runs
+    /// </summary>
+    load_scratch*                    _scratch       = nullptr;
+    /// <summary>
+    /// Only set while load runs, and only if load_options::profile is
+    /// </summary>
+    load_profile*                    _profile       = nullptr;
+    std::uint64_t                    _content_hash  = 0;
+    trace_backend                    _trace_backend = trace_backend::bsp_tree;
+};
+}
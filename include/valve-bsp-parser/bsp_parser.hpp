@@ -5,21 +5,43 @@
 ///--------------------------------------------------------------------------------
 #pragma once
 
-#include <valve-bsp-parser/core/valve_structs.hpp>
-#include <shared_mutex>
-#include <LzmaLib.h>
-#include <cstring>
-#include <cassert>
+#include <valve-bsp-parser/bsp_map.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
-#include <optional>
 
 namespace rn {
+/// <summary>
+/// Holds the current map as an immutable bsp_map snapshot, load_map builds
+/// the next map off to the side and swaps it in. Queries find the map in a
+/// per-thread cache checked against a generation counter, so as long as the
+/// map doesn't change they skip the lock std::atomic_load takes and only bump
+/// the map's reference count while they run. The cache doesn't own the map,
+/// a replaced map is freed once the queries running on it returned and no
+/// snapshot holder is left.
+/// </summary>
 class bsp_parser final
 {
+    struct async_load
+    {
+        std::string                              map_name;
+        std::optional<std::string>               load_key;
+        std::atomic<bool>                        cancelled{ false };
+        std::promise<bool>                       promise;
+        std::shared_future<bool>                 result;
+        std::vector<std::function<void( bool )>> callbacks;
+    };
+
 public:
     bsp_parser() = default;
 
-    ~bsp_parser() = default;
+    /// <summary>
+    /// Cancels a pending load_map_async and waits for it to wind down
+    /// </summary>
+    ~bsp_parser();
 
     bsp_parser(
         const bsp_parser& rhs
@@ -37,210 +59,204 @@ public:
         bsp_parser&& rhs
     ) noexcept;
 
-private:
-    bool set_current_map(
-        const std::string& directory,
-        const std::string& map_name,
-        std::string&       file_path
-    );
-
-
-    bool parse_planes(
-        std::ifstream& file,
-        std::optional<valve::lumpfileheader_t> lumpFileHeader
-    );
-    bool parse_entities(
-        std::ifstream& file,
-        std::optional<valve::lumpfileheader_t> lumpFileHeader
+    /// <summary>
+    /// Loads map_name and publishes it, a failed load keeps the current map
+    /// </summary>
+    bool load_map(
+        const std::string&  directory,
+        const std::string&  map_name,
+        const load_options& options = {}
     );
 
-    bool parse_nodes(
-        std::ifstream& file,
-        std::optional<valve::lumpfileheader_t> lumpFileHeader
+    /// <summary>
+    /// Loads map_name on options.pool (thread_pool::shared() when nullptr)
+    /// and swaps it in once it's done, queries keep hitting the current map
+    /// in the meantime. Requesting another map or unloading cancels a load
+    /// that hasn't been swapped in yet, requesting the one being loaded with
+    /// the same bsp_map::load_key joins it, with other options it's cancelled
+    /// and loaded anew. on_complete gets the result on the loading thread
+    /// (right away if the map is already current), false if the load failed
+    /// or was cancelled.
+    /// </summary>
+    std::shared_future<bool> load_map_async(
+        const std::string&          directory,
+        const std::string&          map_name,
+        const load_options&         options     = {},
+        std::function<void( bool )> on_complete = {}
     );
 
-    bool parse_leaffaces(
-        std::ifstream& file,
-        std::optional<valve::lumpfileheader_t> lumpFileHeader
-    );
+    /// <summary>
+    /// Rays whose end points sit in clusters that can't see each other are
+    /// rejected through the PVS without being traced
+    /// </summary>
+    bool is_visible(
+        const vector3& origin,
+        const vector3& destination
+    ) const;
+
+    /// <summary>
+    /// Visibility cluster the point lies in, -1 when it's in no cluster
+    /// (solid, outside the map) or no map is loaded
+    /// </summary>
+    std::int32_t point_cluster(
+        const vector3& point
+    ) const;
+
+    /// <summary>
+    /// Leaf the point lies in, -1 when no map is loaded
+    /// </summary>
+    std::int32_t point_leaf(
+        const vector3& point
+    ) const;
+
+    /// <summary>
+    /// Contents of the leaf the point lies in masked with mask, 0 when no map
+    /// is loaded
+    /// </summary>
+    std::int32_t point_contents(
+        const vector3& point,
+        std::int32_t   mask = valve::MASK_ALL
+    ) const;
+
+    /// <summary>
+    /// Batched point_leaf, see bsp_map::point_leaf_batch
+    /// </summary>
+    void point_leaf_batch(
+        const vector3* points,
+        std::size_t    count,
+        std::int32_t*  out
+    ) const;
+
+    /// <summary>
+    /// Batched point_contents, see bsp_map::point_leaf_batch
+    /// </summary>
+    void point_contents_batch(
+        const vector3* points,
+        std::size_t    count,
+        std::int32_t   mask,
+        std::int32_t*  out
+    ) const;
 
-    bool parse_leafbrushes(
-        std::ifstream& file,
-        std::optional<valve::lumpfileheader_t> lumpFileHeader
-    ); 
-    
-    //bool parse_entities(
-    //    std::ifstream& file
-    //);
-
-    bool parse_polygons();
-
-    void ray_cast_node(
-        std::int32_t    node_index,
-        float           start_fraction,
-        float           end_fraction,
+    void trace_ray(
         const vector3&  origin,
-        const vector3&  destination,
+        const vector3&  final,
         valve::trace_t* out
-    );
+    ) const;
 
-    void ray_cast_surface(
-        std::int32_t    surface_index,
+    /// <summary>
+    /// Swept-box trace, see bsp_map::trace_hull
+    /// </summary>
+    void trace_hull(
         const vector3&  origin,
-        const vector3&  destination,
+        const vector3&  final,
+        const vector3&  mins,
+        const vector3&  maxs,
+        std::int32_t    mask,
+        valve::trace_t* out
+    ) const;
+
+    /// <summary>
+    /// Traces count rays, see bsp_map::trace_rays
+    /// </summary>
+    void trace_rays(
+        const vector3*  origins,
+        const vector3*  destinations,
+        std::size_t     count,
         valve::trace_t* out
+    ) const;
+
+    /// <summary>
+    /// Batched is_visible, out[i] is set for every unobstructed ray
+    /// </summary>
+    void is_visible_batch(
+        const vector3* origins,
+        const vector3* destinations,
+        std::size_t    count,
+        bool*          out
+    ) const;
+
+    /// <summary>
+    /// Publishes an already loaded map (a map_registry handle for example)
+    /// as the current one, nullptr unloads
+    /// </summary>
+    void set_map(
+        std::shared_ptr<const bsp_map> map
     );
 
-    void ray_cast_brush(
-        valve::dbrush_t* brush,
-        const vector3&   origin,
-        const vector3&   destination,
-        valve::trace_t*  out
-    )const;
+    void unload_map();
 
-    template<typename type>
+    /// <summary>
+    /// Writes the current map to file_path, see bsp_map::save_baked
+    /// </summary>
+    bool save_baked(
+        const std::string& file_path
+    ) const;
+
+    /// <summary>
+    /// Current map, nullptr if none is loaded. Holding on to it keeps the map
+    /// alive across reloads, batches of queries can run against it directly.
+    /// </summary>
     NODISCARD
-    bool parse_lump(
-        std::ifstream&          file,
-        const valve::lump_index lump_index,
-        std::vector<type>&      out,
-        std::optional<valve::lumpfileheader_t> fileLump = std::nullopt
-    ) const
-    {
-        using rn::valve::lzma_header_t;
-        using rn::valve::has_valid_lzma_ident;
-        const auto index = static_cast<std::underlying_type_t<valve::lump_index>>( lump_index );
-
-
-
-        if( index >= bsp_header.lumps.size() ) {
-            return false;
-        }
-        //TODO: decompress lump here if compressed
-        //Default behavior is casting data to underlying types.
-        //It doesn't handle compression
-
-
-        //There are two exceptions though: Game lumps (35) (yes, multiple; compressed individually), and PAK Lump (40) (basically a zip file)
-
-
-        const auto& lump = bsp_header.lumps.at( index );
-
-        std::size_t lumpOffset,lumpSize;
-
-        valve::lumpfileheader_t lumpPatch;
-        if (fileLump.has_value()) {
-               lumpPatch = fileLump.value();
-               lumpOffset = lumpPatch.file_offset;
-               lumpSize = lumpPatch.file_size;
-        } else {
-
-            lumpOffset = lump.file_offset;
-            lumpSize = lump.file_size;
-        }
-
-        auto size  = static_cast<std::size_t>( lumpSize ) / sizeof( type );
-        //out.resize( size );
-
-
-        char* tmpData = new char[lumpSize + sizeof(lzma_header_t) + 1]; //lump.file_size doesn't count size of the header
-        file.seekg( lumpOffset );
-        //Temporarily make this array. This data may be compressed.
-        
-        memset(tmpData, 0, lumpSize + sizeof(lzma_header_t) + 1);
-
-        file.read(tmpData, lumpSize);
-
-        lzma_header_t lzma_header;
-        memcpy(&lzma_header, tmpData, sizeof(lzma_header));
+    std::shared_ptr<const bsp_map> snapshot() const;
 
-
-        if (has_valid_lzma_ident(lzma_header.id))
-        {
-            assert(lump_index != valve::lump_index::game_lump || lump_index != valve::lump_index::pak_file); //Those have special rules regarding compression.
-
-
-
-            //This section below was BEFORE if check. This resulted on malloc pulling array size from garbage data
-            //without checking if data were actually compressed.
-
-
-            char* tmpUncompressedData;
-            //bool isCompressed = false;
-
-           
-            tmpUncompressedData = new char[lzma_header.actualSize + 1];
-
-
-            size_t lzmaSize = lzma_header.lzmaSize,realSize = lzma_header.actualSize;
-
-
-            LzmaUncompress(reinterpret_cast<unsigned char*>(tmpUncompressedData),
-                           &realSize,
-                           reinterpret_cast<unsigned char*>(tmpData+sizeof(lzma_header_t)), //point to actual data, not the header
-                           &lzmaSize,
-                           reinterpret_cast<unsigned char*>(lzma_header.properties.data()),
-                           LZMA_PROPS_SIZE);
-            out.resize(static_cast<std::size_t>(lzma_header.actualSize) / sizeof(type));
-            out.assign(reinterpret_cast<type*>(tmpUncompressedData),reinterpret_cast<type*>(tmpUncompressedData+realSize));
-            delete[] tmpUncompressedData;
-
-        }
-        else
-        {
-            out.resize(size/sizeof(type));
-            out.assign(reinterpret_cast<type*>(tmpData),reinterpret_cast<type*>(tmpData+lumpSize));
-        }
-
-        
-
-
-        //file.read( reinterpret_cast<char*>( out.data() ), size * static_cast<std::size_t>( sizeof( type ) ) );
-        delete[] tmpData;
-        return true;
-    }
-
-public:
-    bool load_map(
-        const std::string& directory,
-        const std::string& map_name
+private:
+    /// <summary>
+    /// Current map through the calling thread's cache, nullptr if none is
+    /// loaded. The cache only borrows it, callers hold the returned pointer
+    /// for as long as they use the map.
+    /// </summary>
+    std::shared_ptr<const bsp_map> cached_map() const;
+
+    /// <summary>
+    /// Swaps map in and moves _generation on, so thread caches reload it
+    /// </summary>
+    void publish(
+        std::shared_ptr<const bsp_map> map
     );
 
-    bool is_visible(
-        const vector3& origin,
-        const vector3& destination
-    );
+    static std::uint64_t next_id();
 
-    void trace_ray(
-        const vector3&  origin,
-        const vector3&  final,
-        valve::trace_t* out
+    void run_async_load(
+        const std::shared_ptr<async_load>& request,
+        const std::string&                 directory,
+        const load_options&                options
     );
-    void unload_map();
-
 
-
-
-    //TODO: Cannot remove leading underscores as some code relies on it.
-public:
-    std::string                      map_name;
-    valve::dheader_t                 bsp_header;
-    //entities go here
-    std::vector<valve::mvertex_t>    vertices;
-    std::vector<valve::cplane_t>     planes;
-    std::vector<valve::dedge_t>      edges;
-    std::vector<std::int32_t>        surf_edges;
-    std::vector<valve::dleaf_t>      leaves;
-    std::vector<valve::snode_t>      nodes;
-    std::vector<valve::dface_t>      surfaces;
-    std::vector<valve::texinfo_t>    tex_infos;
-    std::vector<valve::dbrush_t>     brushes;
-    std::vector<valve::dbrushside_t> brush_sides;
-    std::vector<std::uint16_t>       leaf_faces;
-    std::vector<std::uint16_t>       leaf_brushes;
-    std::vector<valve::polygon>      polygons;
-    std::vector<valve::entity_t>     entities;
-private:
-    mutable std::shared_timed_mutex  _mutex;
+    /// <summary>
+    /// Flags the pending async load as cancelled, _async_mutex must be held
+    /// </summary>
+    void cancel_async_load();
+
+    /// <summary>
+    /// Cancels the pending async load and blocks until no async load task
+    /// refers to this parser anymore
+    /// </summary>
+    void wait_async_loads();
+
+    /// <summary>
+    /// Only touched through std::atomic_load / std::atomic_store, which take a
+    /// lock in libstdc++. Queries only load it when _generation moved or the
+    /// map they cached is gone.
+    /// </summary>
+    std::shared_ptr<const bsp_map> _map;
+    std::atomic<std::uint64_t>     _generation{ 0 };
+    /// <summary>
+    /// Tells the parsers apart in the thread caches, unlike the address it's
+    /// never reused
+    /// </summary>
+    std::uint64_t                  _id = next_id();
+    /// <summary>
+    /// Reused by every load, guarded by _load_mutex
+    /// </summary>
+    load_scratch                   _scratch;
+    std::mutex                     _load_mutex;
+    /// <summary>
+    /// Latest load_map_async request that hasn't finished, guarded by
+    /// _async_mutex like _async_tasks
+    /// </summary>
+    std::shared_ptr<async_load>    _pending;
+    std::size_t                    _async_tasks = 0;
+    std::mutex                     _async_mutex;
+    std::condition_variable        _async_done;
 };
 }
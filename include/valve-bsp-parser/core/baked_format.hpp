@@ -0,0 +1,126 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#pragma once
+
+#include <valve-bsp-parser/core/requirements.hpp>
+#include <cstdint>
+#include <cstring>
+
+/// On-disk layout of a baked map: a header, a table of sections and the
+/// section payloads, each aligned to 16 bytes. Payloads are the in-memory
+/// arrays of bsp_map, so loading is one mapping plus one copy per section.
+namespace rn::baked {
+constexpr std::uint32_t MAGIC   = ( 'K' << 24 ) + ( 'B' << 16 ) + ( 'N' << 8 ) + 'R';
+/// bump whenever the layout of a section or of a stored struct changes, or
+/// what load computes into one
+constexpr std::uint32_t VERSION = 8;
+
+constexpr std::size_t SECTION_ALIGNMENT = 16;
+
+enum class section_id
+    : std::uint32_t
+{
+    bsp_header          = 0,
+    planes              = 1,
+    nodes               = 2,
+    leaves              = 3,
+    brushes             = 4,
+    brush_sides         = 5,
+    leaf_faces          = 6,
+    leaf_brushes        = 7,
+    polygons            = 8,
+    entities            = 9,
+    polygon_verts       = 10,
+    polygon_edge_planes = 11,
+    visibility_clusters = 12,
+    visibility_rows     = 13,
+    displacements       = 14,
+    disp_positions      = 15,
+    disp_nodes          = 16,
+    disp_bvh            = 17,
+    models              = 18,
+    count
+};
+
+struct file_header
+{
+    std::uint32_t magic         = MAGIC;
+    std::uint32_t version       = VERSION;
+    std::int32_t  map_revision  = 0;
+    std::uint32_t num_sections  = 0;
+    std::uint64_t content_hash  = 0;
+    std::uint64_t file_size     = 0;
+    /// <summary>
+    /// payload_hash of the section table and the sections, catches truncated
+    /// or corrupted files the size check lets through
+    /// </summary>
+    std::uint64_t payload_hash  = 0;
+};//Size=0x28
+
+struct section_entry
+{
+    std::uint32_t id           = 0;
+    std::uint32_t element_size = 0;
+    std::uint64_t offset       = 0;
+    std::uint64_t count        = 0;
+};//Size=0x18
+
+/// <summary>
+/// 64 bit hash used to key baked maps to the .bsp (and .lmp) contents
+/// </summary>
+inline std::uint64_t hash_bytes(
+    const void*   data,
+    std::size_t   size,
+    std::uint64_t seed
+)
+{
+    constexpr std::uint64_t prime = 0x9E3779B97F4A7C15ull;
+
+    const auto* bytes = static_cast<const std::uint8_t*>( data );
+    auto        hash  = seed ^ ( size * prime );
+
+    auto mix = [&hash]( std::uint64_t value )
+    {
+        value *= 0xBF58476D1CE4E5B9ull;
+        value ^= value >> 31;
+        hash  ^= value;
+        hash   = ( ( hash << 27 ) | ( hash >> 37 ) ) * prime + 0x52DCE729ull;
+    };
+
+    for( ; size >= sizeof( std::uint64_t ); size -= sizeof( std::uint64_t ), bytes += sizeof( std::uint64_t ) ) {
+        std::uint64_t value;
+        std::memcpy( &value, bytes, sizeof( value ) );
+        mix( value );
+    }
+
+    std::uint64_t tail = 0;
+    if( size ) {
+        std::memcpy( &tail, bytes, size );
+    }
+    mix( tail );
+
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/// <summary>
+/// Combines the section table with the hash of every section (indexed by
+/// section_id, seeded with it), padding between sections isn't covered
+/// </summary>
+inline std::uint64_t payload_hash(
+    const section_entry* table,
+    const std::uint64_t* section_hashes,
+    const std::size_t    num_sections
+)
+{
+    const auto hash = hash_bytes( table, sizeof( section_entry ) * num_sections, VERSION );
+    return hash_bytes( section_hashes, sizeof( std::uint64_t ) * num_sections, hash );
+}
+}
@@ -0,0 +1,59 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#pragma once
+
+#include <valve-bsp-parser/core/valve_structs.hpp>
+
+namespace rn {
+/// <summary>
+/// Tokenizer over the text of an entity lump, { "key" "value" ... } blocks
+/// with braces and pairs anywhere on a line. Keys and values come back as
+/// views into the text, \" and \\ escapes are decoded in place so the text
+/// is modified while it is read.
+/// </summary>
+class entity_reader final
+{
+public:
+    entity_reader(
+        char*       text,
+        std::size_t size
+    );
+
+    /// <summary>
+    /// Appends the keyvalues of the next entity to keyvalues, false at the
+    /// end of the text or when it is malformed
+    /// </summary>
+    bool read_entity(
+        std::vector<valve::entity_keyvalue_t>& keyvalues
+    );
+
+    /// <summary>
+    /// Whether reading stopped on malformed text rather than its end
+    /// </summary>
+    NODISCARD
+    bool failed() const
+    {
+        return _failed;
+    }
+
+private:
+    enum class token_type
+    {
+        end,
+        open_brace,
+        close_brace,
+        string
+    };
+
+    token_type read_token(
+        std::string_view& token
+    );
+
+    char* _cursor;
+    char* _end;
+    bool  _failed = false;
+};
+}
@@ -0,0 +1,129 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#pragma once
+
+#include <valve-bsp-parser/core/requirements.hpp>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+namespace rn {
+enum class file_access
+{
+    /// <summary>
+    /// Map the whole file into memory, lumps are read straight out of the mapping
+    /// </summary>
+    memory_mapped,
+    /// <summary>
+    /// Keep the file open and copy each requested range into a caller buffer
+    /// </summary>
+    copy_on_demand
+};
+
+class file_view final
+{
+public:
+    file_view() = default;
+
+    ~file_view();
+
+    file_view(
+        const file_view& rhs
+    ) = delete;
+
+    file_view& operator = (
+        const file_view& rhs
+    ) = delete;
+
+    file_view(
+        file_view&& rhs
+    ) noexcept;
+
+    file_view& operator = (
+        file_view&& rhs
+    ) noexcept;
+
+    /// <summary>
+    /// Opens file_path, falls back to copy_on_demand if the file can't be mapped
+    /// </summary>
+    bool open(
+        const std::string& file_path,
+        file_access        access = file_access::memory_mapped
+    );
+
+    void close();
+
+    NODISCARD
+    bool is_open() const
+    {
+        return _size != 0;
+    }
+
+    NODISCARD
+    std::size_t size() const
+    {
+        return _size;
+    }
+
+    NODISCARD
+    file_access access() const
+    {
+        return _access;
+    }
+
+    /// <summary>
+    /// Hints the OS to page in the given range before it's read
+    /// </summary>
+    void prefetch(
+        std::size_t offset,
+        std::size_t size
+    ) const;
+
+    /// <summary>
+    /// Returns a pointer to [offset, offset + size) or nullptr if the range is
+    /// out of bounds. When the file is mapped the pointer refers to the mapping
+    /// and buffer stays untouched, otherwise the range is copied into buffer.
+    /// </summary>
+    NODISCARD
+    const std::uint8_t* read(
+        std::size_t                offset,
+        std::size_t                size,
+        std::vector<std::uint8_t>& buffer
+    ) const;
+
+    /// <summary>
+    /// Copies [offset, offset + size) straight into destination without any
+    /// intermediate buffer
+    /// </summary>
+    NODISCARD
+    bool copy(
+        std::size_t offset,
+        std::size_t size,
+        void*       destination
+    ) const;
+
+    template<typename type>
+    NODISCARD
+    bool read_object(
+        const std::size_t offset,
+        type&             out
+    ) const
+    {
+        return copy( offset, sizeof( type ), static_cast<void*>( &out ) );
+    }
+
+private:
+    file_access          _access  = file_access::memory_mapped;
+    std::size_t          _size    = 0;
+    const std::uint8_t*  _mapping = nullptr;
+#if defined(_WIN32)
+    void*                _file_handle    = nullptr;
+    void*                _mapping_handle = nullptr;
+#endif
+    mutable std::ifstream _stream;
+    mutable std::mutex    _stream_mutex;
+};
+}
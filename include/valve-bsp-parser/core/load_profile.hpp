@@ -0,0 +1,211 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#pragma once
+
+#include <valve-bsp-parser/core/valve_structs.hpp>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+namespace rn {
+/// <summary>
+/// Where the load time of one lump went. Everything a step reads for its
+/// lump adds up in one record, the game lump counts its directory and the
+/// static prop entry.
+/// </summary>
+struct lump_profile
+{
+    valve::lump_index lump               = valve::lump_index::entities;
+    /// <summary>
+    /// Index of the .lmp file the lump was patched from, -1 for the .bsp
+    /// </summary>
+    std::int32_t      patch              = -1;
+    /// <summary>
+    /// Bytes as stored in the file, the LZMA header included
+    /// </summary>
+    std::uint64_t     compressed_bytes   = 0;
+    std::uint64_t     uncompressed_bytes = 0;
+    /// <summary>
+    /// Copying or mapping the stored bytes in, page faults of mapped files land here
+    /// </summary>
+    std::uint64_t     read_ns            = 0;
+    std::uint64_t     decompress_ns      = 0;
+    /// <summary>
+    /// Everything after decoding: converting, tokenizing, building prop boxes, ...
+    /// </summary>
+    std::uint64_t     process_ns         = 0;
+    /// <summary>
+    /// Since the load started
+    /// </summary>
+    std::uint64_t     start_ns           = 0;
+    std::thread::id   thread;
+
+    NODISCARD
+    std::uint64_t total_ns() const
+    {
+        return read_ns + decompress_ns + process_ns;
+    }
+};
+
+/// <summary>
+/// Load work that isn't tied to one lump: hashing, the baked cache, node
+/// linking, polygon building, ...
+/// </summary>
+struct stage_profile
+{
+    std::string     name;
+    std::uint64_t   start_ns    = 0;
+    std::uint64_t   duration_ns = 0;
+    std::thread::id thread;
+};
+
+/// <summary>
+/// Filled by bsp_map::load when load_options::profile points at it. Lumps
+/// decoded concurrently are recorded from the pool threads, so one profile
+/// must only be handed to one load at a time.
+/// </summary>
+class load_profile final
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    /// <summary>
+    /// Sums of every lump record, lump and patch are left at their defaults
+    /// </summary>
+    NODISCARD
+    lump_profile totals() const;
+
+    /// <summary>
+    /// Lump and stage table for logging, sizes in KiB and times in ms
+    /// </summary>
+    NODISCARD
+    std::string summary() const;
+
+    /// <summary>
+    /// Writes the lumps and stages as Chrome trace events (chrome://tracing,
+    /// Perfetto). Each lump is split into read, decompress and process slices
+    /// laid out back to back.
+    /// </summary>
+    bool write_chrome_trace(
+        const std::string& file_path
+    ) const;
+
+    /// <summary>
+    /// Drops the previous records and starts the clock, called by bsp_map::load
+    /// </summary>
+    void begin();
+
+    void finish(
+        bool result
+    );
+
+    void add_lump(
+        const lump_profile& lump
+    );
+
+    void add_stage(
+        const char*       name,
+        clock::time_point start,
+        clock::time_point end
+    );
+
+    NODISCARD
+    std::uint64_t elapsed_ns(
+        clock::time_point time
+    ) const;
+
+    /// <summary>
+    /// Nanoseconds since since, which is moved up to now
+    /// </summary>
+    static std::uint64_t lap(
+        clock::time_point& since
+    );
+
+public:
+    std::vector<lump_profile>  lumps;
+    std::vector<stage_profile> stages;
+    std::uint64_t              total_ns  = 0;
+    /// <summary>
+    /// The map came out of the baked cache, lumps then only lists the game lump
+    /// </summary>
+    bool                       cache_hit = false;
+    bool                       succeeded = false;
+
+private:
+    clock::time_point _start;
+    /// <summary>
+    /// Thread load ran on
+    /// </summary>
+    std::thread::id   _thread;
+    std::mutex        _mutex;
+};
+
+/// <summary>
+/// Records the lump the current thread decodes from construction to
+/// destruction. parse_lump and the game lump reader add their read and
+/// decompress share to current(), the rest counts as processing. Does
+/// nothing without a profile.
+/// </summary>
+class lump_timer final
+{
+public:
+    lump_timer(
+        load_profile*     profile,
+        valve::lump_index lump,
+        std::int32_t      patch = -1
+    );
+
+    ~lump_timer();
+
+    lump_timer(
+        const lump_timer& rhs
+    ) = delete;
+
+    lump_timer& operator = (
+        const lump_timer& rhs
+    ) = delete;
+
+    /// <summary>
+    /// Record of the lump timed on this thread, nullptr if none is
+    /// </summary>
+    static lump_profile* current();
+
+private:
+    static lump_profile*& current_slot();
+
+    load_profile*                   _profile  = nullptr;
+    lump_profile*                   _previous = nullptr;
+    lump_profile                    _record;
+    load_profile::clock::time_point _start;
+};
+
+/// <summary>
+/// Records a stage from construction to destruction, does nothing without a profile
+/// </summary>
+class stage_timer final
+{
+public:
+    stage_timer(
+        load_profile* profile,
+        const char*   name
+    );
+
+    ~stage_timer();
+
+    stage_timer(
+        const stage_timer& rhs
+    ) = delete;
+
+    stage_timer& operator = (
+        const stage_timer& rhs
+    ) = delete;
+
+private:
+    load_profile*                   _profile = nullptr;
+    const char*                     _name    = nullptr;
+    load_profile::clock::time_point _start;
+};
+}
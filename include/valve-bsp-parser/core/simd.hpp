@@ -0,0 +1,302 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#pragma once
+
+#include <valve-bsp-parser/core/requirements.hpp>
+#include <cstdint>
+#include <cstring>
+
+/// AVX gives 8 lanes, SSE2 4 lanes. Everything else (or RN_BSP_PARSER_NO_SIMD)
+/// uses a plain 4 lane array so packet code compiles and behaves the same.
+#if !defined(RN_BSP_PARSER_NO_SIMD)
+    #if defined(__AVX__)
+        #include <immintrin.h>
+        #define RN_BSP_PARSER_SIMD_AVX
+    #elif defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+        #include <emmintrin.h>
+        #define RN_BSP_PARSER_SIMD_SSE
+    #endif
+#endif
+
+namespace rn::simd {
+/// <summary>
+/// A packet of floats. Comparisons return lane masks (all bits set or clear)
+/// that feed select() and movemask().
+/// </summary>
+class float_v
+{
+public:
+#if defined(RN_BSP_PARSER_SIMD_AVX)
+    using type_native = __m256;
+    static constexpr std::size_t width = 8;
+#elif defined(RN_BSP_PARSER_SIMD_SSE)
+    using type_native = __m128;
+    static constexpr std::size_t width = 4;
+#else
+    using type_native = std::array<float, 4>;
+    static constexpr std::size_t width = 4;
+#endif
+
+    float_v() = default;
+
+    float_v(
+        const type_native& value
+    )
+        : _value( value )
+    { }
+
+    NODISCARD
+    static float_v broadcast(
+        const float value
+    )
+    {
+    #if defined(RN_BSP_PARSER_SIMD_AVX)
+        return _mm256_set1_ps( value );
+    #elif defined(RN_BSP_PARSER_SIMD_SSE)
+        return _mm_set1_ps( value );
+    #else
+        type_native out;
+        out.fill( value );
+        return out;
+    #endif
+    }
+
+    NODISCARD
+    static float_v load(
+        const float* values
+    )
+    {
+    #if defined(RN_BSP_PARSER_SIMD_AVX)
+        return _mm256_loadu_ps( values );
+    #elif defined(RN_BSP_PARSER_SIMD_SSE)
+        return _mm_loadu_ps( values );
+    #else
+        type_native out;
+        std::memcpy( out.data(), values, sizeof( out ) );
+        return out;
+    #endif
+    }
+
+    void store(
+        float* values
+    ) const
+    {
+    #if defined(RN_BSP_PARSER_SIMD_AVX)
+        _mm256_storeu_ps( values, _value );
+    #elif defined(RN_BSP_PARSER_SIMD_SSE)
+        _mm_storeu_ps( values, _value );
+    #else
+        std::memcpy( values, _value.data(), sizeof( _value ) );
+    #endif
+    }
+
+    NODISCARD
+    const type_native& native() const
+    {
+        return _value;
+    }
+
+private:
+    type_native _value;
+};
+
+namespace detail {
+#if !defined(RN_BSP_PARSER_SIMD_AVX) && !defined(RN_BSP_PARSER_SIMD_SSE)
+template<typename operation>
+float_v lanewise(
+    const float_v& lhs,
+    const float_v& rhs,
+    operation      op
+)
+{
+    float_v::type_native out;
+    for( std::size_t i = 0; i < float_v::width; ++i ) {
+        out.at( i ) = op( lhs.native().at( i ), rhs.native().at( i ) );
+    }
+    return out;
+}
+
+inline float lane_mask(
+    const bool value
+)
+{
+    const std::uint32_t bits = value ? 0xFFFFFFFFu : 0u;
+    float out;
+    std::memcpy( &out, &bits, sizeof( out ) );
+    return out;
+}
+
+inline bool lane_set(
+    const float value
+)
+{
+    std::uint32_t bits;
+    std::memcpy( &bits, &value, sizeof( bits ) );
+    return bits != 0;
+}
+#endif
+}
+
+inline float_v operator + ( const float_v& lhs, const float_v& rhs )
+{
+#if defined(RN_BSP_PARSER_SIMD_AVX)
+    return _mm256_add_ps( lhs.native(), rhs.native() );
+#elif defined(RN_BSP_PARSER_SIMD_SSE)
+    return _mm_add_ps( lhs.native(), rhs.native() );
+#else
+    return detail::lanewise( lhs, rhs, []( const float a, const float b ) { return a + b; } );
+#endif
+}
+
+inline float_v operator - ( const float_v& lhs, const float_v& rhs )
+{
+#if defined(RN_BSP_PARSER_SIMD_AVX)
+    return _mm256_sub_ps( lhs.native(), rhs.native() );
+#elif defined(RN_BSP_PARSER_SIMD_SSE)
+    return _mm_sub_ps( lhs.native(), rhs.native() );
+#else
+    return detail::lanewise( lhs, rhs, []( const float a, const float b ) { return a - b; } );
+#endif
+}
+
+inline float_v operator * ( const float_v& lhs, const float_v& rhs )
+{
+#if defined(RN_BSP_PARSER_SIMD_AVX)
+    return _mm256_mul_ps( lhs.native(), rhs.native() );
+#elif defined(RN_BSP_PARSER_SIMD_SSE)
+    return _mm_mul_ps( lhs.native(), rhs.native() );
+#else
+    return detail::lanewise( lhs, rhs, []( const float a, const float b ) { return a * b; } );
+#endif
+}
+
+inline float_v operator / ( const float_v& lhs, const float_v& rhs )
+{
+#if defined(RN_BSP_PARSER_SIMD_AVX)
+    return _mm256_div_ps( lhs.native(), rhs.native() );
+#elif defined(RN_BSP_PARSER_SIMD_SSE)
+    return _mm_div_ps( lhs.native(), rhs.native() );
+#else
+    return detail::lanewise( lhs, rhs, []( const float a, const float b ) { return a / b; } );
+#endif
+}
+
+inline float_v operator < ( const float_v& lhs, const float_v& rhs )
+{
+#if defined(RN_BSP_PARSER_SIMD_AVX)
+    return _mm256_cmp_ps( lhs.native(), rhs.native(), _CMP_LT_OQ );
+#elif defined(RN_BSP_PARSER_SIMD_SSE)
+    return _mm_cmplt_ps( lhs.native(), rhs.native() );
+#else
+    return detail::lanewise( lhs, rhs, []( const float a, const float b ) { return detail::lane_mask( a < b ); } );
+#endif
+}
+
+inline float_v operator >= ( const float_v& lhs, const float_v& rhs )
+{
+#if defined(RN_BSP_PARSER_SIMD_AVX)
+    return _mm256_cmp_ps( lhs.native(), rhs.native(), _CMP_GE_OQ );
+#elif defined(RN_BSP_PARSER_SIMD_SSE)
+    return _mm_cmpge_ps( lhs.native(), rhs.native() );
+#else
+    return detail::lanewise( lhs, rhs, []( const float a, const float b ) { return detail::lane_mask( a >= b ); } );
+#endif
+}
+
+inline float_v operator > ( const float_v& lhs, const float_v& rhs )
+{
+    return rhs < lhs;
+}
+
+inline float_v operator <= ( const float_v& lhs, const float_v& rhs )
+{
+    return rhs >= lhs;
+}
+
+inline float_v operator & ( const float_v& lhs, const float_v& rhs )
+{
+#if defined(RN_BSP_PARSER_SIMD_AVX)
+    return _mm256_and_ps( lhs.native(), rhs.native() );
+#elif defined(RN_BSP_PARSER_SIMD_SSE)
+    return _mm_and_ps( lhs.native(), rhs.native() );
+#else
+    return detail::lanewise( lhs, rhs, []( const float a, const float b )
+    {
+        return detail::lane_mask( detail::lane_set( a ) && detail::lane_set( b ) );
+    } );
+#endif
+}
+
+/// <summary>
+/// Lane-wise smaller of lhs and rhs
+/// </summary>
+inline float_v minimum( const float_v& lhs, const float_v& rhs )
+{
+#if defined(RN_BSP_PARSER_SIMD_AVX)
+    return _mm256_min_ps( lhs.native(), rhs.native() );
+#elif defined(RN_BSP_PARSER_SIMD_SSE)
+    return _mm_min_ps( lhs.native(), rhs.native() );
+#else
+    return detail::lanewise( lhs, rhs, []( const float a, const float b ) { return a < b ? a : b; } );
+#endif
+}
+
+/// <summary>
+/// Lane-wise larger of lhs and rhs
+/// </summary>
+inline float_v maximum( const float_v& lhs, const float_v& rhs )
+{
+#if defined(RN_BSP_PARSER_SIMD_AVX)
+    return _mm256_max_ps( lhs.native(), rhs.native() );
+#elif defined(RN_BSP_PARSER_SIMD_SSE)
+    return _mm_max_ps( lhs.native(), rhs.native() );
+#else
+    return detail::lanewise( lhs, rhs, []( const float a, const float b ) { return a > b ? a : b; } );
+#endif
+}
+
+/// <summary>
+/// Lane-wise mask ? if_set : if_clear
+/// </summary>
+inline float_v select(
+    const float_v& mask,
+    const float_v& if_set,
+    const float_v& if_clear
+)
+{
+#if defined(RN_BSP_PARSER_SIMD_AVX)
+    return _mm256_blendv_ps( if_clear.native(), if_set.native(), mask.native() );
+#elif defined(RN_BSP_PARSER_SIMD_SSE)
+    return _mm_or_ps( _mm_and_ps( mask.native(), if_set.native() ), _mm_andnot_ps( mask.native(), if_clear.native() ) );
+#else
+    float_v::type_native out;
+    for( std::size_t i = 0; i < float_v::width; ++i ) {
+        out.at( i ) = detail::lane_set( mask.native().at( i ) ) ? if_set.native().at( i ) : if_clear.native().at( i );
+    }
+    return out;
+#endif
+}
+
+/// <summary>
+/// One bit per lane, bit i is set when lane i of mask is set
+/// </summary>
+inline std::uint32_t movemask(
+    const float_v& mask
+)
+{
+#if defined(RN_BSP_PARSER_SIMD_AVX)
+    return static_cast<std::uint32_t>( _mm256_movemask_ps( mask.native() ) );
+#elif defined(RN_BSP_PARSER_SIMD_SSE)
+    return static_cast<std::uint32_t>( _mm_movemask_ps( mask.native() ) );
+#else
+    std::uint32_t out = 0;
+    for( std::size_t i = 0; i < float_v::width; ++i ) {
+        out |= detail::lane_set( mask.native().at( i ) ) ? 1u << i : 0u;
+    }
+    return out;
+#endif
+}
+}
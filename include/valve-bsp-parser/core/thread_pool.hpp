@@ -0,0 +1,123 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#pragma once
+
+#include <valve-bsp-parser/core/requirements.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace rn {
+class thread_pool final
+{
+public:
+    /// <summary>
+    /// Spawns num_threads workers, 0 uses std::thread::hardware_concurrency()
+    /// </summary>
+    explicit thread_pool(
+        std::size_t num_threads = 0
+    );
+
+    ~thread_pool();
+
+    thread_pool(
+        const thread_pool& rhs
+    ) = delete;
+
+    thread_pool& operator = (
+        const thread_pool& rhs
+    ) = delete;
+
+    /// <summary>
+    /// Pool shared by every load that wasn't handed one in load_options::pool
+    /// </summary>
+    static thread_pool& shared();
+
+    void enqueue(
+        std::function<void()> task
+    );
+
+    NODISCARD
+    std::size_t size() const
+    {
+        return _workers.size();
+    }
+
+private:
+    void worker();
+
+    std::vector<std::thread>          _workers;
+    std::deque<std::function<void()>> _tasks;
+    std::mutex                        _mutex;
+    std::condition_variable           _condition;
+    bool                              _stop = false;
+};
+
+/// <summary>
+/// A batch of tasks that is waited on as a whole. The waiting thread runs
+/// tasks that no worker picked up yet itself, so waiting on a group from
+/// inside a pool worker (or with a pool of one thread) can't deadlock.
+/// </summary>
+class task_group final
+{
+    struct entry
+    {
+        std::function<void()> task;
+        std::atomic<bool>     claimed{ false };
+    };
+
+    struct state
+    {
+        std::mutex                          mutex;
+        std::condition_variable             condition;
+        std::vector<std::shared_ptr<entry>> entries;
+        std::size_t                         pending = 0;
+        std::exception_ptr                  error;
+    };
+
+public:
+    explicit task_group(
+        thread_pool* pool
+    );
+
+    ~task_group();
+
+    task_group(
+        const task_group& rhs
+    ) = delete;
+
+    task_group& operator = (
+        const task_group& rhs
+    ) = delete;
+
+    /// <summary>
+    /// Schedules a task, safe to call from inside another task of this group
+    /// </summary>
+    void run(
+        std::function<void()> task
+    );
+
+    /// <summary>
+    /// Blocks until every task (including ones scheduled while waiting) has
+    /// finished and rethrows the first exception a task threw
+    /// </summary>
+    void wait();
+
+private:
+    static void execute(
+        const std::shared_ptr<state>& shared,
+        entry&                        item
+    );
+
+    thread_pool*           _pool;
+    std::shared_ptr<state> _state;
+};
+}
@@ -6,6 +6,7 @@
 #pragma once
 
 #include <valve-bsp-parser/core/matrix.hpp>
+#include <string_view>
 
 namespace rn::valve {
 constexpr bool has_valid_bsp_ident(
@@ -40,7 +41,19 @@ constexpr std::size_t  MAX_MAP_LEAFBRUSHES       = 65536;
 constexpr std::size_t  MIN_MAP_DISP_POWER        = 2;
 constexpr std::size_t  MAX_MAP_DISP_POWER        = 4;
 constexpr std::size_t  MAX_MAP_SURFEDGES         = 512000;
+constexpr std::size_t  MAX_MAP_CLUSTERS          = 65536;
 constexpr std::size_t  MAX_DISP_CORNER_NEIGHBORS = 4;
+// upper bound for lzma_header_t::actualSize, anything above is treated as a corrupt lump
+constexpr std::size_t  MAX_LUMP_UNCOMPRESSED_SIZE = 256 * 1024 * 1024;
+constexpr std::size_t  MAX_MAP_GAMELUMPS          = 128;
+constexpr std::size_t  STATIC_PROP_NAME_LENGTH    = 128;
+
+constexpr std::int32_t  GAMELUMP_STATIC_PROPS = ( 's' << 24 ) + ( 'p' << 16 ) + ( 'r' << 8 ) + 'p';
+constexpr std::uint16_t GAMELUMP_COMPRESSED   = 0x0001; // the game lump carries its own lzma_header_t
+
+constexpr std::uint8_t SOLID_NONE     = 0; // no collision at all
+constexpr std::uint8_t SOLID_BBOX     = 2; // the model's bounding box
+constexpr std::uint8_t SOLID_VPHYSICS = 6; // the model's physics hull
 
 // NOTE: These are stored in a short in the engine now.  Don't use more than 16 bits
 constexpr std::int32_t SURF_LIGHT     = 0x0001; // value will hold the light strength
@@ -246,10 +259,60 @@ private:
 
 
 
+/// <summary>
+/// One key and its value, views into the text the entity was read from
+/// </summary>
+class entity_keyvalue_t
+{
+public:
+    std::string_view key;
+    std::string_view value;
+};
+
+/// <summary>
+/// Keyvalues of one entity in lump order, a range over the map's
+/// entity_keyvalues
+/// </summary>
 class entity_t
 {
 public:
-    std::unordered_map<std::string,std::string> keyvalues;
+    NODISCARD
+    const entity_keyvalue_t* begin() const
+    {
+        return first_keyvalue;
+    }
+
+    NODISCARD
+    const entity_keyvalue_t* end() const
+    {
+        return last_keyvalue;
+    }
+
+    NODISCARD
+    std::size_t size() const
+    {
+        return static_cast<std::size_t>( last_keyvalue - first_keyvalue );
+    }
+
+    /// <summary>
+    /// Value of the first keyvalue named key, empty if there is none
+    /// </summary>
+    NODISCARD
+    std::string_view value(
+        const std::string_view key
+    ) const
+    {
+        for( const auto& keyvalue : *this ) {
+            if( keyvalue.key == key ) {
+                return keyvalue.value;
+            }
+        }
+        return {};
+    }
+
+public:
+    const entity_keyvalue_t* first_keyvalue = nullptr;
+    const entity_keyvalue_t* last_keyvalue  = nullptr;
 };
 
 class dedge_t
@@ -282,6 +345,43 @@ public:
     std::int16_t  leaf_water_data_id; // 0x2E
 };//Size=0x30
 
+/// <summary>
+/// The potentially visible sets of the visibility lump, decompressed into
+/// one row of num_clusters bits per cluster
+/// </summary>
+class visibility_t
+{
+public:
+    std::int32_t              num_clusters = 0;
+    std::size_t               row_size     = 0;
+    std::vector<std::uint8_t> rows;
+
+    /// <summary>
+    /// false only if from's PVS rules out to. Clusters outside the map (-1)
+    /// or a map without vis data never rule anything out.
+    /// </summary>
+    NODISCARD
+    bool can_see(
+        const std::int32_t from,
+        const std::int32_t to
+    ) const
+    {
+        if( from < 0 || to < 0 || from >= num_clusters || to >= num_clusters ) {
+            return true;
+        }
+
+        const auto row = static_cast<std::size_t>( from ) * row_size;
+        return ( rows.at( row + static_cast<std::size_t>( to >> 3 ) ) & ( 1u << ( to & 7 ) ) ) != 0;
+    }
+
+    void clear()
+    {
+        num_clusters = 0;
+        row_size     = 0;
+        rows.clear();
+    }
+};
+
 struct dgamelump_t
 {
     std::int32_t		id;		// gamelump ID
@@ -298,6 +398,172 @@ struct dgamelumpheader_t
     dgamelump_t* gamelump{};
 };
 
+/// <summary>
+/// The part of a sprp static prop every version since 4 starts with, later
+/// versions only append fields. Converted from the stored entry, offsets
+/// are those in the lump.
+/// </summary>
+class static_prop_t
+{
+public:
+    vector3       origin;      // 0x00
+    vector3       angles;      // 0x0C pitch, yaw, roll in degrees
+    std::uint16_t model_index; // 0x18 into the model name dictionary
+    std::uint16_t first_leaf;  // 0x1A
+    std::uint16_t leaf_count;  // 0x1C
+    std::uint8_t  solid;       // 0x1E SOLID_NONE, SOLID_BBOX or SOLID_VPHYSICS
+    std::uint8_t  flags;       // 0x1F
+};//Size=0x20
+
+/// <summary>
+/// Oriented box a static prop blocks traces with. axes are the prop's local
+/// x, y and z in world space, mins and maxs its bounds along them,
+/// world_mins and world_maxs the axis aligned box around it.
+/// </summary>
+class prop_box_t
+{
+public:
+    vector3                origin;
+    std::array<vector3, 3> axes;
+    vector3                mins;
+    vector3                maxs;
+    vector3                world_mins;
+    vector3                world_maxs;
+    std::int32_t           prop_index;
+};
+
+/// <summary>
+/// Axis-aligned box, brush_aabbs keeps one per brush and
+/// entity_index_t one per entity
+/// </summary>
+class aabb_t
+{
+public:
+    vector3 mins;
+    vector3 maxs;
+};
+
+/// <summary>
+/// Node of a bounding volume hierarchy over axis aligned boxes. Leaves
+/// (num_boxes > 0) hold boxes [first, first + num_boxes), inner nodes have
+/// their first child right behind them and the second at first.
+/// </summary>
+class bvh_node_t
+{
+public:
+    vector3      mins;
+    vector3      maxs;
+    std::int32_t first;
+    std::int32_t num_boxes;
+};
+
+/// <summary>
+/// Deepest leaf bsp_map::build_bvh creates, the root being 0. Walks pop a
+/// node and push both children, so they never keep more than
+/// MAX_BVH_DEPTH + 1 nodes pending.
+/// </summary>
+constexpr std::size_t MAX_BVH_DEPTH = 48;
+
+class ddispinfo_t
+{
+    using type_neighbors     = std::array<std::uint8_t, 0x58>;
+    using type_allowed_verts = std::array<std::uint32_t, 10>;
+
+public:
+    vector3            start_position;           // 0x00 first corner of the base face
+    std::int32_t       disp_vert_start;          // 0x0C
+    std::int32_t       disp_tri_start;           // 0x10
+    std::int32_t       power;                    // 0x14 2^power quads per side
+    std::int32_t       min_tess;                 // 0x18
+    float              smoothing_angle;          // 0x1C
+    std::int32_t       contents;                 // 0x20
+    std::uint16_t      map_face;                 // 0x24
+    std::int32_t       lightmap_alpha_start;     // 0x28
+    std::int32_t       lightmap_sample_start;    // 0x2C
+    type_neighbors     neighbors;                // 0x30 edge and corner neighbors
+    type_allowed_verts allowed_verts;            // 0x88
+};//Size=0xB0
+
+static_assert( sizeof( ddispinfo_t ) == 0xB0, "ddispinfo_t is copied straight out of the disp_info lump" );
+
+class dispvert_t
+{
+public:
+    vector3 vector;   // 0x00 offset direction from the base face
+    float   distance; // 0x0C
+    float   alpha;    // 0x10
+};//Size=0x14
+
+/// <summary>
+/// Displacement ready for traces. Its (2^power + 1)^2 vertices start at
+/// first_vert, the quadtree over its quads at first_node: level l holds
+/// 4^l nodes row by row, the last level one node per quad.
+/// </summary>
+class displacement_t
+{
+public:
+    std::int32_t first_vert;
+    std::int32_t first_node;
+    std::int32_t power;
+    std::int32_t contents;
+    std::int32_t face;       // the face it replaces
+};
+
+class disp_node_t
+{
+public:
+    vector3 mins;
+    vector3 maxs;
+};
+
+class dmodel_t
+{
+public:
+    vector3      mins;       // 0x00
+    vector3      maxs;       // 0x0C
+    vector3      origin;     // 0x18
+    std::int32_t head_node;  // 0x24
+    std::int32_t first_face; // 0x28
+    std::int32_t num_faces;  // 0x2C
+};//Size=0x30
+
+/// <summary>
+/// Lookups over the map's entities, built once at load. Classnames and
+/// targetnames are interned into ids whose entities are ranges of one array
+/// each. origins and angles come pre-parsed, and a BVH over the entity
+/// bounds answers spatial queries.
+/// </summary>
+class entity_index_t
+{
+public:
+    std::unordered_map<std::string_view, std::uint32_t> class_ids;
+    std::vector<std::uint32_t>                          class_first;
+    std::vector<std::uint32_t>                          class_entities;
+    std::unordered_map<std::string_view, std::uint32_t> name_ids;
+    std::vector<std::uint32_t>                          name_first;
+    std::vector<std::uint32_t>                          name_entities;
+    std::vector<vector3>                                origins;
+    std::vector<vector3>                                angles;
+    std::vector<aabb_t>                                 bounds;
+    std::vector<bvh_node_t>                             bvh;
+    std::vector<std::uint32_t>                          bvh_entities;
+
+    void clear()
+    {
+        class_ids.clear();
+        class_first.clear();
+        class_entities.clear();
+        name_ids.clear();
+        name_first.clear();
+        name_entities.clear();
+        origins.clear();
+        angles.clear();
+        bounds.clear();
+        bvh.clear();
+        bvh_entities.clear();
+    }
+};
+
 class dnode_t
 {
     using type_min_max  = std::array<std::int16_t, 3>;
@@ -335,6 +601,26 @@ private:
     std::uint8_t  _pad0x2A[ 0x2 ]{};   // 0x2A
 };//Size=0x2C
 
+/// <summary>
+/// Node layout ray_cast_node walks: the splitting plane is stored inline and
+/// children are plain indices (>= 0 node, < 0 leaf as -1 - index), so a
+/// step down the tree touches a single 32 byte node and nothing else.
+/// </summary>
+class alignas( 32 ) trace_node_t
+{
+    using type_children = std::array<std::int32_t, 2>;
+
+public:
+    vector3       normal;              // 0x00
+    float         distance;            // 0x0C
+    type_children children;            // 0x10
+    std::uint8_t  type;                // 0x18
+private:
+    std::uint8_t  _pad0x19[ 0x7 ]{};   // 0x19
+};//Size=0x20
+
+static_assert( sizeof( trace_node_t ) == 0x20, "two trace nodes have to fit into one cache line" );
+
 class dface_t
 {
     using type_styles = std::array<std::uint8_t, 4>;
@@ -378,6 +664,34 @@ public:
     std::uint8_t  thin;      // 0x7
 };//Size=0x8
 
+/// <summary>
+/// The non-bevel side planes of every brush as structure of arrays, so
+/// ray_cast_brush loads a brush's sides straight into SIMD registers instead
+/// of going through brush_sides and planes side by side. The planes of the
+/// i-th brush start at first_plane[i] and span num_planes[i], padded to a
+/// multiple of the SIMD width with planes every segment lies behind.
+/// </summary>
+class brush_planes_t
+{
+public:
+    std::vector<float>         normal_x;
+    std::vector<float>         normal_y;
+    std::vector<float>         normal_z;
+    std::vector<float>         distance;
+    std::vector<std::uint32_t> first_plane;
+    std::vector<std::uint32_t> num_planes;
+
+    void clear()
+    {
+        normal_x.clear();
+        normal_y.clear();
+        normal_z.clear();
+        distance.clear();
+        first_plane.clear();
+        num_planes.clear();
+    }
+};
+
 class texinfo_t
 {
     using type_vecs = std::array<vector4, 2>;
@@ -451,18 +765,17 @@ public:
     float   distance = 0.f;
 };
 
+/// <summary>
+/// A face as a range into the polygon vertex and edge plane pools of
+/// bsp_map. Polygons are indexed like the faces lump, faces that can't be
+/// traced keep num_verts = 0.
+/// </summary>
 class polygon
 {
-    using type_surfinfo_vecs = std::array<vector3, MAX_SURFINFO_VERTS>;
-    using type_edge_planes   = std::array<VPlane, MAX_SURFINFO_VERTS>;
-
 public:
-    type_surfinfo_vecs verts;
-    std::size_t        num_verts = 0;
-    VPlane             plane;
-    type_edge_planes   edge_planes;
-    type_surfinfo_vecs vec2d;
-    std::int32_t       skip = 0;
+    std::uint32_t first_vert = 0;
+    std::uint32_t num_verts  = 0;
+    VPlane        plane;
 };
 
 struct trace_t
@@ -470,23 +783,35 @@ struct trace_t
     /// <summary>
     /// Determine if a plan is NOT valid
     /// </summary>
-    bool         all_solid           = true;
+    bool            all_solid           = true;
     /// <summary>
     /// Determine if the start point was in a solid area
     /// </summary>
-    bool         start_solid         = true;
+    bool            start_solid         = true;
     /// <summary>
     /// Time completed, 1.0              = didn't hit anything
     /// </summary>
-    float        fraction            = 1.f;
-    float        fraction_left_solid = 1.f;
+    float           fraction            = 1.f;
+    float           fraction_left_solid = 1.f;
     /// <summary>
     /// Final trace position
     /// </summary>
-    vector3      end_pos;
-    std::int32_t contents            = 0;
-    dbrush_t*    brush               = nullptr;
-    std::int32_t num_brush_sides     = 0;
+    vector3         end_pos;
+    std::int32_t    contents            = 0;
+    const dbrush_t* brush               = nullptr;
+    std::int32_t    num_brush_sides     = 0;
+    /// <summary>
+    /// Static prop that stopped the trace, -1 when it wasn't one
+    /// </summary>
+    std::int32_t    static_prop         = -1;
+    /// <summary>
+    /// Displacement that stopped the trace, -1 when it wasn't one
+    /// </summary>
+    std::int32_t    displacement        = -1;
+    /// <summary>
+    /// Face that stopped the trace, -1 when it wasn't one
+    /// </summary>
+    std::int32_t    surface             = -1;
 
     void clear()
     {
@@ -497,6 +822,9 @@ struct trace_t
         contents            = 0;
         brush               = nullptr;
         num_brush_sides     = 0;
+        static_prop         = -1;
+        displacement        = -1;
+        surface             = -1;
         end_pos.clear();
     }
 };
@@ -0,0 +1,118 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#pragma once
+
+#include <valve-bsp-parser/bsp_map.hpp>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace rn {
+/// <summary>
+/// Loaded maps shared by any number of users. Maps are keyed by their path,
+/// file revision and the load options that shape the built map, so every
+/// user of the same .bsp and options gets the same map and a changed file
+/// is reloaded on the next acquire. Once the resident maps
+/// exceed the memory budget, the least recently used ones nobody holds a
+/// handle to are dropped.
+/// </summary>
+class map_registry final
+{
+    struct entry
+    {
+        std::uint64_t                                       revision     = 0;
+        std::uint64_t                                       generation   = 0;
+        /// <summary>
+        /// Set once the load finished, until then acquirers wait on pending
+        /// </summary>
+        std::shared_ptr<const bsp_map>                      map;
+        std::shared_future<std::shared_ptr<const bsp_map>> pending;
+        std::size_t                                         memory_usage = 0;
+        std::list<std::string>::iterator                    lru;
+    };
+
+public:
+    /// <summary>
+    /// memory_budget is in bytes, 0 never evicts
+    /// </summary>
+    explicit map_registry(
+        std::size_t memory_budget = 0
+    );
+
+    ~map_registry() = default;
+
+    map_registry(
+        const map_registry& rhs
+    ) = delete;
+
+    map_registry& operator = (
+        const map_registry& rhs
+    ) = delete;
+
+    /// <summary>
+    /// Shared handle to map_name, loaded if it isn't resident or its file
+    /// changed. Concurrent acquires of the same map wait for a single load.
+    /// nullptr if the map can't be loaded. Different access, backend,
+    /// cache_directory or prop_bounds load a map of their own, prop_bounds
+    /// count as the same with the same prop_bounds_key or, without one, the
+    /// same function pointer. Any other prop_bounds gets a map nobody else
+    /// shares, loaded on every acquire.
+    /// </summary>
+    std::shared_ptr<const bsp_map> acquire(
+        const std::string&  directory,
+        const std::string&  map_name,
+        const load_options& options = {}
+    );
+
+    void set_memory_budget(
+        std::size_t memory_budget
+    );
+
+    NODISCARD
+    std::size_t memory_budget() const;
+
+    /// <summary>
+    /// Bytes of every resident map, handles that outlived their eviction
+    /// aren't counted
+    /// </summary>
+    NODISCARD
+    std::size_t memory_usage() const;
+
+    /// <summary>
+    /// Number of resident (and loading) maps
+    /// </summary>
+    NODISCARD
+    std::size_t size() const;
+
+    /// <summary>
+    /// Forgets every resident map, handles that are still held stay valid
+    /// </summary>
+    void clear();
+
+private:
+    void erase(
+        std::unordered_map<std::string, entry>::iterator it
+    );
+
+    /// <summary>
+    /// Drops unreferenced maps from the cold end until the budget is met,
+    /// _mutex must be held
+    /// </summary>
+    void evict();
+
+    mutable std::mutex                     _mutex;
+    std::unordered_map<std::string, entry> _entries;
+    /// <summary>
+    /// Keys of _entries, most recently acquired first
+    /// </summary>
+    std::list<std::string>                 _lru;
+    std::size_t                            _memory_budget;
+    std::size_t                            _memory_usage = 0;
+    std::uint64_t                          _generation   = 0;
+};
+}
@@ -0,0 +1,633 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include <valve-bsp-parser/bsp_map.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+using namespace rn;
+
+namespace {
+/// <summary>
+/// Most boxes a BVH leaf holds before it gets split
+/// </summary>
+constexpr std::size_t BVH_LEAF_SIZE = 4;
+
+/// <summary>
+/// Most boxes a SAH leaf holds when splitting it wouldn't pay off
+/// </summary>
+constexpr std::size_t SAH_LEAF_SIZE = 8;
+
+/// <summary>
+/// Candidate split planes per axis
+/// </summary>
+constexpr std::size_t SAH_BINS = 16;
+
+/// <summary>
+/// Cost of visiting a node relative to testing one box's contents
+/// </summary>
+constexpr float SAH_TRAVERSAL_COST = 0.5f;
+
+/// <summary>
+/// Pending nodes the brush and the face walk of ray_cast_bvh keep around
+/// </summary>
+constexpr std::size_t BRUSH_BVH_STACK_SIZE = 64;
+
+static_assert( BRUSH_BVH_STACK_SIZE > valve::MAX_BVH_DEPTH, "a walk keeps at most MAX_BVH_DEPTH + 1 nodes pending" );
+
+/// <summary>
+/// Brush bounds are padded by this much. The brush test accepts a ray
+/// DIST_EPSILON before it actually touches a side, the bounds must still
+/// contain that point.
+/// </summary>
+constexpr float BRUSH_BOUNDS_MARGIN = 1.f;
+
+/// <summary>
+/// Face bounds are padded by this much, so the flat box of a face doesn't
+/// lose a hit to the rounding of the box test
+/// </summary>
+constexpr float FACE_BOUNDS_MARGIN = 1.f;
+
+float surface_area(
+    const vector3& mins,
+    const vector3& maxs
+)
+{
+    const auto x = maxs( 0 ) - mins( 0 );
+    const auto y = maxs( 1 ) - mins( 1 );
+    const auto z = maxs( 2 ) - mins( 2 );
+    return 2.f * ( x * y + y * z + z * x );
+}
+
+/// <summary>
+/// Levels of median splits it takes to get count boxes down to one
+/// </summary>
+std::size_t median_levels(
+    const std::size_t count
+)
+{
+    std::size_t levels = 0;
+    while( ( std::size_t{ 1 } << levels ) < count ) {
+        ++levels;
+    }
+    return levels;
+}
+
+struct sah_bin
+{
+    std::size_t count = 0;
+    vector3     mins;
+    vector3     maxs;
+};
+
+void grow(
+    vector3&       mins,
+    vector3&       maxs,
+    const vector3& box_mins,
+    const vector3& box_maxs
+)
+{
+    for( std::size_t k = 0; k < 3; ++k ) {
+        mins( k ) = std::min( mins( k ), box_mins( k ) );
+        maxs( k ) = std::max( maxs( k ), box_maxs( k ) );
+    }
+}
+}
+
+std::vector<std::size_t> bsp_map::build_bvh(
+    const std::vector<vector3>&     mins,
+    const std::vector<vector3>&     maxs,
+    std::vector<valve::bvh_node_t>& nodes,
+    const bool                      surface_area_heuristic
+)
+{
+    nodes.clear();
+
+    std::vector<std::size_t> order( mins.size() );
+    std::iota( order.begin(), order.end(), std::size_t{ 0 } );
+    if( order.empty() ) {
+        return order;
+    }
+
+    std::vector<vector3> centers( mins.size() );
+    for( std::size_t i = 0; i < centers.size(); ++i ) {
+        for( std::size_t k = 0; k < 3; ++k ) {
+            centers.at( i )( k ) = ( mins.at( i )( k ) + maxs.at( i )( k ) ) * 0.5f;
+        }
+    }
+
+    nodes.reserve( 2 * order.size() / BVH_LEAF_SIZE + 1 );
+
+    std::function<void( std::size_t, std::size_t, std::size_t )> build = [&]( const std::size_t first, const std::size_t last, const std::size_t depth )
+    {
+        const auto node_index = nodes.size();
+        nodes.emplace_back();
+
+        vector3 node_mins, node_maxs, center_mins, center_maxs;
+        node_mins   = mins.at( order.at( first ) );
+        node_maxs   = maxs.at( order.at( first ) );
+        center_mins = centers.at( order.at( first ) );
+        center_maxs = center_mins;
+        for( auto i = first; i < last; ++i ) {
+            const auto box = order.at( i );
+            for( std::size_t k = 0; k < 3; ++k ) {
+                node_mins( k )   = std::min( node_mins( k ), mins.at( box )( k ) );
+                node_maxs( k )   = std::max( node_maxs( k ), maxs.at( box )( k ) );
+                center_mins( k ) = std::min( center_mins( k ), centers.at( box )( k ) );
+                center_maxs( k ) = std::max( center_maxs( k ), centers.at( box )( k ) );
+            }
+        }
+
+        nodes.at( node_index ).mins = node_mins;
+        nodes.at( node_index ).maxs = node_maxs;
+
+        auto make_leaf = [&]
+        {
+            nodes.at( node_index ).first     = static_cast<std::int32_t>( first );
+            nodes.at( node_index ).num_boxes = static_cast<std::int32_t>( last - first );
+        };
+
+        const auto count = last - first;
+        if( count <= BVH_LEAF_SIZE ) {
+            make_leaf();
+            return;
+        }
+
+        /// a SAH split may peel off a single box, it is only taken while median splits below it still fit in MAX_BVH_DEPTH
+        std::size_t middle = first;
+        if( surface_area_heuristic && depth + 1 + median_levels( count - 1 ) <= valve::MAX_BVH_DEPTH ) {
+            /// bin the centers on every axis and take the plane with the lowest surface area cost
+            auto        best_cost = std::numeric_limits<float>::max();
+            std::size_t best_axis = 0;
+            std::size_t best_bin  = 0;
+
+            for( std::size_t k = 0; k < 3; ++k ) {
+                const auto extent = center_maxs( k ) - center_mins( k );
+                if( extent <= 0.f ) {
+                    continue;
+                }
+
+                const auto bin_scale = static_cast<float>( SAH_BINS ) / extent;
+
+                std::array<sah_bin, SAH_BINS> bins;
+                for( auto i = first; i < last; ++i ) {
+                    const auto box = order.at( i );
+                    const auto bin = std::min( SAH_BINS - 1, static_cast<std::size_t>( ( centers.at( box )( k ) - center_mins( k ) ) * bin_scale ) );
+                    auto&      target = bins.at( bin );
+                    if( !target.count++ ) {
+                        target.mins = mins.at( box );
+                        target.maxs = maxs.at( box );
+                    }
+                    else {
+                        grow( target.mins, target.maxs, mins.at( box ), maxs.at( box ) );
+                    }
+                }
+
+                /// right_costs[ i ] covers bins above i, filled back to front
+                std::array<float, SAH_BINS> right_costs{};
+                std::size_t                 right_count = 0;
+                vector3                     right_mins, right_maxs;
+                for( auto i = SAH_BINS - 1; i > 0; --i ) {
+                    const auto& bin = bins.at( i );
+                    if( bin.count ) {
+                        if( !right_count ) {
+                            right_mins = bin.mins;
+                            right_maxs = bin.maxs;
+                        }
+                        else {
+                            grow( right_mins, right_maxs, bin.mins, bin.maxs );
+                        }
+                        right_count += bin.count;
+                    }
+                    right_costs.at( i - 1 ) = right_count ? surface_area( right_mins, right_maxs ) * static_cast<float>( right_count ) : 0.f;
+                }
+
+                std::size_t left_count = 0;
+                vector3     left_mins, left_maxs;
+                for( std::size_t i = 0; i + 1 < SAH_BINS; ++i ) {
+                    const auto& bin = bins.at( i );
+                    if( bin.count ) {
+                        if( !left_count ) {
+                            left_mins = bin.mins;
+                            left_maxs = bin.maxs;
+                        }
+                        else {
+                            grow( left_mins, left_maxs, bin.mins, bin.maxs );
+                        }
+                        left_count += bin.count;
+                    }
+                    if( !left_count || left_count == count ) {
+                        continue;
+                    }
+
+                    const auto cost = surface_area( left_mins, left_maxs ) * static_cast<float>( left_count ) + right_costs.at( i );
+                    if( cost < best_cost ) {
+                        best_cost = cost;
+                        best_axis = k;
+                        best_bin  = i;
+                    }
+                }
+            }
+
+            const auto node_area = surface_area( node_mins, node_maxs );
+            const auto leaf_cost = node_area * static_cast<float>( count );
+            const auto found     = best_cost < std::numeric_limits<float>::max();
+            if( count <= SAH_LEAF_SIZE && ( !found || SAH_TRAVERSAL_COST * node_area + best_cost >= leaf_cost ) ) {
+                make_leaf();
+                return;
+            }
+
+            if( found ) {
+                const auto extent    = center_maxs( best_axis ) - center_mins( best_axis );
+                const auto bin_scale = static_cast<float>( SAH_BINS ) / extent;
+
+                const auto split = std::partition( order.begin() + first, order.begin() + last, [&]( const std::size_t box )
+                {
+                    const auto bin = std::min( SAH_BINS - 1, static_cast<std::size_t>( ( centers.at( box )( best_axis ) - center_mins( best_axis ) ) * bin_scale ) );
+                    return bin <= best_bin;
+                } );
+                middle = static_cast<std::size_t>( split - order.begin() );
+            }
+        }
+
+        if( middle == first || middle == last ) {
+            /// median split along the axis the centers spread out the most
+            std::size_t axis = 0;
+            for( std::size_t k = 1; k < 3; ++k ) {
+                if( center_maxs( k ) - center_mins( k ) > center_maxs( axis ) - center_mins( axis ) ) {
+                    axis = k;
+                }
+            }
+
+            middle = first + count / 2;
+            std::nth_element( order.begin() + first, order.begin() + middle, order.begin() + last, [&]( const std::size_t lhs, const std::size_t rhs )
+            {
+                return centers.at( lhs )( axis ) < centers.at( rhs )( axis );
+            } );
+        }
+
+        build( first, middle, depth + 1 );
+        nodes.at( node_index ).first     = static_cast<std::int32_t>( nodes.size() );
+        nodes.at( node_index ).num_boxes = 0;
+        build( middle, last, depth + 1 );
+    };
+
+    build( 0, order.size(), 0 );
+    return order;
+}
+
+bool bsp_map::clip_to_box(
+    const vector3& origin,
+    const vector3& delta,
+    const vector3& extents,
+    const vector3& mins,
+    const vector3& maxs,
+    float&         enter,
+    float&         leave
+)
+{
+    for( std::size_t k = 0; k < 3; ++k ) {
+        const auto min = mins( k ) - extents( k );
+        const auto max = maxs( k ) + extents( k );
+
+        if( delta( k ) == 0.f ) {
+            if( origin( k ) < min || origin( k ) > max ) {
+                return false;
+            }
+            continue;
+        }
+
+        const auto inversed_delta = 1.f / delta( k );
+
+        auto near_fraction = ( min - origin( k ) ) * inversed_delta;
+        auto far_fraction  = ( max - origin( k ) ) * inversed_delta;
+        if( near_fraction > far_fraction ) {
+            std::swap( near_fraction, far_fraction );
+        }
+
+        enter = std::max( enter, near_fraction );
+        leave = std::min( leave, far_fraction );
+        if( enter > leave ) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool bsp_map::brush_bounds(
+    const valve::dbrush_t& brush,
+    vector3&               mins,
+    vector3&               maxs
+) const
+{
+    /// compiled brushes carry axial bevel sides, those are the bounds already
+    std::array<bool, 3> has_min{}, has_max{};
+    for( std::int32_t i = 0; i < brush.num_sides; ++i ) {
+        const auto& plane = planes.at( brush_sides.at( static_cast<std::size_t>( brush.first_side + i ) ).plane_num );
+        for( std::size_t k = 0; k < 3; ++k ) {
+            if( plane.normal( ( k + 1 ) % 3 ) != 0.f || plane.normal( ( k + 2 ) % 3 ) != 0.f ) {
+                continue;
+            }
+
+            if( plane.normal( k ) == 1.f ) {
+                maxs( k )       = has_max.at( k ) ? std::min( maxs( k ), plane.distance ) : plane.distance;
+                has_max.at( k ) = true;
+            }
+            else if( plane.normal( k ) == -1.f ) {
+                mins( k )       = has_min.at( k ) ? std::max( mins( k ), -plane.distance ) : -plane.distance;
+                has_min.at( k ) = true;
+            }
+        }
+    }
+
+    const auto bevelled = std::all_of( has_min.begin(), has_min.end(), []( const bool has ) { return has; } )
+        && std::all_of( has_max.begin(), has_max.end(), []( const bool has ) { return has; } );
+
+    if( !bevelled ) {
+        /// without bevels the corners are found by intersecting every three sides
+        vector3 corner_mins, corner_maxs;
+        auto    has_corner = false;
+
+        for( std::int32_t i = 0; i < brush.num_sides; ++i ) {
+            const auto& first = planes.at( brush_sides.at( static_cast<std::size_t>( brush.first_side + i ) ).plane_num );
+            for( auto j = i + 1; j < brush.num_sides; ++j ) {
+                const auto& second = planes.at( brush_sides.at( static_cast<std::size_t>( brush.first_side + j ) ).plane_num );
+                for( auto l = j + 1; l < brush.num_sides; ++l ) {
+                    const auto& third = planes.at( brush_sides.at( static_cast<std::size_t>( brush.first_side + l ) ).plane_num );
+
+                    const auto second_third = second.normal.cross( third.normal );
+                    const auto determinant  = first.normal.dot( second_third );
+                    if( std::abs( determinant ) < 1e-6f ) {
+                        continue;
+                    }
+
+                    const auto third_first  = third.normal.cross( first.normal );
+                    const auto first_second = first.normal.cross( second.normal );
+
+                    vector3 corner;
+                    for( std::size_t k = 0; k < 3; ++k ) {
+                        corner( k ) = ( second_third( k ) * first.distance + third_first( k ) * second.distance + first_second( k ) * third.distance ) / determinant;
+                    }
+
+                    auto inside = true;
+                    for( std::int32_t m = 0; m < brush.num_sides && inside; ++m ) {
+                        const auto& plane = planes.at( brush_sides.at( static_cast<std::size_t>( brush.first_side + m ) ).plane_num );
+                        inside = corner.dot( plane.normal ) - plane.distance <= BRUSH_BOUNDS_MARGIN;
+                    }
+                    if( !inside ) {
+                        continue;
+                    }
+
+                    if( !has_corner ) {
+                        corner_mins = corner;
+                        corner_maxs = corner;
+                        has_corner  = true;
+                    }
+                    else {
+                        grow( corner_mins, corner_maxs, corner, corner );
+                    }
+                }
+            }
+        }
+
+        if( !has_corner ) {
+            return false;
+        }
+
+        for( std::size_t k = 0; k < 3; ++k ) {
+            if( !has_min.at( k ) ) {
+                mins( k ) = corner_mins( k );
+            }
+            if( !has_max.at( k ) ) {
+                maxs( k ) = corner_maxs( k );
+            }
+        }
+    }
+
+    for( std::size_t k = 0; k < 3; ++k ) {
+        if( mins( k ) > maxs( k ) ) {
+            return false;
+        }
+        mins( k ) -= BRUSH_BOUNDS_MARGIN;
+        maxs( k ) += BRUSH_BOUNDS_MARGIN;
+    }
+
+    return true;
+}
+
+void bsp_map::build_brush_bvh()
+{
+    brush_bvh.clear();
+    brush_bvh_brushes.clear();
+
+    /// only the brushes some leaf lists, brush entities never show up in the BSP walk either
+    std::vector<bool> in_leaf( brushes.size() );
+    for( const auto brush : leaf_brushes ) {
+        if( brush < in_leaf.size() ) {
+            in_leaf.at( brush ) = true;
+        }
+    }
+
+    std::vector<vector3>       mins, maxs;
+    std::vector<std::uint16_t> candidates;
+    for( std::size_t i = 0; i < brushes.size(); ++i ) {
+        const auto& brush = brushes.at( i );
+        if( !in_leaf.at( i ) || !brush.num_sides || !( brush.contents & valve::MASK_SHOT_HULL ) ) {
+            continue;
+        }
+
+        /// the unbounded stand-ins build_brush_planes keeps for brushes without volume stay out
+        const auto& bounds = brush_aabbs.at( i );
+        if( !std::isfinite( bounds.mins( 0 ) ) ) {
+            continue;
+        }
+
+        mins.push_back( bounds.mins );
+        maxs.push_back( bounds.maxs );
+        candidates.push_back( static_cast<std::uint16_t>( i ) );
+    }
+
+    const auto order = build_bvh( mins, maxs, brush_bvh, true );
+
+    brush_bvh_brushes.reserve( order.size() );
+    for( const auto brush : order ) {
+        brush_bvh_brushes.push_back( candidates.at( brush ) );
+    }
+}
+
+void bsp_map::build_face_bvh()
+{
+    face_bvh.clear();
+    face_bvh_faces.clear();
+
+    /// only the faces some leaf lists, the BSP walk never sees the others
+    std::vector<bool> in_leaf( polygons.size() );
+    for( const auto face : leaf_faces ) {
+        if( face < in_leaf.size() ) {
+            in_leaf.at( face ) = true;
+        }
+    }
+
+    std::vector<vector3>       mins, maxs;
+    std::vector<std::uint16_t> candidates;
+    for( std::size_t i = 0; i < polygons.size(); ++i ) {
+        const auto& polygon = polygons.at( i );
+        if( !in_leaf.at( i ) || !polygon.num_verts ) {
+            continue;
+        }
+
+        const auto& first_vert = polygon_verts.at( polygon.first_vert );
+
+        vector3 face_mins = first_vert;
+        vector3 face_maxs = first_vert;
+        for( std::size_t j = 1; j < polygon.num_verts; ++j ) {
+            const auto& vert = polygon_verts.at( polygon.first_vert + j );
+            grow( face_mins, face_maxs, vert, vert );
+        }
+        for( std::size_t k = 0; k < 3; ++k ) {
+            face_mins( k ) -= FACE_BOUNDS_MARGIN;
+            face_maxs( k ) += FACE_BOUNDS_MARGIN;
+        }
+
+        mins.push_back( face_mins );
+        maxs.push_back( face_maxs );
+        candidates.push_back( static_cast<std::uint16_t>( i ) );
+    }
+
+    const auto order = build_bvh( mins, maxs, face_bvh, true );
+
+    face_bvh_faces.reserve( order.size() );
+    for( const auto face : order ) {
+        face_bvh_faces.push_back( candidates.at( face ) );
+    }
+}
+
+void bsp_map::select_backend(
+    const trace_backend backend
+)
+{
+    _trace_backend = backend;
+    if( backend == trace_backend::brush_bvh ) {
+        build_brush_bvh();
+        build_face_bvh();
+    }
+    else {
+        brush_bvh.clear();
+        brush_bvh_brushes.clear();
+        face_bvh.clear();
+        face_bvh_faces.clear();
+    }
+}
+
+void bsp_map::ray_cast_bvh(
+    const vector3&  origin,
+    const vector3&  destination,
+    valve::trace_t* out
+) const
+{
+    /// hits are kept by fraction alone, so the faces may go first and spare the brushes behind a hit
+    clip_to_faces( origin, destination, out );
+
+    if( brush_bvh.empty() ) {
+        return;
+    }
+
+    vector3 delta;
+    for( std::size_t k = 0; k < 3; ++k ) {
+        delta( k ) = destination( k ) - origin( k );
+    }
+
+    const vector3 no_extents( 0.f, 0.f, 0.f );
+
+    std::array<std::int32_t, BRUSH_BVH_STACK_SIZE> stack;
+    std::size_t                                    stack_size = 0;
+
+    stack.at( stack_size++ ) = 0;
+    while( stack_size ) {
+        const auto  node_index = stack.at( --stack_size );
+        const auto& node       = brush_bvh.at( static_cast<std::size_t>( node_index ) );
+
+        auto enter = 0.f;
+        auto leave = out->fraction;
+        if( !clip_to_box( origin, delta, no_extents, node.mins, node.maxs, enter, leave ) ) {
+            continue;
+        }
+
+        if( node.num_boxes ) {
+            for( auto i = node.first; i < node.first + node.num_boxes; ++i ) {
+                ray_cast_brush( &brushes.at( brush_bvh_brushes.at( static_cast<std::size_t>( i ) ) ), origin, destination, out );
+                /// a hit right at the start is undone if the ray turns out to start in
+                /// another brush, only a ray stuck in solid is final
+                if( out->fraction == 0.f && out->fraction_left_solid == 1.f ) {
+                    return;
+                }
+            }
+            continue;
+        }
+
+        /// the child whose center lies further along the ray goes on the stack first
+        const auto& near_child = brush_bvh.at( static_cast<std::size_t>( node_index ) + 1 );
+        const auto& far_child  = brush_bvh.at( static_cast<std::size_t>( node.first ) );
+
+        auto along = 0.f;
+        for( std::size_t k = 0; k < 3; ++k ) {
+            along += ( far_child.mins( k ) + far_child.maxs( k ) - near_child.mins( k ) - near_child.maxs( k ) ) * delta( k );
+        }
+
+        if( along >= 0.f ) {
+            stack.at( stack_size++ ) = node.first;
+            stack.at( stack_size++ ) = node_index + 1;
+        }
+        else {
+            stack.at( stack_size++ ) = node_index + 1;
+            stack.at( stack_size++ ) = node.first;
+        }
+    }
+}
+
+void bsp_map::clip_to_faces(
+    const vector3&  origin,
+    const vector3&  destination,
+    valve::trace_t* out
+) const
+{
+    if( face_bvh.empty() ) {
+        return;
+    }
+
+    vector3 delta;
+    for( std::size_t k = 0; k < 3; ++k ) {
+        delta( k ) = destination( k ) - origin( k );
+    }
+
+    const vector3 no_extents( 0.f, 0.f, 0.f );
+
+    std::array<std::int32_t, BRUSH_BVH_STACK_SIZE> stack;
+    std::size_t                                    stack_size = 0;
+
+    stack.at( stack_size++ ) = 0;
+    while( stack_size ) {
+        const auto& node = face_bvh.at( static_cast<std::size_t>( stack.at( --stack_size ) ) );
+
+        auto enter = 0.f;
+        auto leave = out->fraction;
+        if( !clip_to_box( origin, delta, no_extents, node.mins, node.maxs, enter, leave ) ) {
+            continue;
+        }
+
+        if( !node.num_boxes ) {
+            stack.at( stack_size++ ) = node.first;
+            stack.at( stack_size++ ) = static_cast<std::int32_t>( &node - face_bvh.data() ) + 1;
+            continue;
+        }
+
+        for( auto i = node.first; i < node.first + node.num_boxes; ++i ) {
+            ray_cast_surface( face_bvh_faces.at( static_cast<std::size_t>( i ) ), origin, destination, out );
+        }
+    }
+}
@@ -0,0 +1,542 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include <valve-bsp-parser/bsp_map.hpp>
+#include <valve-bsp-parser/core/baked_format.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <random>
+
+#if defined(_WIN32)
+    #include <process.h>
+#else
+    #include <unistd.h>
+#endif
+
+using namespace rn;
+
+namespace {
+struct section_source
+{
+    baked::section_id id;
+    std::uint32_t     element_size;
+    const void*       data;
+    std::uint64_t     count;
+};
+
+template<typename type>
+section_source make_section(
+    const baked::section_id  id,
+    const std::vector<type>& values
+)
+{
+    return { id, static_cast<std::uint32_t>( sizeof( type ) ), values.data(), values.size() };
+}
+
+/// <summary>
+/// File next to file_path no other process or thread writes to, concurrent
+/// saves of one map each rename a complete file over it
+/// </summary>
+std::string temp_path_for(
+    const std::string& file_path
+)
+{
+#if defined(_WIN32)
+    const auto pid = static_cast<unsigned long long>( _getpid() );
+#else
+    const auto pid = static_cast<unsigned long long>( getpid() );
+#endif
+    thread_local std::mt19937_64 random( std::random_device{}() );
+
+    std::array<char, 48> suffix;
+    std::snprintf( suffix.data(), suffix.size(), ".%llu.%016llx.tmp", pid, static_cast<unsigned long long>( random() ) );
+    return file_path + suffix.data();
+}
+
+std::uint64_t align_offset(
+    const std::uint64_t offset
+)
+{
+    return ( offset + baked::SECTION_ALIGNMENT - 1 ) & ~static_cast<std::uint64_t>( baked::SECTION_ALIGNMENT - 1 );
+}
+
+/// entities are stored as
+/// u32 num_entities, { u32 num_keyvalues, { u32 length, key, u32 length, value }... }...
+std::vector<std::uint8_t> serialize_entities(
+    const std::vector<valve::entity_t>& entities
+)
+{
+    std::vector<std::uint8_t> out;
+
+    auto write_u32 = [&out]( const std::size_t value )
+    {
+        const auto narrowed = static_cast<std::uint32_t>( value );
+        const auto* bytes   = reinterpret_cast<const std::uint8_t*>( &narrowed );
+        out.insert( out.end(), bytes, bytes + sizeof( narrowed ) );
+    };
+    auto write_string = [&]( const std::string_view value )
+    {
+        write_u32( value.size() );
+        out.insert( out.end(), value.begin(), value.end() );
+    };
+
+    write_u32( entities.size() );
+    for( const auto& entity : entities ) {
+        write_u32( entity.size() );
+        for( const auto& keyvalue : entity ) {
+            write_string( keyvalue.key );
+            write_string( keyvalue.value );
+        }
+    }
+
+    return out;
+}
+
+/// the strings are copied into text back to back, keyvalues view into it and
+/// entity_ends are laid out like store_entities expects them
+bool deserialize_entities(
+    const std::uint8_t*                    data,
+    const std::size_t                      size,
+    std::vector<char>&                     text,
+    std::vector<valve::entity_keyvalue_t>& keyvalues,
+    std::vector<std::size_t>&              entity_ends
+)
+{
+    std::size_t offset = 0;
+
+    auto read_u32 = [&]( std::uint32_t& value )
+    {
+        if( size - offset < sizeof( value ) ) {
+            return false;
+        }
+        std::memcpy( &value, data + offset, sizeof( value ) );
+        offset += sizeof( value );
+        return true;
+    };
+    /// the strings can't outgrow the section, so text never reallocates under the views
+    text.clear();
+    text.reserve( size );
+
+    auto read_string = [&]( std::string_view& value )
+    {
+        std::uint32_t length;
+        if( !read_u32( length ) || size - offset < length ) {
+            return false;
+        }
+        const auto* first = reinterpret_cast<const char*>( data + offset );
+        text.insert( text.end(), first, first + length );
+        value = std::string_view( text.data() + text.size() - length, length );
+        offset += length;
+        return true;
+    };
+
+    std::uint32_t num_entities;
+    if( !read_u32( num_entities ) || num_entities > ( size - offset ) / sizeof( std::uint32_t ) ) {
+        return false;
+    }
+
+    keyvalues.clear();
+    entity_ends.clear();
+    entity_ends.reserve( num_entities );
+    for( std::uint32_t entity = 0; entity < num_entities; ++entity ) {
+        std::uint32_t num_keyvalues;
+        if( !read_u32( num_keyvalues ) ) {
+            return false;
+        }
+        for( std::uint32_t i = 0; i < num_keyvalues; ++i ) {
+            valve::entity_keyvalue_t keyvalue;
+            if( !read_string( keyvalue.key ) || !read_string( keyvalue.value ) ) {
+                return false;
+            }
+            keyvalues.push_back( keyvalue );
+        }
+        entity_ends.push_back( keyvalues.size() );
+    }
+
+    return offset == size;
+}
+}
+
+std::uint64_t bsp_map::compute_content_hash(
+    const file_view&   file,
+    const std::string& file_path,
+    const file_access  access
+) const
+{
+    auto hash = baked::hash_bytes( &bsp_header, sizeof( bsp_header ), baked::VERSION );
+
+    std::vector<std::uint8_t> buffer;
+    for( const auto lump : parsed_lumps ) {
+        const auto& header = bsp_header.lumps.at( static_cast<std::size_t>( lump ) );
+        const auto  size   = static_cast<std::size_t>( header.file_size );
+        const auto* data   = file.read( static_cast<std::size_t>( header.file_offset ), size, buffer );
+        if( data ) {
+            hash = baked::hash_bytes( data, size, hash );
+        }
+    }
+
+    /// standalone lump files patch the map after the fact, they're part of the key too
+    for( std::size_t i = 0;; ++i ) {
+        file_view patch;
+        if( !patch.open( lump_patch_path( file_path, i ), access ) ) {
+            break;
+        }
+        const auto* data = patch.read( 0, patch.size(), buffer );
+        if( data ) {
+            hash = baked::hash_bytes( data, patch.size(), hash );
+        }
+    }
+
+    return hash;
+}
+
+std::uint64_t bsp_map::file_revision(
+    const std::string& file_path
+)
+{
+    auto stamp = []( const std::string& path, std::uint64_t& hash )
+    {
+        std::error_code error;
+        const auto size = std::filesystem::file_size( path, error );
+        if( error ) {
+            return false;
+        }
+        const auto time = std::filesystem::last_write_time( path, error ).time_since_epoch().count();
+        if( error ) {
+            return false;
+        }
+
+        const std::array<std::uint64_t, 2> key = { static_cast<std::uint64_t>( size ), static_cast<std::uint64_t>( time ) };
+        hash = baked::hash_bytes( key.data(), sizeof( key ), hash );
+        return true;
+    };
+
+    std::uint64_t hash = baked::VERSION;
+    if( file_path.empty() || !stamp( file_path, hash ) ) {
+        return 0;
+    }
+
+    /// the .lmp patches change the loaded map just like the .bsp does
+    for( std::size_t i = 0;; ++i ) {
+        if( !stamp( lump_patch_path( file_path, i ), hash ) ) {
+            break;
+        }
+    }
+
+    return hash ? hash : 1;
+}
+
+std::string bsp_map::baked_path(
+    const std::string& cache_directory,
+    const std::string& file_path
+)
+{
+    std::error_code error;
+    auto absolute = std::filesystem::absolute( file_path, error );
+    if( error ) {
+        absolute = file_path;
+    }
+    const auto full_path = absolute.lexically_normal().generic_string();
+
+    std::array<char, 24> suffix;
+    std::snprintf( suffix.data(), suffix.size(), "-%016llx.baked",
+                   static_cast<unsigned long long>( baked::hash_bytes( full_path.data(), full_path.size(), baked::VERSION ) ) );
+
+    return std::filesystem::path( cache_directory )
+        .append( std::filesystem::path( file_path ).stem().string() + suffix.data() )
+        .generic_string();
+}
+
+bool bsp_map::save_baked(
+    const std::string& file_path
+) const
+{
+    if( planes.empty() ) {
+        return false;
+    }
+
+    const auto entity_data = serialize_entities( entities );
+
+    const std::vector<section_source> sections = {
+        { baked::section_id::bsp_header, static_cast<std::uint32_t>( sizeof( bsp_header ) ), &bsp_header, 1 },
+        make_section( baked::section_id::planes, planes ),
+        make_section( baked::section_id::nodes, nodes ),
+        make_section( baked::section_id::leaves, leaves ),
+        make_section( baked::section_id::brushes, brushes ),
+        make_section( baked::section_id::brush_sides, brush_sides ),
+        make_section( baked::section_id::leaf_faces, leaf_faces ),
+        make_section( baked::section_id::leaf_brushes, leaf_brushes ),
+        make_section( baked::section_id::polygons, polygons ),
+        make_section( baked::section_id::entities, entity_data ),
+        make_section( baked::section_id::polygon_verts, polygon_verts ),
+        make_section( baked::section_id::polygon_edge_planes, polygon_edge_planes ),
+        { baked::section_id::visibility_clusters, static_cast<std::uint32_t>( sizeof( visibility.num_clusters ) ), &visibility.num_clusters, 1 },
+        make_section( baked::section_id::visibility_rows, visibility.rows ),
+        make_section( baked::section_id::displacements, displacements ),
+        make_section( baked::section_id::disp_positions, disp_positions ),
+        make_section( baked::section_id::disp_nodes, disp_nodes ),
+        make_section( baked::section_id::disp_bvh, disp_bvh ),
+        make_section( baked::section_id::models, models ),
+    };
+
+    baked::file_header header;
+    header.map_revision = bsp_header.map_revision;
+    header.num_sections = static_cast<std::uint32_t>( sections.size() );
+    header.content_hash = _content_hash;
+
+    std::vector<baked::section_entry> table( sections.size() );
+    std::vector<std::uint64_t>        section_hashes( sections.size() );
+
+    auto offset = align_offset( sizeof( header ) + sizeof( baked::section_entry ) * table.size() );
+    for( std::size_t i = 0; i < sections.size(); ++i ) {
+        const auto& section = sections.at( i );
+        auto&       entry   = table.at( i );
+
+        entry.id           = static_cast<std::uint32_t>( section.id );
+        entry.element_size = section.element_size;
+        entry.offset       = offset;
+        entry.count        = section.count;
+
+        section_hashes.at( i ) = baked::hash_bytes( section.data, section.count * section.element_size, entry.id );
+
+        offset = align_offset( offset + section.count * section.element_size );
+    }
+    header.file_size    = offset;
+    header.payload_hash = baked::payload_hash( table.data(), section_hashes.data(), table.size() );
+
+    /// write next to the target and rename, a reader never sees a half written cache
+    const auto temp_path = temp_path_for( file_path );
+    {
+        std::ofstream stream( temp_path, std::ios_base::binary | std::ios_base::trunc );
+        if( !stream ) {
+            return false;
+        }
+
+        static const std::array<char, baked::SECTION_ALIGNMENT> padding{};
+        auto pad_to = [&stream]( const std::uint64_t target )
+        {
+            const auto position = static_cast<std::uint64_t>( stream.tellp() );
+            stream.write( padding.data(), static_cast<std::streamsize>( target - position ) );
+        };
+
+        stream.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+        stream.write( reinterpret_cast<const char*>( table.data() ),
+                      static_cast<std::streamsize>( sizeof( baked::section_entry ) * table.size() ) );
+
+        for( std::size_t i = 0; i < sections.size(); ++i ) {
+            const auto& section = sections.at( i );
+            pad_to( table.at( i ).offset );
+            stream.write( static_cast<const char*>( section.data ),
+                          static_cast<std::streamsize>( section.count * section.element_size ) );
+        }
+        pad_to( header.file_size );
+
+        if( !stream ) {
+            stream.close();
+            std::error_code error;
+            std::filesystem::remove( temp_path, error );
+            return false;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename( temp_path, file_path, error );
+    if( error ) {
+        std::filesystem::remove( temp_path, error );
+        return false;
+    }
+
+    return true;
+}
+
+bool bsp_map::load_baked(
+    const std::string&  file_path,
+    const std::uint64_t content_hash,
+    const file_access   access
+)
+{
+    file_view file;
+    if( !file.open( file_path, access ) ) {
+        return false;
+    }
+
+    baked::file_header header;
+    if( !file.read_object( 0, header )
+        || header.magic != baked::MAGIC
+        || header.version != baked::VERSION
+        || header.map_revision != bsp_header.map_revision
+        || header.content_hash != content_hash
+        || header.file_size != file.size()
+        || header.num_sections != static_cast<std::uint32_t>( baked::section_id::count ) ) {
+        return false;
+    }
+
+    std::array<baked::section_entry, static_cast<std::size_t>( baked::section_id::count )> table;
+    if( !file.copy( sizeof( header ), sizeof( table ), table.data() ) ) {
+        return false;
+    }
+
+    std::array<std::uint64_t, static_cast<std::size_t>( baked::section_id::count )> section_hashes{};
+    auto read_section = [&]( const baked::section_id id, auto& out )
+    {
+        using type = typename std::decay_t<decltype( out )>::value_type;
+
+        const auto& entry = table.at( static_cast<std::size_t>( id ) );
+        if( entry.id != static_cast<std::uint32_t>( id ) || entry.element_size != sizeof( type ) ) {
+            return false;
+        }
+        if( entry.count > file.size() / sizeof( type ) ) {
+            return false;
+        }
+
+        out.resize( static_cast<std::size_t>( entry.count ) );
+        if( !file.copy( static_cast<std::size_t>( entry.offset ),
+                        out.size() * sizeof( type ),
+                        static_cast<void*>( out.data() ) ) ) {
+            return false;
+        }
+
+        section_hashes.at( entry.id ) = baked::hash_bytes( out.data(), out.size() * sizeof( type ), entry.id );
+        return true;
+    };
+
+    /// everything is read into temporaries first, a stale or broken cache
+    /// must leave the map untouched so load can fall back to the .bsp
+    std::vector<valve::dheader_t>         baked_header;
+    std::vector<valve::cplane_t>          baked_planes;
+    std::vector<valve::snode_t>           baked_nodes;
+    std::vector<valve::dleaf_t>           baked_leaves;
+    std::vector<valve::dbrush_t>          baked_brushes;
+    std::vector<valve::dbrushside_t>      baked_brush_sides;
+    std::vector<std::uint16_t>            baked_leaf_faces;
+    std::vector<std::uint16_t>            baked_leaf_brushes;
+    std::vector<valve::polygon>           baked_polygons;
+    std::vector<vector3>                  baked_polygon_verts;
+    std::vector<valve::VPlane>            baked_polygon_edge_planes;
+    std::vector<std::int32_t>             baked_visibility_clusters;
+    std::vector<std::uint8_t>             baked_visibility_rows;
+    std::vector<std::uint8_t>             baked_entity_data;
+    std::vector<char>                     baked_entity_text;
+    std::vector<valve::entity_keyvalue_t> baked_entity_keyvalues;
+    std::vector<std::size_t>              baked_entity_ends;
+    std::vector<valve::displacement_t>    baked_displacements;
+    std::vector<vector3>                  baked_disp_positions;
+    std::vector<valve::disp_node_t>       baked_disp_nodes;
+    std::vector<valve::bvh_node_t>        baked_disp_bvh;
+    std::vector<valve::dmodel_t>          baked_models;
+
+    if( !read_section( baked::section_id::bsp_header, baked_header )
+        || baked_header.size() != 1
+        || !read_section( baked::section_id::planes, baked_planes )
+        || !read_section( baked::section_id::nodes, baked_nodes )
+        || !read_section( baked::section_id::leaves, baked_leaves )
+        || !read_section( baked::section_id::brushes, baked_brushes )
+        || !read_section( baked::section_id::brush_sides, baked_brush_sides )
+        || !read_section( baked::section_id::leaf_faces, baked_leaf_faces )
+        || !read_section( baked::section_id::leaf_brushes, baked_leaf_brushes )
+        || !read_section( baked::section_id::polygons, baked_polygons )
+        || !read_section( baked::section_id::polygon_verts, baked_polygon_verts )
+        || !read_section( baked::section_id::polygon_edge_planes, baked_polygon_edge_planes )
+        || !read_section( baked::section_id::visibility_clusters, baked_visibility_clusters )
+        || baked_visibility_clusters.size() != 1
+        || !read_section( baked::section_id::visibility_rows, baked_visibility_rows )
+        || !read_section( baked::section_id::displacements, baked_displacements )
+        || !read_section( baked::section_id::disp_positions, baked_disp_positions )
+        || !read_section( baked::section_id::disp_nodes, baked_disp_nodes )
+        || !read_section( baked::section_id::disp_bvh, baked_disp_bvh )
+        || !read_section( baked::section_id::models, baked_models )
+        || !read_section( baked::section_id::entities, baked_entity_data )
+        || baked::payload_hash( table.data(), section_hashes.data(), table.size() ) != header.payload_hash
+        || !deserialize_entities( baked_entity_data.data(), baked_entity_data.size(), baked_entity_text, baked_entity_keyvalues, baked_entity_ends ) ) {
+        return false;
+    }
+
+    /// displacements are walked through raw pointers, so their ranges have to fit
+    const auto displacement_fits = [&]( const valve::displacement_t& displacement )
+    {
+        if( displacement.power < static_cast<std::int32_t>( valve::MIN_MAP_DISP_POWER )
+            || displacement.power > static_cast<std::int32_t>( valve::MAX_MAP_DISP_POWER )
+            || displacement.first_vert < 0 || displacement.first_node < 0 ) {
+            return false;
+        }
+
+        const auto size      = ( std::size_t{ 1 } << displacement.power ) + 1;
+        const auto num_nodes = ( ( std::size_t{ 1 } << ( 2 * displacement.power + 2 ) ) - 1 ) / 3;
+        return static_cast<std::size_t>( displacement.first_vert ) + size * size <= baked_disp_positions.size()
+            && static_cast<std::size_t>( displacement.first_node ) + num_nodes <= baked_disp_nodes.size();
+    };
+    /// inner nodes have both children behind them, so walks can't loop, and no leaf sits deeper than the walks' stacks allow
+    std::vector<std::size_t> bvh_depths( baked_disp_bvh.size(), 0 );
+    const auto bvh_node_fits = [&]( const std::size_t index )
+    {
+        const auto& node = baked_disp_bvh.at( index );
+        if( node.first < 0 || node.num_boxes < 0 ) {
+            return false;
+        }
+        if( node.num_boxes ) {
+            return static_cast<std::size_t>( node.first ) + static_cast<std::size_t>( node.num_boxes ) <= baked_displacements.size();
+        }
+
+        const auto second = static_cast<std::size_t>( node.first );
+        const auto depth  = bvh_depths.at( index ) + 1;
+        if( second <= index + 1 || second >= baked_disp_bvh.size() || depth > valve::MAX_BVH_DEPTH ) {
+            return false;
+        }
+        bvh_depths.at( index + 1 ) = std::max( bvh_depths.at( index + 1 ), depth );
+        bvh_depths.at( second )    = std::max( bvh_depths.at( second ), depth );
+        return true;
+    };
+    if( !std::all_of( baked_displacements.begin(), baked_displacements.end(), displacement_fits ) ) {
+        return false;
+    }
+    for( std::size_t i = 0; i < baked_disp_bvh.size(); ++i ) {
+        if( !bvh_node_fits( i ) ) {
+            return false;
+        }
+    }
+
+    bsp_header          = baked_header.front();
+    planes              = std::move( baked_planes );
+    nodes               = std::move( baked_nodes );
+    leaves              = std::move( baked_leaves );
+    brushes             = std::move( baked_brushes );
+    brush_sides         = std::move( baked_brush_sides );
+    leaf_faces          = std::move( baked_leaf_faces );
+    leaf_brushes        = std::move( baked_leaf_brushes );
+    polygons            = std::move( baked_polygons );
+    polygon_verts       = std::move( baked_polygon_verts );
+    polygon_edge_planes = std::move( baked_polygon_edge_planes );
+    store_entities( std::move( baked_entity_text ), std::move( baked_entity_keyvalues ), baked_entity_ends );
+    displacements       = std::move( baked_displacements );
+    disp_positions      = std::move( baked_disp_positions );
+    disp_nodes          = std::move( baked_disp_nodes );
+    disp_bvh            = std::move( baked_disp_bvh );
+    models              = std::move( baked_models );
+
+    visibility.num_clusters = std::max( baked_visibility_clusters.front(), 0 );
+    visibility.row_size     = ( static_cast<std::size_t>( visibility.num_clusters ) + 7 ) / 8;
+    visibility.rows         = std::move( baked_visibility_rows );
+    if( visibility.rows.size() != visibility.row_size * static_cast<std::size_t>( visibility.num_clusters ) ) {
+        visibility.clear();
+    }
+
+    vertices.clear();
+    edges.clear();
+    surf_edges.clear();
+    surfaces.clear();
+    tex_infos.clear();
+
+    /// the stored nodes still point into the arrays of the process that baked them
+    link_nodes();
+    build_brush_planes();
+    build_entity_index();
+
+#if defined(RN_BSP_PARSER_MESSAGES)
+    std::printf( "[+] Loaded baked map: %s\n", file_path.data() );
+#endif
+
+    return true;
+}
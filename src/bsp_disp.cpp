@@ -0,0 +1,340 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include <valve-bsp-parser/bsp_map.hpp>
+#include <algorithm>
+
+using namespace rn;
+
+namespace {
+/// <summary>
+/// Pending BVH nodes clip_to_displacements keeps around
+/// </summary>
+constexpr std::size_t DISP_BVH_STACK_SIZE = 64;
+
+static_assert( DISP_BVH_STACK_SIZE > valve::MAX_BVH_DEPTH, "a walk keeps at most MAX_BVH_DEPTH + 1 nodes pending" );
+
+/// <summary>
+/// Pending quadtree nodes of one displacement, every level leaves three
+/// siblings behind
+/// </summary>
+constexpr std::size_t DISP_QUADTREE_STACK_SIZE = 3 * valve::MAX_MAP_DISP_POWER + 1;
+
+/// <summary>
+/// Index of the first node of a quadtree level
+/// </summary>
+constexpr std::size_t level_offset(
+    const std::size_t level
+)
+{
+    return ( ( std::size_t{ 1 } << ( 2 * level ) ) - 1 ) / 3;
+}
+
+/// <summary>
+/// Fraction at which origin + t * delta crosses triangle (a, b, c) from
+/// either side, -1 when it misses
+/// </summary>
+float intersect_triangle(
+    const vector3& origin,
+    const vector3& delta,
+    const vector3& a,
+    const vector3& b,
+    const vector3& c
+)
+{
+    vector3 edge_first, edge_second, offset;
+    for( std::size_t k = 0; k < 3; ++k ) {
+        edge_first( k )  = b( k ) - a( k );
+        edge_second( k ) = c( k ) - a( k );
+        offset( k )      = origin( k ) - a( k );
+    }
+
+    const auto p           = delta.cross( edge_second );
+    const auto determinant = edge_first.dot( p );
+    if( determinant == 0.f ) {
+        return -1.f;
+    }
+
+    const auto inversed_determinant = 1.f / determinant;
+
+    const auto u = offset.dot( p ) * inversed_determinant;
+    if( u < 0.f || u > 1.f ) {
+        return -1.f;
+    }
+
+    const auto q = offset.cross( edge_first );
+    const auto v = delta.dot( q ) * inversed_determinant;
+    if( v < 0.f || u + v > 1.f ) {
+        return -1.f;
+    }
+
+    return edge_second.dot( q ) * inversed_determinant;
+}
+}
+
+bool bsp_map::build_displacements()
+{
+    displacements.clear();
+    disp_positions.clear();
+    disp_nodes.clear();
+    disp_bvh.clear();
+
+    const auto& disp_infos = _scratch->disp_infos;
+    const auto& disp_verts = _scratch->disp_verts;
+
+    for( const auto& info : disp_infos ) {
+        if( info.power < static_cast<std::int32_t>( valve::MIN_MAP_DISP_POWER )
+            || info.power > static_cast<std::int32_t>( valve::MAX_MAP_DISP_POWER )
+            || info.map_face >= surfaces.size() ) {
+            continue;
+        }
+
+        const auto& surface = surfaces.at( info.map_face );
+        if( surface.num_edges != 4 ) {
+            continue;
+        }
+
+        const auto size       = ( std::size_t{ 1 } << info.power ) + 1;
+        const auto num_verts  = size * size;
+        const auto first_vert = static_cast<std::size_t>( info.disp_vert_start );
+        if( info.disp_vert_start < 0 || first_vert + num_verts > disp_verts.size() ) {
+            continue;
+        }
+
+        /// the base face's corners, starting with the one the displacement was authored from
+        std::array<vector3, 4> corners;
+        std::size_t            start_corner  = 0;
+        auto                   best_distance = 0.f;
+        for( std::size_t i = 0; i < corners.size(); ++i ) {
+            const auto edge_index = surf_edges.at( surface.first_edge + static_cast<std::int32_t>( i ) );
+            if( edge_index >= 0 ) {
+                corners.at( i ) = vertices.at( edges.at( edge_index ).v.at( 0 ) ).position;
+            }
+            else {
+                corners.at( i ) = vertices.at( edges.at( -edge_index ).v.at( 1 ) ).position;
+            }
+
+            auto distance = 0.f;
+            for( std::size_t k = 0; k < 3; ++k ) {
+                const auto offset = corners.at( i )( k ) - info.start_position( k );
+                distance += offset * offset;
+            }
+            if( !i || distance < best_distance ) {
+                start_corner  = i;
+                best_distance = distance;
+            }
+        }
+        std::rotate( corners.begin(), corners.begin() + static_cast<std::ptrdiff_t>( start_corner ), corners.end() );
+
+        valve::displacement_t displacement{};
+        displacement.first_vert = static_cast<std::int32_t>( disp_positions.size() );
+        displacement.first_node = static_cast<std::int32_t>( disp_nodes.size() );
+        displacement.power      = info.power;
+        displacement.contents   = info.contents;
+        displacement.face       = info.map_face;
+
+        /// rows run from the first corner to the second, columns from the left edge to the right one
+        const auto scale = 1.f / static_cast<float>( size - 1 );
+        for( std::size_t row = 0; row < size; ++row ) {
+            const auto row_ratio = static_cast<float>( row ) * scale;
+            for( std::size_t column = 0; column < size; ++column ) {
+                const auto  column_ratio = static_cast<float>( column ) * scale;
+                const auto& vert         = disp_verts.at( first_vert + row * size + column );
+
+                vector3 position;
+                for( std::size_t k = 0; k < 3; ++k ) {
+                    const auto left  = corners.at( 0 )( k ) + ( corners.at( 1 )( k ) - corners.at( 0 )( k ) ) * row_ratio;
+                    const auto right = corners.at( 3 )( k ) + ( corners.at( 2 )( k ) - corners.at( 3 )( k ) ) * row_ratio;
+                    position( k ) = left + ( right - left ) * column_ratio + vert.vector( k ) * vert.distance;
+                }
+                disp_positions.push_back( position );
+            }
+        }
+
+        /// the deepest level bounds one quad each, every level above merges four of them
+        const auto power = static_cast<std::size_t>( info.power );
+        disp_nodes.resize( disp_nodes.size() + level_offset( power + 1 ) );
+
+        const auto* positions = disp_positions.data() + displacement.first_vert;
+        auto*       nodes     = disp_nodes.data() + displacement.first_node;
+
+        const auto quads = size - 1;
+        for( std::size_t y = 0; y < quads; ++y ) {
+            for( std::size_t x = 0; x < quads; ++x ) {
+                auto& node = nodes[ level_offset( power ) + y * quads + x ];
+                node.mins  = positions[ y * size + x ];
+                node.maxs  = node.mins;
+                for( const auto corner : { y * size + x + 1, ( y + 1 ) * size + x, ( y + 1 ) * size + x + 1 } ) {
+                    for( std::size_t k = 0; k < 3; ++k ) {
+                        node.mins( k ) = std::min( node.mins( k ), positions[ corner ]( k ) );
+                        node.maxs( k ) = std::max( node.maxs( k ), positions[ corner ]( k ) );
+                    }
+                }
+            }
+        }
+
+        for( auto level = power; level-- > 0; ) {
+            const auto width = std::size_t{ 1 } << level;
+            for( std::size_t y = 0; y < width; ++y ) {
+                for( std::size_t x = 0; x < width; ++x ) {
+                    auto& node = nodes[ level_offset( level ) + y * width + x ];
+
+                    const auto* children = nodes + level_offset( level + 1 );
+                    const auto  first    = 2 * y * 2 * width + 2 * x;
+
+                    node = children[ first ];
+                    for( const auto child : { first + 1, first + 2 * width, first + 2 * width + 1 } ) {
+                        for( std::size_t k = 0; k < 3; ++k ) {
+                            node.mins( k ) = std::min( node.mins( k ), children[ child ].mins( k ) );
+                            node.maxs( k ) = std::max( node.maxs( k ), children[ child ].maxs( k ) );
+                        }
+                    }
+                }
+            }
+        }
+
+        displacements.push_back( displacement );
+    }
+
+    build_disp_bvh();
+    return true;
+}
+
+void bsp_map::build_disp_bvh()
+{
+    std::vector<vector3> mins( displacements.size() ), maxs( displacements.size() );
+    for( std::size_t i = 0; i < displacements.size(); ++i ) {
+        const auto& root = disp_nodes.at( static_cast<std::size_t>( displacements.at( i ).first_node ) );
+        mins.at( i ) = root.mins;
+        maxs.at( i ) = root.maxs;
+    }
+
+    const auto order = build_bvh( mins, maxs, disp_bvh );
+
+    std::vector<valve::displacement_t> ordered;
+    ordered.reserve( displacements.size() );
+    for( const auto displacement : order ) {
+        ordered.push_back( displacements.at( displacement ) );
+    }
+    displacements = std::move( ordered );
+}
+
+void bsp_map::clip_to_displacements(
+    const vector3&  origin,
+    const vector3&  destination,
+    valve::trace_t* out
+) const
+{
+    if( disp_bvh.empty() ) {
+        return;
+    }
+
+    vector3 delta;
+    for( std::size_t k = 0; k < 3; ++k ) {
+        delta( k ) = destination( k ) - origin( k );
+    }
+
+    const vector3 no_extents( 0.f, 0.f, 0.f );
+
+    std::array<std::int32_t, DISP_BVH_STACK_SIZE> stack;
+    std::size_t                                   stack_size = 0;
+
+    stack.at( stack_size++ ) = 0;
+    while( stack_size ) {
+        const auto& node = disp_bvh.at( static_cast<std::size_t>( stack.at( --stack_size ) ) );
+
+        auto enter = 0.f;
+        auto leave = out->fraction;
+        if( !clip_to_box( origin, delta, no_extents, node.mins, node.maxs, enter, leave ) ) {
+            continue;
+        }
+
+        if( !node.num_boxes ) {
+            stack.at( stack_size++ ) = node.first;
+            stack.at( stack_size++ ) = static_cast<std::int32_t>( &node - disp_bvh.data() ) + 1;
+            continue;
+        }
+
+        for( auto i = node.first; i < node.first + node.num_boxes; ++i ) {
+            ray_cast_displacement( static_cast<std::size_t>( i ), origin, delta, out );
+        }
+    }
+}
+
+void bsp_map::ray_cast_displacement(
+    const std::size_t disp_index,
+    const vector3&    origin,
+    const vector3&    delta,
+    valve::trace_t*   out
+) const
+{
+    struct quad_entry
+    {
+        std::uint32_t level;
+        std::uint32_t x;
+        std::uint32_t y;
+    };
+
+    const auto& displacement = displacements.at( disp_index );
+    const auto  power        = static_cast<std::uint32_t>( displacement.power );
+    const auto  size         = ( std::size_t{ 1 } << power ) + 1;
+    const auto* positions    = disp_positions.data() + displacement.first_vert;
+    const auto* nodes        = disp_nodes.data() + displacement.first_node;
+
+    const vector3 no_extents( 0.f, 0.f, 0.f );
+
+    std::array<quad_entry, DISP_QUADTREE_STACK_SIZE> stack;
+    std::size_t                                      stack_size = 0;
+
+    stack.at( stack_size++ ) = { 0, 0, 0 };
+    while( stack_size ) {
+        const auto entry = stack.at( --stack_size );
+        const auto width = std::size_t{ 1 } << entry.level;
+        const auto& node = nodes[ level_offset( entry.level ) + entry.y * width + entry.x ];
+
+        auto enter = 0.f;
+        auto leave = out->fraction;
+        if( !clip_to_box( origin, delta, no_extents, node.mins, node.maxs, enter, leave ) ) {
+            continue;
+        }
+
+        if( entry.level < power ) {
+            for( std::uint32_t child = 0; child < 4; ++child ) {
+                stack.at( stack_size++ ) = { entry.level + 1, 2 * entry.x + ( child & 1 ), 2 * entry.y + ( child >> 1 ) };
+            }
+            continue;
+        }
+
+        /// the quad's diagonal alternates like the engine builds it
+        const auto index = entry.y * size + entry.x;
+
+        std::array<std::array<std::size_t, 3>, 2> triangles;
+        if( index % 2 ) {
+            triangles = { { { index, index + size, index + 1 }, { index + 1, index + size, index + size + 1 } } };
+        }
+        else {
+            triangles = { { { index, index + size, index + size + 1 }, { index, index + size + 1, index + 1 } } };
+        }
+
+        for( const auto& triangle : triangles ) {
+            const auto fraction = intersect_triangle( origin,
+                                                      delta,
+                                                      positions[ triangle.at( 0 ) ],
+                                                      positions[ triangle.at( 1 ) ],
+                                                      positions[ triangle.at( 2 ) ] );
+            if( fraction <= 0.f || fraction >= out->fraction ) {
+                continue;
+            }
+
+            out->fraction        = fraction;
+            out->contents        = displacement.contents;
+            out->brush           = nullptr;
+            out->num_brush_sides = 0;
+            out->static_prop     = -1;
+            out->displacement    = static_cast<std::int32_t>( disp_index );
+            out->surface         = -1;
+        }
+    }
+}
@@ -0,0 +1,329 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include <valve-bsp-parser/bsp_map.hpp>
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+
+using namespace rn;
+
+namespace {
+/// <summary>
+/// Pending BVH nodes the spatial queries keep around
+/// </summary>
+constexpr std::size_t ENTITY_BVH_STACK_SIZE = 64;
+
+static_assert( ENTITY_BVH_STACK_SIZE > valve::MAX_BVH_DEPTH, "a walk keeps at most MAX_BVH_DEPTH + 1 nodes pending" );
+
+/// <summary>
+/// Longest value parse_floats copies, vectors are far shorter
+/// </summary>
+constexpr std::size_t MAX_NUMBER_TEXT = 128;
+
+/// <summary>
+/// Reads up to count whitespace separated floats from text, views into the
+/// entity text are not null terminated so they are parsed from a copy
+/// </summary>
+std::size_t parse_floats(
+    const std::string_view text,
+    float*                 values,
+    const std::size_t      count
+)
+{
+    if( text.empty() || text.size() >= MAX_NUMBER_TEXT ) {
+        return 0;
+    }
+
+    std::array<char, MAX_NUMBER_TEXT> buffer;
+    std::copy( text.begin(), text.end(), buffer.begin() );
+    buffer.at( text.size() ) = '\0';
+
+    const char* position = buffer.data();
+    std::size_t parsed   = 0;
+    while( parsed < count ) {
+        char*      end   = nullptr;
+        const auto value = std::strtof( position, &end );
+        if( end == position ) {
+            break;
+        }
+        values[ parsed++ ] = value;
+        position           = end;
+    }
+    return parsed;
+}
+
+/// <summary>
+/// Reads the whole of text as a decimal index, false for anything else
+/// (signs, fractions, exponents, trailing text or values past size_t)
+/// </summary>
+bool parse_index(
+    const std::string_view text,
+    std::size_t&           index
+)
+{
+    const auto* last   = text.data() + text.size();
+    const auto  result = std::from_chars( text.data(), last, index );
+    return result.ec == std::errc{} && result.ptr == last;
+}
+
+/// <summary>
+/// Assigns every distinct value an id in the order it first shows up and
+/// lays the entities out grouped by id, first[ id ] to first[ id + 1 ]
+/// </summary>
+void build_lookup(
+    const std::vector<std::string_view>&                 values,
+    std::unordered_map<std::string_view, std::uint32_t>& ids,
+    std::vector<std::uint32_t>&                          first,
+    std::vector<std::uint32_t>&                          members
+)
+{
+    std::vector<std::uint32_t> entity_ids( values.size(), 0 );
+    for( std::size_t i = 0; i < values.size(); ++i ) {
+        if( values.at( i ).empty() ) {
+            continue;
+        }
+        const auto it = ids.emplace( values.at( i ), static_cast<std::uint32_t>( ids.size() ) ).first;
+        entity_ids.at( i ) = it->second;
+    }
+
+    first.assign( ids.size() + 1, 0 );
+    for( std::size_t i = 0; i < values.size(); ++i ) {
+        if( !values.at( i ).empty() ) {
+            ++first.at( entity_ids.at( i ) + 1 );
+        }
+    }
+    for( std::size_t id = 0; id < ids.size(); ++id ) {
+        first.at( id + 1 ) += first.at( id );
+    }
+
+    members.resize( first.back() );
+    auto next = first;
+    for( std::size_t i = 0; i < values.size(); ++i ) {
+        if( !values.at( i ).empty() ) {
+            members.at( next.at( entity_ids.at( i ) )++ ) = static_cast<std::uint32_t>( i );
+        }
+    }
+}
+
+/// <summary>
+/// Collects the entities of pattern, a trailing * turns it into a prefix match
+/// </summary>
+void find_in_lookup(
+    std::string_view                                           pattern,
+    const std::unordered_map<std::string_view, std::uint32_t>& ids,
+    const std::vector<std::uint32_t>&                          first,
+    const std::vector<std::uint32_t>&                          members,
+    std::vector<std::uint32_t>&                                out
+)
+{
+    out.clear();
+
+    auto append = [&]( const std::uint32_t id )
+    {
+        out.insert( out.end(),
+                    members.begin() + first.at( id ),
+                    members.begin() + first.at( id + 1 ) );
+    };
+
+    if( pattern.empty() || pattern.back() != '*' ) {
+        const auto it = ids.find( pattern );
+        if( it != ids.end() ) {
+            append( it->second );
+        }
+        return;
+    }
+
+    pattern.remove_suffix( 1 );
+    for( const auto& [ value, id ] : ids ) {
+        if( value.substr( 0, pattern.size() ) == pattern ) {
+            append( id );
+        }
+    }
+    std::sort( out.begin(), out.end() );
+}
+}
+
+void bsp_map::build_entity_index()
+{
+    entity_index.clear();
+
+    const auto num_entities = entities.size();
+
+    std::vector<std::string_view> classnames( num_entities ), targetnames( num_entities );
+    for( std::size_t i = 0; i < num_entities; ++i ) {
+        classnames.at( i )  = entities.at( i ).value( "classname" );
+        targetnames.at( i ) = entities.at( i ).value( "targetname" );
+    }
+    build_lookup( classnames, entity_index.class_ids, entity_index.class_first, entity_index.class_entities );
+    build_lookup( targetnames, entity_index.name_ids, entity_index.name_first, entity_index.name_entities );
+
+    entity_index.origins.assign( num_entities, vector3( 0.f, 0.f, 0.f ) );
+    entity_index.angles.assign( num_entities, vector3( 0.f, 0.f, 0.f ) );
+    entity_index.bounds.resize( num_entities );
+
+    std::vector<vector3>       mins, maxs;
+    std::vector<std::uint32_t> bounded;
+    for( std::size_t i = 0; i < num_entities; ++i ) {
+        const auto& entity = entities.at( i );
+        auto&       origin = entity_index.origins.at( i );
+
+        std::array<float, 3> values{};
+        const auto           has_origin = parse_floats( entity.value( "origin" ), values.data(), 3 ) == 3;
+        if( has_origin ) {
+            origin = vector3( values.at( 0 ), values.at( 1 ), values.at( 2 ) );
+        }
+        if( parse_floats( entity.value( "angles" ), values.data(), 3 ) == 3 ) {
+            entity_index.angles.at( i ) = vector3( values.at( 0 ), values.at( 1 ), values.at( 2 ) );
+        }
+
+        /// brush entities reference their model as *N, rotation is not applied to its bounds
+        auto&      bounds = entity_index.bounds.at( i );
+        const auto model  = entity.value( "model" );
+        std::size_t number = 0;
+        if( model.size() > 1 && model.front() == '*'
+            && parse_index( model.substr( 1 ), number )
+            && number < models.size() ) {
+            const auto& brush_model = models.at( number );
+            for( std::size_t k = 0; k < 3; ++k ) {
+                bounds.mins( k ) = brush_model.mins( k ) + origin( k );
+                bounds.maxs( k ) = brush_model.maxs( k ) + origin( k );
+            }
+        }
+        else if( has_origin ) {
+            bounds.mins = origin;
+            bounds.maxs = origin;
+        }
+        else {
+            bounds.mins = vector3( 0.f, 0.f, 0.f );
+            bounds.maxs = bounds.mins;
+            continue;
+        }
+
+        mins.push_back( bounds.mins );
+        maxs.push_back( bounds.maxs );
+        bounded.push_back( static_cast<std::uint32_t>( i ) );
+    }
+
+    const auto order = build_bvh( mins, maxs, entity_index.bvh );
+    entity_index.bvh_entities.reserve( order.size() );
+    for( const auto box : order ) {
+        entity_index.bvh_entities.push_back( bounded.at( box ) );
+    }
+}
+
+void bsp_map::find_entities_by_class(
+    const std::string_view      classname,
+    std::vector<std::uint32_t>& out
+) const
+{
+    find_in_lookup( classname, entity_index.class_ids, entity_index.class_first, entity_index.class_entities, out );
+}
+
+void bsp_map::find_entities_by_name(
+    const std::string_view      targetname,
+    std::vector<std::uint32_t>& out
+) const
+{
+    find_in_lookup( targetname, entity_index.name_ids, entity_index.name_first, entity_index.name_entities, out );
+}
+
+void bsp_map::find_entities_in_radius(
+    const vector3&              center,
+    const float                 radius,
+    std::vector<std::uint32_t>& out
+) const
+{
+    out.clear();
+    if( entity_index.bvh.empty() || radius < 0.f ) {
+        return;
+    }
+
+    const auto radius_squared = radius * radius;
+
+    auto distance_squared = [&]( const vector3& mins, const vector3& maxs )
+    {
+        auto distance = 0.f;
+        for( std::size_t k = 0; k < 3; ++k ) {
+            const auto offset = center( k ) - std::clamp( center( k ), mins( k ), maxs( k ) );
+            distance += offset * offset;
+        }
+        return distance;
+    };
+
+    std::array<std::int32_t, ENTITY_BVH_STACK_SIZE> stack;
+    std::size_t                                     stack_size = 0;
+
+    stack.at( stack_size++ ) = 0;
+    while( stack_size ) {
+        const auto& node = entity_index.bvh.at( static_cast<std::size_t>( stack.at( --stack_size ) ) );
+        if( distance_squared( node.mins, node.maxs ) > radius_squared ) {
+            continue;
+        }
+
+        if( !node.num_boxes ) {
+            stack.at( stack_size++ ) = node.first;
+            stack.at( stack_size++ ) = static_cast<std::int32_t>( &node - entity_index.bvh.data() ) + 1;
+            continue;
+        }
+
+        for( auto i = node.first; i < node.first + node.num_boxes; ++i ) {
+            const auto  entity = entity_index.bvh_entities.at( static_cast<std::size_t>( i ) );
+            const auto& bounds = entity_index.bounds.at( entity );
+            if( distance_squared( bounds.mins, bounds.maxs ) <= radius_squared ) {
+                out.push_back( entity );
+            }
+        }
+    }
+    std::sort( out.begin(), out.end() );
+}
+
+void bsp_map::find_entities_in_box(
+    const vector3&              mins,
+    const vector3&              maxs,
+    std::vector<std::uint32_t>& out
+) const
+{
+    out.clear();
+    if( entity_index.bvh.empty() ) {
+        return;
+    }
+
+    auto overlaps = [&]( const vector3& other_mins, const vector3& other_maxs )
+    {
+        for( std::size_t k = 0; k < 3; ++k ) {
+            if( other_mins( k ) > maxs( k ) || other_maxs( k ) < mins( k ) ) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    std::array<std::int32_t, ENTITY_BVH_STACK_SIZE> stack;
+    std::size_t                                     stack_size = 0;
+
+    stack.at( stack_size++ ) = 0;
+    while( stack_size ) {
+        const auto& node = entity_index.bvh.at( static_cast<std::size_t>( stack.at( --stack_size ) ) );
+        if( !overlaps( node.mins, node.maxs ) ) {
+            continue;
+        }
+
+        if( !node.num_boxes ) {
+            stack.at( stack_size++ ) = node.first;
+            stack.at( stack_size++ ) = static_cast<std::int32_t>( &node - entity_index.bvh.data() ) + 1;
+            continue;
+        }
+
+        for( auto i = node.first; i < node.first + node.num_boxes; ++i ) {
+            const auto  entity = entity_index.bvh_entities.at( static_cast<std::size_t>( i ) );
+            const auto& bounds = entity_index.bounds.at( entity );
+            if( overlaps( bounds.mins, bounds.maxs ) ) {
+                out.push_back( entity );
+            }
+        }
+    }
+    std::sort( out.begin(), out.end() );
+}
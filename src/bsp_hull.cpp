@@ -0,0 +1,302 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include <valve-bsp-parser/bsp_map.hpp>
+#include <algorithm>
+#include <cmath>
+
+using namespace rn;
+
+namespace {
+/// <summary>
+/// Pending far sides hull_cast_node keeps around, deeper trees continue on
+/// a fresh stack
+/// </summary>
+constexpr std::size_t HULL_STACK_SIZE = 64;
+
+struct hull_split
+{
+    std::int32_t side_id;
+    float        fraction_first;
+    float        fraction_second;
+};
+
+/// <summary>
+/// Splits a segment that straddles a node plane widened by offset on both
+/// sides. The near side runs up to fraction_first, the far side starts at
+/// fraction_second, the two overlap by the box and DIST_EPSILON.
+/// </summary>
+hull_split split_hull_segment(
+    const float start_distance,
+    const float end_distance,
+    const float offset
+)
+{
+    hull_split split{};
+
+    if( start_distance < end_distance ) {
+        split.side_id = 1;
+        const auto inversed_distance = 1.f / ( start_distance - end_distance );
+
+        split.fraction_first  = ( start_distance - offset + valve::DIST_EPSILON ) * inversed_distance;
+        split.fraction_second = ( start_distance + offset + valve::DIST_EPSILON ) * inversed_distance;
+    }
+    else if( end_distance < start_distance ) {
+        split.side_id = 0;
+        const auto inversed_distance = 1.f / ( start_distance - end_distance );
+
+        split.fraction_first  = ( start_distance + offset + valve::DIST_EPSILON ) * inversed_distance;
+        split.fraction_second = ( start_distance - offset - valve::DIST_EPSILON ) * inversed_distance;
+    }
+    else {
+        split.side_id         = 0;
+        split.fraction_first  = 1.f;
+        split.fraction_second = 0.f;
+    }
+
+    split.fraction_first  = std::clamp( split.fraction_first, 0.f, 1.f );
+    split.fraction_second = std::clamp( split.fraction_second, 0.f, 1.f );
+    return split;
+}
+
+/// <summary>
+/// How far the box reaches along normal, axial planes skip the dot product
+/// </summary>
+float support_distance(
+    const vector3&     normal,
+    const std::uint8_t type,
+    const vector3&     extents
+)
+{
+    if( type < 3 ) {
+        return extents( type );
+    }
+
+    return std::abs( normal( 0 ) ) * extents( 0 )
+        + std::abs( normal( 1 ) ) * extents( 1 )
+        + std::abs( normal( 2 ) ) * extents( 2 );
+}
+}
+
+void bsp_map::trace_hull(
+    const vector3&     origin,
+    const vector3&     final,
+    const vector3&     mins,
+    const vector3&     maxs,
+    const std::int32_t mask,
+    valve::trace_t*    out
+) const
+{
+    if( planes.empty() || !out ) {
+        return;
+    }
+
+    out->clear();
+    out->fraction = 1.0f;
+    out->fraction_left_solid = 0.f;
+    /// clear() assumes solid, only clip_to_brush may find the box starting in a brush
+    out->start_solid = false;
+    out->all_solid   = false;
+
+    /// the box is traced centered on the segment, offset moves the segment to its center
+    hull_t hull{};
+    for( std::size_t i = 0; i < 3; ++i ) {
+        const auto offset = ( mins( i ) + maxs( i ) ) * 0.5f;
+        hull.start( i )   = origin( i ) + offset;
+        hull.end( i )     = final( i ) + offset;
+        hull.extents( i ) = ( maxs( i ) - mins( i ) ) * 0.5f;
+    }
+    hull.mask = mask;
+
+    hull_cast_node( 0, 0.f, 1.f, hull.start, hull.end, hull, out );
+    if( hull.mask & valve::CONTENTS_SOLID ) {
+        clip_to_props( hull.start, hull.end, hull.extents, out );
+    }
+
+    if( out->fraction < 1.0f ) {
+        for( std::size_t i = 0; i < 3; ++i ) {
+            out->end_pos( i ) = origin( i ) + out->fraction * ( final( i ) - origin( i ) );
+        }
+    }
+    else {
+        out->end_pos = final;
+    }
+}
+
+void bsp_map::hull_cast_node(
+    std::int32_t    node_index,
+    float           start_fraction,
+    float           end_fraction,
+    const vector3&  origin,
+    const vector3&  destination,
+    const hull_t&   hull,
+    valve::trace_t* out
+) const
+{
+    struct traversal_entry
+    {
+        std::int32_t         node_index;
+        float                start_fraction;
+        float                end_fraction;
+        std::array<float, 3> origin;
+        std::array<float, 3> destination;
+    };
+
+    std::array<traversal_entry, HULL_STACK_SIZE> stack;
+    std::size_t                                  stack_size = 0;
+
+    vector3 segment_origin      = origin;
+    vector3 segment_destination = destination;
+
+    for( ;; ) {
+        /// a hit at fraction 0 doesn't end the walk where the box starts, it may start in a brush further on
+        if( out->fraction > start_fraction || start_fraction == 0.f ) {
+            if( node_index < 0 ) {
+                hull_cast_leaf( static_cast<std::size_t>( -node_index - 1 ), hull, out );
+            }
+            else {
+                const auto& node = trace_nodes.at( static_cast<std::size_t>( node_index ) );
+
+                float start_distance, end_distance;
+
+                if( node.type < 3 ) {
+                    start_distance = segment_origin( static_cast<std::size_t>( node.type ) ) - node.distance;
+                    end_distance   = segment_destination( static_cast<std::size_t>( node.type ) ) - node.distance;
+                }
+                else {
+                    start_distance = segment_origin.dot( node.normal ) - node.distance;
+                    end_distance   = segment_destination.dot( node.normal ) - node.distance;
+                }
+
+                /// the box only stays on one side when it clears the plane by its reach along the normal
+                const auto offset = support_distance( node.normal, node.type, hull.extents );
+
+                if( start_distance >= offset && end_distance >= offset ) {
+                    node_index = node.children.at( 0 );
+                    continue;
+                }
+                if( start_distance < -offset && end_distance < -offset ) {
+                    node_index = node.children.at( 1 );
+                    continue;
+                }
+
+                const auto split = split_hull_segment( start_distance, end_distance, offset );
+
+                const auto fraction_first  = start_fraction + ( end_fraction - start_fraction ) * split.fraction_first;
+                const auto fraction_second = start_fraction + ( end_fraction - start_fraction ) * split.fraction_second;
+
+                vector3 middle_first, middle_second;
+                for( std::size_t i = 0; i < 3; i++ ) {
+                    middle_first( i )  = segment_origin( i ) + split.fraction_first * ( segment_destination( i ) - segment_origin( i ) );
+                    middle_second( i ) = segment_origin( i ) + split.fraction_second * ( segment_destination( i ) - segment_origin( i ) );
+                }
+
+                const auto near_index = node.children.at( split.side_id );
+                const auto far_index  = node.children.at( !split.side_id );
+
+                if( stack_size < stack.size() ) {
+                    auto& entry = stack.at( stack_size++ );
+                    entry.node_index     = far_index;
+                    entry.start_fraction = fraction_second;
+                    entry.end_fraction   = end_fraction;
+                    for( std::size_t i = 0; i < 3; i++ ) {
+                        entry.origin.at( i )      = middle_second( i );
+                        entry.destination.at( i ) = segment_destination( i );
+                    }
+
+                    node_index          = near_index;
+                    end_fraction        = fraction_first;
+                    segment_destination = middle_first;
+                    continue;
+                }
+
+                hull_cast_node( near_index, start_fraction, fraction_first, segment_origin, middle_first, hull, out );
+
+                node_index     = far_index;
+                start_fraction = fraction_second;
+                segment_origin = middle_second;
+                continue;
+            }
+        }
+
+        if( !stack_size ) {
+            return;
+        }
+
+        const auto& entry = stack.at( --stack_size );
+        node_index          = entry.node_index;
+        start_fraction      = entry.start_fraction;
+        end_fraction        = entry.end_fraction;
+        segment_origin      = vector3( entry.origin.at( 0 ), entry.origin.at( 1 ), entry.origin.at( 2 ) );
+        segment_destination = vector3( entry.destination.at( 0 ), entry.destination.at( 1 ), entry.destination.at( 2 ) );
+    }
+}
+
+void bsp_map::hull_cast_leaf(
+    const std::size_t leaf_index,
+    const hull_t&     hull,
+    valve::trace_t*   out
+) const
+{
+    const auto& leaf = leaves.at( leaf_index );
+    for( std::uint16_t i = 0; i < leaf.num_leafbrushes; ++i ) {
+        const auto& brush = brushes.at( leaf_brushes.at( leaf.first_leafbrush + i ) );
+        if( !( brush.contents & hull.mask ) ) {
+            continue;
+        }
+
+        hull_cast_brush( &brush, hull, out );
+        /// a box touching a brush at the start may still start in another one
+        if( out->fraction == 0.f && out->fraction_left_solid == 1.f ) {
+            return;
+        }
+    }
+}
+
+void bsp_map::hull_cast_brush(
+    const valve::dbrush_t* brush,
+    const hull_t&          hull,
+    valve::trace_t*        out
+) const
+{
+    if( !brush->num_sides ) {
+        return;
+    }
+
+    auto fraction_to_enter = -99.f;
+    auto fraction_to_leave = 1.f;
+    auto starts_out        = false;
+    auto ends_out          = false;
+
+    for( std::int32_t i = 0; i < brush->num_sides; ++i ) {
+        const auto& side  = brush_sides.at( static_cast<std::size_t>( brush->first_side + i ) );
+        const auto& plane = planes.at( side.plane_num );
+
+        /// push the side out until the box touches it with its closest corner
+        const auto distance       = plane.distance + support_distance( plane.normal, plane.type, hull.extents );
+        const auto start_distance = hull.start.dot( plane.normal ) - distance;
+        const auto end_distance   = hull.end.dot( plane.normal ) - distance;
+
+        if( start_distance > 0.f && end_distance > 0.f ) {
+            return;
+        }
+
+        if( start_distance > 0.f ) {
+            starts_out = true;
+
+            auto enter_distance = start_distance - valve::DIST_EPSILON;
+            if( enter_distance < 0.f ) {
+                enter_distance = 0.f;
+            }
+            fraction_to_enter = std::max( fraction_to_enter, enter_distance / ( start_distance - end_distance ) );
+        }
+        else if( end_distance > 0.f ) {
+            ends_out = true;
+            fraction_to_leave = std::min( fraction_to_leave, ( start_distance + valve::DIST_EPSILON ) / ( start_distance - end_distance ) );
+        }
+    }
+
+    clip_to_brush( brush, fraction_to_enter, fraction_to_leave, starts_out, ends_out, out );
+}
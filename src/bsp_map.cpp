@@ -0,0 +1,1692 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include <valve-bsp-parser/bsp_map.hpp>
+#include <valve-bsp-parser/core/simd.hpp>
+#include <filesystem>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace rn;
+
+namespace {
+/// <summary>
+/// One unit of load work and the steps it has to wait for
+/// </summary>
+struct load_step
+{
+    std::function<bool()>    work;
+    std::vector<std::size_t> dependencies;
+};
+
+bool is_cancelled(
+    const std::atomic<bool>* cancelled
+)
+{
+    return cancelled && cancelled->load();
+}
+
+/// <summary>
+/// Runs every step as soon as all of its dependencies finished. Steps whose
+/// dependencies failed are skipped, once cancelled is set every step fails.
+/// Without a pool everything runs inline on the calling thread, in the order
+/// the steps became ready.
+/// </summary>
+bool run_load_steps(
+    const std::vector<load_step>& steps,
+    thread_pool*                  pool,
+    const std::atomic<bool>*      cancelled
+)
+{
+    const auto num_steps = steps.size();
+
+    std::vector<std::vector<std::size_t>> dependents( num_steps );
+    auto remaining = std::make_unique<std::atomic<std::size_t>[]>( num_steps );
+    for( std::size_t i = 0; i < num_steps; ++i ) {
+        remaining[ i ] = steps.at( i ).dependencies.size();
+        for( const auto dependency : steps.at( i ).dependencies ) {
+            dependents.at( dependency ).push_back( i );
+        }
+    }
+
+    std::atomic<bool> succeeded{ true };
+    task_group        group( pool );
+
+    std::function<void( std::size_t )> schedule = [&]( const std::size_t index )
+    {
+        group.run( [&, index]
+        {
+            if( succeeded.load() && ( is_cancelled( cancelled ) || !steps.at( index ).work() ) ) {
+                succeeded = false;
+            }
+            for( const auto dependent : dependents.at( index ) ) {
+                if( remaining[ dependent ].fetch_sub( 1 ) == 1 ) {
+                    schedule( dependent );
+                }
+            }
+        } );
+    };
+
+    for( std::size_t i = 0; i < num_steps; ++i ) {
+        if( steps.at( i ).dependencies.empty() ) {
+            schedule( i );
+        }
+    }
+
+    group.wait();
+    return succeeded;
+}
+
+/// <summary>
+/// Pending far sides ray_cast_node keeps around, one per split on the way
+/// down, so this bounds the tree depth handled without recursing
+/// </summary>
+constexpr std::size_t TRAVERSAL_STACK_SIZE = 64;
+
+/// <summary>
+/// Stands in for 1 / delta on axes the segment doesn't move along, large
+/// enough to push any box the origin is outside of beyond [0, 1]
+/// </summary>
+constexpr float BOUNDS_INVERSED_ZERO_DELTA = 1e30f;
+
+/// <summary>
+/// Points point_leaf_batch walks down the tree at the same time, enough to
+/// keep several node fetches in flight
+/// </summary>
+constexpr std::size_t POINT_LANES = 8;
+
+/// <summary>
+/// How a segment coming within DIST_EPSILON of a node plane is cut: the
+/// child entered first and the clamped fractions where the near and far
+/// sub-segments end and begin. Both reach DIST_EPSILON past the plane, the
+/// brush test stops rays that far before a side.
+/// </summary>
+struct node_split
+{
+    std::int32_t side_id;
+    float        fraction_first;
+    float        fraction_second;
+};
+
+node_split split_segment(
+    const float start_distance,
+    const float end_distance
+)
+{
+    node_split split{};
+
+    if( start_distance < end_distance ) {
+        /// Back
+        split.side_id = 1;
+        const auto inversed_distance = 1.f / ( start_distance - end_distance );
+
+        split.fraction_first  = ( start_distance - valve::DIST_EPSILON ) * inversed_distance;
+        split.fraction_second = ( start_distance + valve::DIST_EPSILON ) * inversed_distance;
+    }
+    else if( end_distance < start_distance ) {
+        /// Front
+        split.side_id = 0;
+        const auto inversed_distance = 1.0f / ( start_distance - end_distance );
+
+        split.fraction_first  = ( start_distance + valve::DIST_EPSILON ) * inversed_distance;
+        split.fraction_second = ( start_distance - valve::DIST_EPSILON ) * inversed_distance;
+    }
+    else {
+        /// Front
+        split.side_id         = 0;
+        split.fraction_first  = 1.f;
+        split.fraction_second = 0.f;
+    }
+
+    split.fraction_first  = std::clamp( split.fraction_first, 0.f, 1.f );
+    split.fraction_second = std::clamp( split.fraction_second, 0.f, 1.f );
+    return split;
+}
+
+/// <summary>
+/// Run-length decodes one PVS row starting at offset: a zero byte is followed
+/// by the number of zero bytes it stands for, anything else is copied as is
+/// </summary>
+bool decompress_vis_row(
+    const std::vector<std::uint8_t>& data,
+    std::size_t                      offset,
+    std::uint8_t*                    out,
+    const std::size_t                row_size
+)
+{
+    std::size_t written = 0;
+    while( written < row_size ) {
+        if( offset >= data.size() ) {
+            return false;
+        }
+
+        const auto value = data[ offset++ ];
+        if( value ) {
+            out[ written++ ] = value;
+            continue;
+        }
+
+        if( offset >= data.size() ) {
+            return false;
+        }
+        /// out is zeroed already
+        written += std::min<std::size_t>( data[ offset++ ], row_size - written );
+    }
+
+    return true;
+}
+}
+
+std::string bsp_map::lump_patch_path(
+    const std::string& file_path,
+    const std::size_t  index
+)
+{
+    //first strip bsp and add lmp extension
+    return file_path.substr( 0, file_path.size() - 4 ) //remove .bsp
+        .append( "_l_" )
+        .append( std::to_string( index ) )
+        .append( ".lmp" );
+}
+
+std::vector<std::uint8_t>& bsp_map::read_scratch()
+{
+    thread_local std::vector<std::uint8_t> buffer;
+    return buffer;
+}
+
+bsp_map::ray_t bsp_map::begin_ray(
+    const vector3& start,
+    const vector3& end
+) const
+{
+    /// stamps never repeat on a thread, so one mailbox serves every map it traces
+    struct brush_mailbox
+    {
+        std::vector<brush_mark_t> marks;
+        std::uint32_t             stamp = 0;
+    };
+    thread_local brush_mailbox mailbox;
+
+    if( mailbox.marks.size() < brushes.size() ) {
+        mailbox.marks.resize( brushes.size() );
+    }
+
+    if( !++mailbox.stamp ) {
+        std::fill( mailbox.marks.begin(), mailbox.marks.end(), brush_mark_t{} );
+        mailbox.stamp = 1;
+    }
+
+    return { start, end, mailbox.stamp, 1u, mailbox.marks.data() };
+}
+
+std::string bsp_map::map_path(
+    const std::string& directory,
+    const std::string& map_name
+)
+{
+    static auto fix_seperators = []( const std::string& input )
+    {
+        // convert seperators from DOS to UNIX
+        return std::filesystem::path( input ).generic_string();
+    };
+
+    if( directory.empty() || map_name.empty() ) {
+        return std::string();
+    }
+
+    return fix_seperators( directory )
+        .append( "/" )
+        .append( fix_seperators( map_name ) );
+}
+
+std::optional<std::string> bsp_map::load_key(
+    const std::string&  file_path,
+    const load_options& options
+)
+{
+    using prop_bounds_fn = bool( * )( const std::string&, vector3&, vector3& );
+
+    std::array<char, 64> buffer;
+    std::snprintf( buffer.data(), buffer.size(), "|%d|%d|",
+                   static_cast<int>( options.access ),
+                   static_cast<int>( options.backend ) );
+
+    auto key = file_path;
+    key += buffer.data();
+    key += options.cache_directory;
+    key += '|';
+    if( !options.prop_bounds ) {
+        return key;
+    }
+
+    if( !options.prop_bounds_key.empty() ) {
+        key += 'k';
+        key += options.prop_bounds_key;
+        return key;
+    }
+
+    /// two lambdas of one type may capture different state, only a function's address says it all
+    const auto* function = options.prop_bounds.target<prop_bounds_fn>();
+    if( !function ) {
+        return std::nullopt;
+    }
+
+    std::snprintf( buffer.data(), buffer.size(), "f%p", reinterpret_cast<const void*>( *function ) );
+    key += buffer.data();
+    return key;
+}
+
+std::size_t bsp_map::memory_usage() const
+{
+    auto bytes = []( const auto& container )
+    {
+        return container.capacity() * sizeof( typename std::decay_t<decltype( container )>::value_type );
+    };
+
+    auto total = sizeof( bsp_map ) + map_name.capacity()
+        + bytes( vertices ) + bytes( planes ) + bytes( edges ) + bytes( surf_edges )
+        + bytes( leaves ) + bytes( nodes ) + bytes( trace_nodes ) + bytes( surfaces )
+        + bytes( tex_infos ) + bytes( brushes ) + bytes( brush_sides )
+        + bytes( brush_planes.normal_x ) + bytes( brush_planes.normal_y )
+        + bytes( brush_planes.normal_z ) + bytes( brush_planes.distance )
+        + bytes( brush_planes.first_plane ) + bytes( brush_planes.num_planes ) + bytes( brush_aabbs )
+        + bytes( leaf_faces ) + bytes( leaf_brushes ) + bytes( polygons )
+        + bytes( polygon_verts ) + bytes( polygon_edge_planes ) + bytes( entity_text )
+        + bytes( entity_keyvalues ) + bytes( entities ) + bytes( models )
+        + bytes( entity_index.class_first ) + bytes( entity_index.class_entities )
+        + bytes( entity_index.name_first ) + bytes( entity_index.name_entities )
+        + bytes( entity_index.origins ) + bytes( entity_index.angles ) + bytes( entity_index.bounds )
+        + bytes( entity_index.bvh ) + bytes( entity_index.bvh_entities )
+        + bytes( visibility.rows ) + bytes( game_lumps ) + bytes( static_prop_models )
+        + bytes( static_props ) + bytes( prop_boxes ) + bytes( prop_bvh )
+        + bytes( displacements ) + bytes( disp_positions ) + bytes( disp_nodes ) + bytes( disp_bvh )
+        + bytes( brush_bvh ) + bytes( brush_bvh_brushes ) + bytes( face_bvh ) + bytes( face_bvh_faces );
+
+    for( const auto& model : static_prop_models ) {
+        total += model.capacity();
+    }
+
+    return total;
+}
+
+trace_backend bsp_map::backend() const
+{
+    return _trace_backend;
+}
+
+bool bsp_map::set_current_map(
+    const std::string& directory,
+    const std::string& map_name,
+    std::string&       file_path
+)
+{
+    file_path = map_path( directory, map_name );
+    if( file_path.empty() ) {
+        return false;
+    }
+
+    this->map_name = map_name;
+
+#if defined(RN_BSP_PARSER_MESSAGES)
+    std::printf( "[+] Loading map: %s ...\n", map_name.data() );
+#endif
+
+    return true;
+}
+
+bool bsp_map::parse_planes(
+    const file_view& file,
+    std::optional<valve::lumpfileheader_t> lumpFileHeader = std::nullopt
+)
+{
+    auto& planes = _scratch->planes;
+    if( !parse_lump( file, valve::lump_index::planes, planes ,lumpFileHeader) ) {
+        return false;
+    }
+
+    this->planes.resize( planes.size() );
+
+    for( std::size_t i = 0; i < planes.size(); ++i ) {
+        auto& out      = this->planes.at( i );
+        const auto& in = planes.at( i );
+
+        auto plane_bits = 0;
+        for( std::size_t j = 0; j < 3; ++j ) {
+            out.normal( j ) = in.normal( j );
+            if( out.normal( j ) < 0.f ) {
+                plane_bits |= 1 << static_cast<std::int32_t>( j );
+            }
+        }
+
+        out.distance  = in.distance;
+        out.type      = static_cast<std::uint8_t>( in.type );
+        out.sign_bits = static_cast<std::uint8_t>( plane_bits );
+    }
+
+    return true;
+}
+
+bool bsp_map::parse_entities(const file_view &file, std::optional<valve::lumpfileheader_t> lumpFileHeader=std::nullopt)
+{
+    std::vector<char> text;
+    if( !parse_lump( file, valve::lump_index::entities, text, lumpFileHeader ) ) {
+        return false;
+    }
+
+    /// the views point into text's buffer, which store_entities takes over as is
+    entity_reader                         reader( text.data(), text.size() );
+    std::vector<valve::entity_keyvalue_t> keyvalues;
+    std::vector<std::size_t>              entity_ends;
+    while( reader.read_entity( keyvalues ) ) {
+        entity_ends.push_back( keyvalues.size() );
+    }
+    keyvalues.resize( entity_ends.empty() ? 0 : entity_ends.back() );
+
+#if defined(RN_BSP_PARSER_MESSAGES)
+    if( reader.failed() ) {
+        std::printf( "[!] Malformed entity lump, kept the first %zu entities\n", entity_ends.size() );
+    }
+#endif
+
+    store_entities( std::move( text ), std::move( keyvalues ), entity_ends );
+    return true;
+}
+
+void bsp_map::store_entities(
+    std::vector<char>&&                     text,
+    std::vector<valve::entity_keyvalue_t>&& keyvalues,
+    const std::vector<std::size_t>&         entity_ends
+)
+{
+    entity_text      = std::move( text );
+    entity_keyvalues = std::move( keyvalues );
+
+    entities.resize( entity_ends.size() );
+
+    std::size_t first = 0;
+    for( std::size_t i = 0; i < entity_ends.size(); ++i ) {
+        entities.at( i ).first_keyvalue = entity_keyvalues.data() + first;
+        entities.at( i ).last_keyvalue  = entity_keyvalues.data() + entity_ends.at( i );
+        first = entity_ends.at( i );
+    }
+}
+
+bool bsp_map::parse_nodes(
+    const file_view& file,
+        std::optional<valve::lumpfileheader_t> lumpFileHeader = std::nullopt
+)
+{
+    auto& nodes = _scratch->nodes;
+    if( !parse_lump( file, valve::lump_index::nodes, nodes ,lumpFileHeader) ) {
+        return false;
+    }
+
+    build_nodes( nodes );
+    return true;
+}
+
+void bsp_map::build_nodes(
+    const std::vector<valve::dnode_t>& nodes
+)
+{
+    const auto num_nodes = nodes.size();
+    this->nodes.resize( num_nodes );
+
+    for( std::size_t i = 0; i < num_nodes; ++i ) {
+        const auto& in = nodes.at( i );
+        auto& out      = this->nodes.at( i );
+
+        out.mins       = in.mins;
+        out.maxs       = in.maxs;
+        out.plane_num  = in.plane_num;
+        out.first_face = in.first_face;
+        out.num_faces  = in.num_faces;
+        out.children   = in.children;
+    }
+
+    link_nodes();
+}
+
+void bsp_map::link_nodes()
+{
+    for( auto& node : nodes ) {
+        node.plane = planes.data() + node.plane_num;
+
+        for( std::size_t j = 0; j < 2; ++j ) {
+            const auto child_index = node.children.at( j );
+
+            if( child_index >= 0 ) {
+                node.leaf_children = nullptr;
+                node.node_children = nodes.data() + child_index;
+            }
+            else {
+                node.leaf_children = leaves.data() + static_cast<std::ptrdiff_t>( -1 - child_index );
+                node.node_children = nullptr;
+            }
+        }
+    }
+
+    trace_nodes.resize( nodes.size() );
+    for( std::size_t i = 0; i < nodes.size(); ++i ) {
+        const auto& node  = nodes.at( i );
+        const auto& plane = planes.at( static_cast<std::size_t>( node.plane_num ) );
+        auto&       out   = trace_nodes.at( i );
+
+        out.normal   = plane.normal;
+        out.distance = plane.distance;
+        out.type     = plane.type;
+        out.children = node.children;
+    }
+}
+
+bool bsp_map::parse_leaffaces(
+    const file_view& file,
+        std::optional<valve::lumpfileheader_t> lumpFileHeader = std::nullopt
+)
+{
+    if( !parse_lump( file, valve::lump_index::leaf_faces, leaf_faces ,lumpFileHeader) ) {
+        return false;
+    }
+
+    const auto num_leaffaces = leaf_faces.size();
+    if( num_leaffaces > valve::MAX_MAP_LEAFBRUSHES ) {
+        printf( "[!] map has to many leaffaces, parsed more than required...\n" );
+    }
+    else if( !num_leaffaces ) {
+        printf( "[!] map has no leaffaces to parse...\n" );
+    }
+
+    return true;
+}
+
+bool bsp_map::parse_leafbrushes(
+    const file_view& file,
+        std::optional<valve::lumpfileheader_t> lumpFileHeader = std::nullopt
+)
+{
+    if( !parse_lump( file, valve::lump_index::leaf_brushes, leaf_brushes,lumpFileHeader) ) {
+        return false;
+    }
+
+    const auto num_leafbrushes = leaf_brushes.size();
+    if( num_leafbrushes > valve::MAX_MAP_LEAFBRUSHES ) {
+        printf( "[!] map has to many leafbrushes, parsed more than required...\n" );
+    }
+    else if( !num_leafbrushes ) {
+        printf( "[!] map has no leafbrushes to parse...\n" );
+    }
+
+    return true;
+}
+
+bool bsp_map::parse_visibility(
+    const file_view& file,
+    std::optional<valve::lumpfileheader_t> lumpFileHeader = std::nullopt
+)
+{
+    auto& data = _scratch->visibility;
+    if( !parse_lump( file, valve::lump_index::visibility, data, lumpFileHeader ) ) {
+        return false;
+    }
+
+    //Maps without (or with broken) vis data simply don't cull anything.
+    visibility.clear();
+
+    std::int32_t num_clusters = 0;
+    if( data.size() < sizeof( num_clusters ) ) {
+        return true;
+    }
+    std::memcpy( &num_clusters, data.data(), sizeof( num_clusters ) );
+
+    //dvis_t: num_clusters, then a (pvs, pas) offset pair per cluster
+    const auto offsets_size = static_cast<std::size_t>( num_clusters ) * 2 * sizeof( std::int32_t );
+    if( num_clusters <= 0
+        || static_cast<std::size_t>( num_clusters ) > valve::MAX_MAP_CLUSTERS
+        || offsets_size > data.size() - sizeof( num_clusters ) ) {
+        return true;
+    }
+
+    const auto row_size = ( static_cast<std::size_t>( num_clusters ) + 7 ) / 8;
+    visibility.num_clusters = num_clusters;
+    visibility.row_size     = row_size;
+    visibility.rows.assign( row_size * static_cast<std::size_t>( num_clusters ), 0 );
+
+    for( std::size_t i = 0; i < static_cast<std::size_t>( num_clusters ); ++i ) {
+        std::int32_t offset;
+        std::memcpy( &offset, data.data() + sizeof( num_clusters ) + i * 2 * sizeof( std::int32_t ), sizeof( offset ) );
+
+        auto* row = visibility.rows.data() + i * row_size;
+        if( offset < 0 || !decompress_vis_row( data, static_cast<std::size_t>( offset ), row, row_size ) ) {
+            /// a row we can't read sees everything
+            std::memset( row, 0xFF, row_size );
+        }
+    }
+
+    return true;
+}
+
+void bsp_map::build_brush_planes()
+{
+    constexpr auto width = simd::float_v::width;
+
+    brush_planes.clear();
+    brush_planes.first_plane.resize( brushes.size() );
+    brush_planes.num_planes.resize( brushes.size() );
+    brush_aabbs.resize( brushes.size() );
+
+    const auto capacity = brush_sides.size() + brushes.size() * ( width - 1 );
+    brush_planes.normal_x.reserve( capacity );
+    brush_planes.normal_y.reserve( capacity );
+    brush_planes.normal_z.reserve( capacity );
+    brush_planes.distance.reserve( capacity );
+
+    auto add_plane = [this]( const vector3& normal, const float distance )
+    {
+        brush_planes.normal_x.push_back( normal( 0 ) );
+        brush_planes.normal_y.push_back( normal( 1 ) );
+        brush_planes.normal_z.push_back( normal( 2 ) );
+        brush_planes.distance.push_back( distance );
+    };
+
+    for( std::size_t i = 0; i < brushes.size(); ++i ) {
+        const auto& brush = brushes.at( i );
+        const auto  first = brush_planes.distance.size();
+
+        for( std::int32_t j = 0; j < brush.num_sides; ++j ) {
+            const auto side_index = static_cast<std::size_t>( brush.first_side ) + static_cast<std::size_t>( j );
+            if( brush.first_side < 0 || side_index >= brush_sides.size() ) {
+                break;
+            }
+
+            const auto& side = brush_sides.at( side_index );
+            if( side.bevel || side.plane_num >= planes.size() ) {
+                continue;
+            }
+
+            const auto& plane = planes.at( side.plane_num );
+            add_plane( plane.normal, plane.distance );
+        }
+
+        /// a zero normal with a positive distance puts both ends of every segment behind the plane
+        while( ( brush_planes.distance.size() - first ) % width ) {
+            add_plane( vector3( 0.f, 0.f, 0.f ), 1.f );
+        }
+
+        brush_planes.first_plane.at( i ) = static_cast<std::uint32_t>( first );
+        brush_planes.num_planes.at( i )  = static_cast<std::uint32_t>( brush_planes.distance.size() - first );
+
+        /// brushes without proper bounds get a box nothing misses
+        auto& bounds = brush_aabbs.at( i );
+        if( brush.first_side < 0
+            || static_cast<std::size_t>( brush.first_side ) + static_cast<std::size_t>( brush.num_sides ) > brush_sides.size()
+            || !brush_bounds( brush, bounds.mins, bounds.maxs ) ) {
+            const auto infinity = std::numeric_limits<float>::infinity();
+            bounds.mins = vector3( -infinity, -infinity, -infinity );
+            bounds.maxs = vector3( infinity, infinity, infinity );
+        }
+    }
+}
+
+bool bsp_map::parse_polygons(
+    thread_pool* pool
+)
+{
+    //One polygon per face so leaf_faces indices can be used as is, the vertices of all faces share one pool.
+    polygons.assign( surfaces.size(), valve::polygon{} );
+    polygon_verts.clear();
+    polygon_verts.reserve( surf_edges.size() );
+
+    for( std::size_t surface_index = 0; surface_index < surfaces.size(); ++surface_index ) {
+        const auto& surface    = surfaces.at( surface_index );
+        const auto& first_edge = surface.first_edge;
+        const auto& num_edges  = surface.num_edges;
+
+        if( num_edges < 3 || static_cast<size_t>( num_edges ) > valve::MAX_SURFINFO_VERTS ) {
+            continue;
+        }
+        if( surface.tex_info <= 0 ) {
+            continue;
+        }
+        //A displacement's face is the flat quad it was built from, clip_to_displacements traces the real surface.
+        if( surface.disp_info >= 0 ) {
+            continue;
+        }
+
+        auto& polygon = polygons.at( surface_index );
+        vector3 edge;
+
+        polygon.first_vert = static_cast<std::uint32_t>( polygon_verts.size() );
+        for( auto i = 0; i < num_edges; ++i ) {
+            const auto edge_index = surf_edges.at( first_edge + i );
+            if( edge_index >= 0 ) {
+                edge = vertices.at( edges[ edge_index ].v.at( 0 ) ).position;
+            }
+            else {
+                edge = vertices.at( edges[ -edge_index ].v.at( 1 ) ).position;
+            }
+            polygon_verts.push_back( edge );
+        }
+
+        polygon.num_verts      = static_cast<std::uint32_t>( num_edges );
+        polygon.plane.origin   = planes.at( surface.plane_num ).normal;
+        polygon.plane.distance = planes.at( surface.plane_num ).distance;
+    }
+
+    polygon_edge_planes.resize( polygon_verts.size() );
+
+    //Edge planes are filled here once, queries only ever read polygons.
+    constexpr std::size_t polygons_per_task = 1024;
+
+    task_group group( pool );
+    for( std::size_t first = 0; first < polygons.size(); first += polygons_per_task ) {
+        group.run( [this, first]
+        {
+            const auto last = std::min( first + polygons_per_task, polygons.size() );
+            for( auto i = first; i < last; ++i ) {
+                build_edge_planes( polygons.at( i ) );
+            }
+        } );
+    }
+    group.wait();
+
+    return true;
+}
+
+void bsp_map::build_edge_planes(
+    const valve::polygon& polygon
+)
+{
+    const auto first = static_cast<std::size_t>( polygon.first_vert );
+
+    for( std::size_t i = 0; i < polygon.num_verts; ++i ) {
+        const auto& vert      = polygon_verts.at( first + i );
+        const auto& next_vert = polygon_verts.at( first + ( i + 1 ) % polygon.num_verts );
+        auto&       edge_plane = polygon_edge_planes.at( first + i );
+
+        /// faces wind clockwise seen from the front, so this points into the polygon
+        edge_plane.origin   = ( next_vert - vert ).ncross( polygon.plane.origin );
+        edge_plane.distance = edge_plane.origin.dot( vert );
+    }
+}
+
+std::int32_t bsp_map::find_leaf(
+    const vector3& point
+) const
+{
+    if( trace_nodes.empty() ) {
+        return -1;
+    }
+
+    std::int32_t node_index = 0;
+    while( node_index >= 0 ) {
+        const auto& node = trace_nodes.at( static_cast<std::size_t>( node_index ) );
+
+        const auto distance = node.type < 3
+            ? point( static_cast<std::size_t>( node.type ) ) - node.distance
+            : point.dot( node.normal ) - node.distance;
+
+        node_index = node.children.at( distance < 0.f ? 1 : 0 );
+    }
+
+    return -node_index - 1;
+}
+
+std::int32_t bsp_map::cluster_at(
+    const vector3& point
+) const
+{
+    const auto leaf_index = find_leaf( point );
+    if( leaf_index < 0 || static_cast<std::size_t>( leaf_index ) >= leaves.size() ) {
+        return -1;
+    }
+
+    return leaves.at( static_cast<std::size_t>( leaf_index ) ).cluster;
+}
+
+std::int32_t bsp_map::point_leaf(
+    const vector3& point
+) const
+{
+    return find_leaf( point );
+}
+
+std::int32_t bsp_map::point_contents(
+    const vector3&     point,
+    const std::int32_t mask
+) const
+{
+    const auto leaf_index = find_leaf( point );
+    if( leaf_index < 0 || static_cast<std::size_t>( leaf_index ) >= leaves.size() ) {
+        return 0;
+    }
+
+    return leaves.at( static_cast<std::size_t>( leaf_index ) ).contents & mask;
+}
+
+void bsp_map::point_leaf_batch(
+    const vector3*    points,
+    const std::size_t count,
+    std::int32_t*     out
+) const
+{
+    if( trace_nodes.empty() ) {
+        std::fill_n( out, count, -1 );
+        return;
+    }
+
+    /// one node step per lane and round, a lane whose point reached its leaf picks up the next point
+    std::array<std::int32_t, POINT_LANES> lane_nodes{};
+    std::array<std::size_t, POINT_LANES>  lane_points{};
+    std::uint32_t                         active     = 0;
+    std::size_t                           next_point = 0;
+
+    for( std::size_t lane = 0; lane < POINT_LANES && next_point < count; ++lane ) {
+        lane_points.at( lane ) = next_point++;
+        active |= 1u << lane;
+    }
+
+    while( active ) {
+        for( std::size_t lane = 0; lane < POINT_LANES; ++lane ) {
+            if( !( active & ( 1u << lane ) ) ) {
+                continue;
+            }
+
+            const auto& node  = trace_nodes.at( static_cast<std::size_t>( lane_nodes.at( lane ) ) );
+            const auto& point = points[ lane_points.at( lane ) ];
+
+            const auto distance = node.type < 3
+                ? point( static_cast<std::size_t>( node.type ) ) - node.distance
+                : point.dot( node.normal ) - node.distance;
+
+            const auto child = node.children.at( distance < 0.f ? 1 : 0 );
+            if( child >= 0 ) {
+                lane_nodes.at( lane ) = child;
+                continue;
+            }
+
+            out[ lane_points.at( lane ) ] = -child - 1;
+            if( next_point < count ) {
+                lane_nodes.at( lane )  = 0;
+                lane_points.at( lane ) = next_point++;
+            }
+            else {
+                active &= ~( 1u << lane );
+            }
+        }
+    }
+}
+
+void bsp_map::point_contents_batch(
+    const vector3*     points,
+    const std::size_t  count,
+    const std::int32_t mask,
+    std::int32_t*      out
+) const
+{
+    /// the leaf indices land in out first and are replaced by their contents in place
+    point_leaf_batch( points, count, out );
+
+    for( std::size_t i = 0; i < count; ++i ) {
+        const auto leaf_index = out[ i ];
+        out[ i ] = leaf_index >= 0 && static_cast<std::size_t>( leaf_index ) < leaves.size()
+            ? leaves.at( static_cast<std::size_t>( leaf_index ) ).contents & mask
+            : 0;
+    }
+}
+
+void bsp_map::ray_cast_leaf(
+    const std::size_t leaf_index,
+    const ray_t&      ray,
+    valve::trace_t*   out
+) const
+{
+    using simd::float_v;
+
+    auto* leaf = &leaves.at( leaf_index );
+
+    /// slab test constants, axes the segment (almost) doesn't move along keep a finite stand-in
+    std::array<float_v, 3> start, inversed_delta;
+    for( std::size_t k = 0; k < 3; ++k ) {
+        const auto delta = ray.end( k ) - ray.start( k );
+        start.at( k )          = float_v::broadcast( ray.start( k ) );
+        inversed_delta.at( k ) = float_v::broadcast( std::abs( delta ) * BOUNDS_INVERSED_ZERO_DELTA > 1.f ? 1.f / delta : BOUNDS_INVERSED_ZERO_DELTA );
+    }
+
+    const auto zero = float_v::broadcast( 0.f );
+    const auto one  = float_v::broadcast( 1.f );
+
+    for( std::uint16_t first = 0; first < leaf->num_leafbrushes; first += float_v::width ) {
+        const auto count = std::min<std::size_t>( float_v::width, leaf->num_leafbrushes - first );
+
+        /// width brush boxes at a time, unused lanes are ignored below
+        std::array<std::array<float, float_v::width>, 3> mins_lanes{}, maxs_lanes{};
+        for( std::size_t lane = 0; lane < count; ++lane ) {
+            const auto& bounds = brush_aabbs.at( leaf_brushes.at( leaf->first_leafbrush + first + lane ) );
+            for( std::size_t k = 0; k < 3; ++k ) {
+                mins_lanes.at( k ).at( lane ) = bounds.mins( k );
+                maxs_lanes.at( k ).at( lane ) = bounds.maxs( k );
+            }
+        }
+
+        auto enter = zero;
+        auto leave = one;
+        for( std::size_t k = 0; k < 3; ++k ) {
+            const auto to_mins = ( float_v::load( mins_lanes.at( k ).data() ) - start.at( k ) ) * inversed_delta.at( k );
+            const auto to_maxs = ( float_v::load( maxs_lanes.at( k ).data() ) - start.at( k ) ) * inversed_delta.at( k );
+            enter = simd::maximum( enter, simd::minimum( to_mins, to_maxs ) );
+            leave = simd::minimum( leave, simd::maximum( to_mins, to_maxs ) );
+        }
+        const auto touched = simd::movemask( enter <= leave );
+
+        for( std::size_t lane = 0; lane < count; ++lane ) {
+            const auto brush_index = static_cast<std::int32_t>( leaf_brushes.at( leaf->first_leafbrush + first + lane ) );
+            auto* brush            = &brushes.at( brush_index );
+            if( !brush || !( brush->contents & valve::MASK_SHOT_HULL ) ) {
+                continue;
+            }
+
+            /// brushes spanning several leaves are only tested in the first one the ray reaches
+            auto& mark = ray.brush_marks[ brush_index ];
+            if( mark.stamp != ray.stamp ) {
+                mark.stamp = ray.stamp;
+                mark.lanes = 0;
+            }
+            if( mark.lanes & ray.lane ) {
+                continue;
+            }
+
+            /// once a start-solid brush was left, clip_to_brush treats brushes entered
+            /// before that point as solid too, so those can't be skipped by their box
+            if( ( touched >> lane & 1u ) || out->fraction_left_solid > 0.f ) {
+                mark.lanes |= ray.lane;
+                ray_cast_brush( brush, ray.start, ray.end, out );
+                /// a hit right at the start is undone if the ray turns out to start in
+                /// another brush, only a ray stuck in solid is final
+                if( out->fraction == 0.f && out->fraction_left_solid == 1.f ) {
+                    return;
+                }
+            }
+
+            out->brush = brush;
+        }
+    }
+
+    for( std::uint16_t i = 0; i < leaf->num_leaffaces; ++i ) {
+        ray_cast_surface( leaf_faces.at( leaf->first_leafface + i ), ray.start, ray.end, out );
+    }
+}
+
+#if defined(RN_BSP_PARSER_RECURSIVE_TRAVERSAL)
+void bsp_map::ray_cast_node(
+    const std::int32_t node_index,
+    const float        start_fraction,
+    const float        end_fraction,
+    const vector3&     origin,
+    const vector3&     destination,
+    const ray_t&       ray,
+    valve::trace_t*    out
+) const
+{
+    /// a hit at fraction 0 may still be undone by a brush the ray starts in further on
+    if( out->fraction <= start_fraction && start_fraction != 0.f ) {
+        return;
+    }
+
+    if( node_index < 0 ) {
+        ray_cast_leaf( static_cast<std::size_t>( -node_index - 1 ), ray, out );
+        return;
+    }
+
+    const auto& node = trace_nodes.at( static_cast<std::size_t>( node_index ) );
+
+    float start_distance, end_distance;
+
+    if( node.type < 3 ) {
+        start_distance = origin( static_cast<std::size_t>( node.type ) ) - node.distance;
+        end_distance   = destination( static_cast<std::size_t>( node.type ) ) - node.distance;
+    }
+    else {
+        start_distance = origin.dot( node.normal ) - node.distance;
+        end_distance = destination.dot( node.normal ) - node.distance;
+    }
+
+    if( start_distance >= valve::DIST_EPSILON && end_distance >= valve::DIST_EPSILON ) {
+        ray_cast_node( node.children.at( 0 ), start_fraction, end_fraction, origin, destination, ray, out );
+    }
+    else if( start_distance < -valve::DIST_EPSILON && end_distance < -valve::DIST_EPSILON ) {
+        ray_cast_node( node.children.at( 1 ), start_fraction, end_fraction, origin, destination, ray, out );
+    }
+    else {
+        const auto split = split_segment( start_distance, end_distance );
+        vector3 middle;
+
+        auto fraction_middle = start_fraction + ( end_fraction - start_fraction ) * split.fraction_first;
+        for( std::size_t i = 0; i < 3; i++ ) {
+            middle( i ) = origin( i ) + split.fraction_first * ( destination( i ) - origin( i ) );
+        }
+
+        ray_cast_node( node.children.at( split.side_id ), start_fraction, fraction_middle, origin, middle, ray, out );
+        fraction_middle = start_fraction + ( end_fraction - start_fraction ) * split.fraction_second;
+        for( std::size_t i = 0; i < 3; i++ ) {
+            middle( i ) = origin( i ) + split.fraction_second * ( destination( i ) - origin( i ) );
+        }
+
+        ray_cast_node( node.children.at( !split.side_id ), fraction_middle, end_fraction, middle, destination, ray, out );
+    }
+}
+#else
+void bsp_map::ray_cast_node(
+    std::int32_t    node_index,
+    float           start_fraction,
+    float           end_fraction,
+    const vector3&  origin,
+    const vector3&  destination,
+    const ray_t&    ray,
+    valve::trace_t* out
+) const
+{
+    /// the far side of every split waits here until the near side is done,
+    /// the segment end points are kept as is so results match the recursion bit for bit
+    struct traversal_entry
+    {
+        std::int32_t         node_index;
+        float                start_fraction;
+        float                end_fraction;
+        std::array<float, 3> origin;
+        std::array<float, 3> destination;
+    };
+
+    std::array<traversal_entry, TRAVERSAL_STACK_SIZE> stack;
+    std::size_t                                       stack_size = 0;
+
+    vector3 segment_origin      = origin;
+    vector3 segment_destination = destination;
+
+    for( ;; ) {
+        /// a hit at fraction 0 may still be undone by a brush the ray starts in further on
+        if( out->fraction > start_fraction || start_fraction == 0.f ) {
+            if( node_index < 0 ) {
+                ray_cast_leaf( static_cast<std::size_t>( -node_index - 1 ), ray, out );
+            }
+            else {
+                const auto& node = trace_nodes.at( static_cast<std::size_t>( node_index ) );
+
+                float start_distance, end_distance;
+
+                if( node.type < 3 ) {
+                    start_distance = segment_origin( static_cast<std::size_t>( node.type ) ) - node.distance;
+                    end_distance   = segment_destination( static_cast<std::size_t>( node.type ) ) - node.distance;
+                }
+                else {
+                    start_distance = segment_origin.dot( node.normal ) - node.distance;
+                    end_distance   = segment_destination.dot( node.normal ) - node.distance;
+                }
+
+                /// segments within DIST_EPSILON of the plane visit both children
+                if( start_distance >= valve::DIST_EPSILON && end_distance >= valve::DIST_EPSILON ) {
+                    node_index = node.children.at( 0 );
+                    continue;
+                }
+                if( start_distance < -valve::DIST_EPSILON && end_distance < -valve::DIST_EPSILON ) {
+                    node_index = node.children.at( 1 );
+                    continue;
+                }
+
+                const auto split = split_segment( start_distance, end_distance );
+
+                const auto fraction_first  = start_fraction + ( end_fraction - start_fraction ) * split.fraction_first;
+                const auto fraction_second = start_fraction + ( end_fraction - start_fraction ) * split.fraction_second;
+
+                vector3 middle_first, middle_second;
+                for( std::size_t i = 0; i < 3; i++ ) {
+                    middle_first( i )  = segment_origin( i ) + split.fraction_first * ( segment_destination( i ) - segment_origin( i ) );
+                    middle_second( i ) = segment_origin( i ) + split.fraction_second * ( segment_destination( i ) - segment_origin( i ) );
+                }
+
+                const auto near_index = node.children.at( split.side_id );
+                const auto far_index  = node.children.at( !split.side_id );
+
+                if( stack_size < stack.size() ) {
+                    auto& entry = stack.at( stack_size++ );
+                    entry.node_index     = far_index;
+                    entry.start_fraction = fraction_second;
+                    entry.end_fraction   = end_fraction;
+                    for( std::size_t i = 0; i < 3; i++ ) {
+                        entry.origin.at( i )      = middle_second( i );
+                        entry.destination.at( i ) = segment_destination( i );
+                    }
+
+                    node_index          = near_index;
+                    end_fraction        = fraction_first;
+                    segment_destination = middle_first;
+                    continue;
+                }
+
+                /// out of stack space (degenerate, very deep trees), finish the near side
+                /// on a fresh stack and carry on with the far side right here
+                ray_cast_node( near_index, start_fraction, fraction_first, segment_origin, middle_first, ray, out );
+
+                node_index     = far_index;
+                start_fraction = fraction_second;
+                segment_origin = middle_second;
+                continue;
+            }
+        }
+
+        if( !stack_size ) {
+            return;
+        }
+
+        const auto& entry = stack.at( --stack_size );
+        node_index          = entry.node_index;
+        start_fraction      = entry.start_fraction;
+        end_fraction        = entry.end_fraction;
+        segment_origin      = vector3( entry.origin.at( 0 ), entry.origin.at( 1 ), entry.origin.at( 2 ) );
+        segment_destination = vector3( entry.destination.at( 0 ), entry.destination.at( 1 ), entry.destination.at( 2 ) );
+    }
+}
+#endif
+
+void bsp_map::ray_cast_brush(
+    const valve::dbrush_t* brush,
+    const vector3&         origin,
+    const vector3&         destination,
+    valve::trace_t*        out
+) const
+{
+    if( brush->num_sides ) {
+        using simd::float_v;
+
+        const auto brush_index = static_cast<std::size_t>( brush - brushes.data() );
+        const auto first_plane = static_cast<std::size_t>( brush_planes.first_plane.at( brush_index ) );
+        const auto last_plane  = first_plane + brush_planes.num_planes.at( brush_index );
+
+        const auto zero    = float_v::broadcast( 0.f );
+        const auto epsilon = float_v::broadcast( valve::DIST_EPSILON );
+
+        std::array<float_v, 3> start, end;
+        for( std::size_t i = 0; i < 3; ++i ) {
+            start.at( i ) = float_v::broadcast( origin( i ) );
+            end.at( i )   = float_v::broadcast( destination( i ) );
+        }
+
+        auto          enter_fractions = float_v::broadcast( -99.f );
+        auto          leave_fractions = float_v::broadcast( 1.f );
+        std::uint32_t starts_out_mask = 0;
+        std::uint32_t ends_out_mask   = 0;
+
+        /// width sides at a time, the per-brush padding makes a scalar tail unnecessary
+        for( auto i = first_plane; i < last_plane; i += float_v::width ) {
+            const auto normal_x = float_v::load( brush_planes.normal_x.data() + i );
+            const auto normal_y = float_v::load( brush_planes.normal_y.data() + i );
+            const auto normal_z = float_v::load( brush_planes.normal_z.data() + i );
+            const auto distance = float_v::load( brush_planes.distance.data() + i );
+
+            /// same summation order as vector3::dot
+            const auto start_distance = zero + start.at( 0 ) * normal_x + start.at( 1 ) * normal_y + start.at( 2 ) * normal_z - distance;
+            const auto end_distance   = zero + end.at( 0 ) * normal_x + end.at( 1 ) * normal_y + end.at( 2 ) * normal_z - distance;
+
+            const auto start_out = start_distance > zero;
+            const auto end_out   = end_distance > zero;
+            if( simd::movemask( start_out & end_out ) ) {
+                return;
+            }
+
+            /// sides the segment enters start in front, sides it leaves through start behind and end in front
+            const auto leaving = ( start_distance <= zero ) & end_out;
+            starts_out_mask |= simd::movemask( start_out );
+            ends_out_mask   |= simd::movemask( leaving );
+
+            const auto enter_distance = start_distance - epsilon;
+            const auto enter_fraction = simd::select( enter_distance < zero, zero, enter_distance ) / ( start_distance - end_distance );
+            const auto leave_fraction = ( start_distance + epsilon ) / ( start_distance - end_distance );
+
+            enter_fractions = simd::select( start_out & ( enter_fraction > enter_fractions ), enter_fraction, enter_fractions );
+            leave_fractions = simd::select( leaving & ( leave_fraction < leave_fractions ), leave_fraction, leave_fractions );
+        }
+
+        std::array<float, float_v::width> enter_lanes, leave_lanes;
+        enter_fractions.store( enter_lanes.data() );
+        leave_fractions.store( leave_lanes.data() );
+
+        clip_to_brush(
+            brush,
+            *std::max_element( enter_lanes.begin(), enter_lanes.end() ),
+            *std::min_element( leave_lanes.begin(), leave_lanes.end() ),
+            starts_out_mask != 0,
+            ends_out_mask != 0,
+            out
+        );
+    }
+}
+
+void bsp_map::ray_cast_surface(
+    const std::size_t surface_index,
+    const vector3&    origin,
+    const vector3&    destination,
+    valve::trace_t*   out
+) const
+{
+    if( surface_index >= polygons.size() ) {
+        return;
+    }
+
+    const auto& polygon = polygons.at( surface_index );
+    if( !polygon.num_verts ) {
+        return;
+    }
+
+    const auto start_distance = polygon.plane.dist( origin );
+    const auto end_distance   = polygon.plane.dist( destination );
+    if( !( start_distance > 0.f ) || end_distance > 0.f || start_distance - end_distance < valve::DIST_EPSILON ) {
+        return;
+    }
+
+    /// like a brush hit, nothing counts before the ray got out of the solid it started in
+    const auto fraction = start_distance / ( start_distance - end_distance );
+    if( !( fraction > out->fraction_left_solid ) || !( fraction < out->fraction ) ) {
+        return;
+    }
+
+    const auto intersection = origin + ( destination - origin ) * fraction;
+    for( std::size_t i = 0; i < polygon.num_verts; ++i ) {
+        if( polygon_edge_planes.at( polygon.first_vert + i ).dist( intersection ) < 0.f ) {
+            return;
+        }
+    }
+
+    out->fraction        = fraction;
+    out->end_pos         = intersection;
+    out->contents        = 0;
+    out->brush           = nullptr;
+    out->num_brush_sides = 0;
+    out->surface         = static_cast<std::int32_t>( surface_index );
+}
+
+void bsp_map::clip_to_brush(
+    const valve::dbrush_t* brush,
+    float                  fraction_to_enter,
+    const float            fraction_to_leave,
+    bool                   starts_out,
+    const bool             ends_out,
+    valve::trace_t*        out
+)
+{
+    if( starts_out ) {
+        if( out->fraction_left_solid - fraction_to_enter > 0.f ) {
+            starts_out = false;
+        }
+    }
+
+    out->num_brush_sides = brush->num_sides;
+
+    if( !starts_out ) {
+        out->start_solid = true;
+        /// a face hit past the solid keeps the trace's contents, whichever is found first
+        if( out->surface < 0 ) {
+            out->contents = brush->contents;
+        }
+
+        if( !ends_out ) {
+            out->all_solid = true;
+            out->fraction = 0.f;
+            out->fraction_left_solid = 1.f;
+            out->contents = brush->contents;
+            out->surface  = -1;
+        }
+        else {
+            if( fraction_to_leave != 1.f && fraction_to_leave > out->fraction_left_solid ) {
+                out->fraction_left_solid = fraction_to_leave;
+                if( out->fraction <= fraction_to_leave ) {
+                    out->fraction = 1.f;
+                    out->surface  = -1;
+                }
+            }
+        }
+        return;
+    }
+
+    if( fraction_to_enter < fraction_to_leave ) {
+        if( fraction_to_enter > -99.f && fraction_to_enter < out->fraction ) {
+            if( fraction_to_enter < 0.f ) {
+                fraction_to_enter = 0.f;
+            }
+
+            out->fraction = fraction_to_enter;
+            out->brush    = brush;
+            out->contents = brush->contents;
+            out->surface  = -1;
+        }
+    }
+}
+
+bool bsp_map::load(
+    const std::string&  directory,
+    const std::string&  map_name,
+    const load_options& options,
+    load_scratch*       scratch
+)
+{
+    load_scratch local_scratch;
+    _scratch = scratch ? scratch : &local_scratch;
+    _profile = options.profile;
+    if( _profile ) {
+        _profile->begin();
+    }
+
+    const auto result = load_file( directory, map_name, options );
+
+    if( _profile ) {
+        _profile->finish( result );
+    }
+    _scratch = nullptr;
+    _profile = nullptr;
+    return result;
+}
+
+bool bsp_map::load_file(
+    const std::string&  directory,
+    const std::string&  map_name,
+    const load_options& options
+)
+{
+    std::string file_path;
+    if( !set_current_map( directory, map_name, file_path ) ) {
+        return false;
+    }
+
+    //Times the steps that aren't tied to a lump, a no-op unless the load is profiled.
+    auto run_stage = [this]( const char* name, auto&& work )
+    {
+        const stage_timer timer( _profile, name );
+        return work();
+    };
+
+    file_view file;
+    if( !run_stage( "open", [&] { return file.open( file_path, options.access ); } ) ) {
+    #if defined(RN_BSP_PARSER_MESSAGES)
+        std::printf( "[!] failed to open file: %s\n", file_path.data() );
+    #endif
+        return false;
+    }
+
+    try {
+        if( !file.read_object( 0, bsp_header ) ) {
+            return false;
+        }
+    #if defined(RN_BSP_PARSER_MESSAGES)
+        if( _bsp_header.m_Version < valve::BSPVERSION  ) {
+            std::printf( "[!] unknown BSP version (%d), trying to parse it anyway...\n", _bsp_header.m_Version );
+        }
+    #endif
+        if( !valve::has_valid_bsp_ident( bsp_header.ident ) ) {
+    #if defined(RN_BSP_PARSER_MESSAGES)
+            std::printf( "[!] %s isn't a (valid) .bsp file!\n", map_name.data() );
+    #endif
+            return false;
+        }
+
+        std::string baked_file;
+        if( !options.cache_directory.empty() ) {
+            _content_hash = run_stage( "content_hash", [&] { return compute_content_hash( file, file_path, options.access ); } );
+            baked_file    = baked_path( options.cache_directory, file_path );
+            if( run_stage( "load_baked", [&] { return load_baked( baked_file, _content_hash, options.access ); } ) ) {
+                if( _profile ) {
+                    _profile->cache_hit = true;
+                }
+                //Prop boxes depend on options.prop_bounds and the brush BVH on options.backend, neither is baked.
+                {
+                    const lump_timer timer( _profile, valve::lump_index::game_lump );
+                    parse_static_props( file, options );
+                }
+                run_stage( "select_backend", [&] { select_backend( options.backend ); } );
+                return true;
+            }
+        }
+
+        //Only the lumps below get paged in, everything else (pakfile, lighting, ...) is never touched.
+        run_stage( "prefetch", [&]
+        {
+            for( const auto lump : parsed_lumps ) {
+                const auto& header = bsp_header.lumps.at( static_cast<std::size_t>( lump ) );
+                file.prefetch( static_cast<std::size_t>( header.file_offset ), static_cast<std::size_t>( header.file_size ) );
+            }
+        } );
+
+        auto* pool = options.parallel
+            ? ( options.pool ? options.pool : &thread_pool::shared() )
+            : nullptr;
+
+        //Independent lumps are decoded concurrently, node linking and polygon building run once their inputs are in.
+        auto&                  raw_nodes = _scratch->nodes;
+        std::vector<load_step> steps;
+
+        auto add_step = [&steps]( std::function<bool()> work, std::vector<std::size_t> dependencies = {} )
+        {
+            steps.push_back( { std::move( work ), std::move( dependencies ) } );
+            return steps.size() - 1;
+        };
+
+        //Lump steps run under a lump_timer, parse_lump reports into it from whichever pool thread picks the step up.
+        auto add_lump_step = [this, &add_step]( const valve::lump_index lump, std::function<bool()> work )
+        {
+            return add_step( [this, lump, work = std::move( work )]
+            {
+                const lump_timer timer( _profile, lump );
+                return work();
+            } );
+        };
+
+        const auto vertices_step   = add_lump_step( valve::lump_index::vertices, [&] { return parse_lump( file, valve::lump_index::vertices, vertices ); } );
+        const auto planes_step     = add_lump_step( valve::lump_index::planes, [&] { return parse_planes( file ); } );
+        const auto edges_step      = add_lump_step( valve::lump_index::edges, [&] { return parse_lump( file, valve::lump_index::edges, edges ); } );
+        const auto surf_edges_step = add_lump_step( valve::lump_index::surfedges, [&] { return parse_lump( file, valve::lump_index::surfedges, surf_edges ); } );
+        const auto leaves_step     = add_lump_step( valve::lump_index::leafs, [&] { return parse_lump( file, valve::lump_index::leafs, leaves ); } );
+        const auto nodes_step      = add_lump_step( valve::lump_index::nodes, [&] { return parse_lump( file, valve::lump_index::nodes, raw_nodes ); } );
+        const auto faces_step      = add_lump_step( valve::lump_index::faces, [&] { return parse_lump( file, valve::lump_index::faces, surfaces ); } );
+        add_lump_step( valve::lump_index::tex_info, [&] { return parse_lump( file, valve::lump_index::tex_info, tex_infos ); } );
+        const auto brushes_step     = add_lump_step( valve::lump_index::brushes, [&] { return parse_lump( file, valve::lump_index::brushes, brushes ); } );
+        const auto brush_sides_step = add_lump_step( valve::lump_index::brush_sides, [&] { return parse_lump( file, valve::lump_index::brush_sides, brush_sides ); } );
+        add_lump_step( valve::lump_index::leaf_faces, [&] { return parse_leaffaces( file ); } );
+        add_lump_step( valve::lump_index::leaf_brushes, [&] { return parse_leafbrushes( file ); } );
+        add_lump_step( valve::lump_index::entities, [&] { return parse_entities( file ); } );
+        add_lump_step( valve::lump_index::visibility, [&] { return parse_visibility( file ); } );
+        add_lump_step( valve::lump_index::game_lump, [&] { parse_static_props( file, options ); return true; } );
+        add_lump_step( valve::lump_index::disp_info, [&] { return parse_lump( file, valve::lump_index::disp_info, _scratch->disp_infos ); } );
+        add_lump_step( valve::lump_index::disp_verts, [&] { return parse_lump( file, valve::lump_index::disp_verts, _scratch->disp_verts ); } );
+        add_lump_step( valve::lump_index::models, [&] { return parse_lump( file, valve::lump_index::models, models ); } );
+
+        add_step( [&] { return run_stage( "build_nodes", [&] { build_nodes( raw_nodes ); return true; } ); },
+                  { planes_step, leaves_step, nodes_step } );
+        add_step( [&] { return run_stage( "parse_polygons", [&] { return parse_polygons( pool ); } ); },
+                  { vertices_step, planes_step, edges_step, surf_edges_step, faces_step } );
+        add_step( [&] { return run_stage( "build_brush_planes", [&] { build_brush_planes(); return true; } ); },
+                  { planes_step, brushes_step, brush_sides_step } );
+
+        bool baseMapParsed = run_load_steps( steps, pool, options.cancelled );
+        if (!baseMapParsed || is_cancelled( options.cancelled ))
+            return false;
+
+        //Set by the patches that replaced an input of node linking, brush planes or polygons.
+        bool nodesInvalidated    = false;
+        bool brushesInvalidated  = false;
+        bool surfacesInvalidated = false;
+        for (std::size_t i=0;;i++){
+            std::string thisLmpFile = lump_patch_path(file_path, i);
+
+            file_view file;
+            if (!file.open(thisLmpFile, options.access)) {
+                break; // file likely not present. We're finished
+            }
+
+            //Alright. File present. Parse the header of the file.
+            rn::valve::lumpfileheader_t lumpFileHeader;
+
+
+
+            if (!file.read_object(0, lumpFileHeader)) {
+                break;
+            }
+
+            //Patched lumps are profiled like the .bsp ones, tagged with the patch index.
+            const lump_timer patchTimer( _profile, static_cast<valve::lump_index>( lumpFileHeader.lumpID ), static_cast<std::int32_t>( i ) );
+
+            //Now that we have header ready we need to know which lump we're replacing
+            switch (static_cast<valve::lump_index>(lumpFileHeader.lumpID)) {
+
+            case valve::lump_index::entities: {
+                //parse_entities keeps the current entities if the patch can't be read
+                parse_entities(file,std::make_optional(lumpFileHeader));
+                break;
+            }
+            case valve::lump_index::vertices: {
+
+                auto _oldLump = std::vector(vertices);
+                if (!parse_lump(file,valve::lump_index::vertices,vertices,std::make_optional(lumpFileHeader))) {
+                    vertices = _oldLump;
+                } else surfacesInvalidated = true;
+                break;
+                }
+
+            case valve::lump_index::planes: {
+
+
+                auto _oldLump = planes;
+                if (!parse_planes(file,std::make_optional(lumpFileHeader))) {
+                    planes = _oldLump;
+                } else nodesInvalidated = brushesInvalidated = surfacesInvalidated = true;
+                    break;
+
+            }
+            case valve::lump_index::edges: {
+
+
+                auto _oldLump = edges;
+                if (!parse_lump(file,valve::lump_index::edges,edges,std::make_optional(lumpFileHeader))) {
+                    edges = _oldLump;
+                } else surfacesInvalidated = true;
+                    break;
+
+            }
+            case valve::lump_index::surfedges: {
+
+
+                auto _oldLump = surf_edges;
+                if (!parse_lump(file,valve::lump_index::surfedges,surf_edges,std::make_optional(lumpFileHeader))) {
+                    surf_edges = _oldLump;
+                } else surfacesInvalidated = true;
+                    break;
+
+            }
+            case valve::lump_index::leafs: {
+
+
+                auto _oldLump = leaves;
+                if (!parse_lump(file,valve::lump_index::leafs,leaves,std::make_optional(lumpFileHeader))) {
+                    leaves = _oldLump;
+                } else nodesInvalidated = true;
+                    break;
+
+            }
+            case valve::lump_index::nodes: {
+
+
+                auto _oldLump = nodes;
+                if (!parse_nodes(file,std::make_optional(lumpFileHeader))) {
+                    nodes = _oldLump;
+                } else nodesInvalidated = true;
+                    break;
+
+            }
+            case valve::lump_index::faces: {
+
+
+                auto _oldLump = surfaces;
+                if (!parse_lump(file,valve::lump_index::faces,surfaces,std::make_optional(lumpFileHeader))) {
+                    surfaces = _oldLump;
+                } else surfacesInvalidated = true;
+                    break;
+
+            }
+            case valve::lump_index::tex_info: {
+
+
+                auto _oldLump = tex_infos;
+                if (!parse_lump(file,valve::lump_index::tex_info,tex_infos,std::make_optional(lumpFileHeader))) {
+                    tex_infos = _oldLump;
+                }
+                    break;
+
+            }
+            case valve::lump_index::brushes: {
+
+
+                auto _oldLump = brushes;
+                if (!parse_lump(file,valve::lump_index::brushes,brushes,std::make_optional(lumpFileHeader))) {
+                    brushes = _oldLump;
+                } else brushesInvalidated = true;
+                    break;
+
+            }
+            case valve::lump_index::brush_sides: {
+
+
+                auto _oldLump = brush_sides;
+                if (!parse_lump(file,valve::lump_index::brush_sides,brush_sides,std::make_optional(lumpFileHeader))) {
+                    brush_sides = _oldLump;
+                } else brushesInvalidated = true;
+                    break;
+
+            }
+            case valve::lump_index::leaf_faces: {
+
+
+                auto _oldLump = leaf_faces;
+                if (!parse_leaffaces(file,std::make_optional(lumpFileHeader))) {
+                    leaf_faces = _oldLump;
+                }
+                    break;
+
+            }
+            case valve::lump_index::leaf_brushes: {
+
+
+                auto _oldLump = leaf_brushes;
+                if (!parse_leafbrushes(file,std::make_optional(lumpFileHeader))) {
+                    leaf_brushes = _oldLump;
+                }
+                    break;
+
+            }
+            case valve::lump_index::visibility: {
+
+
+                auto _oldLump = visibility;
+                if (!parse_visibility(file,std::make_optional(lumpFileHeader))) {
+                    visibility = _oldLump;
+                }
+                    break;
+
+            }
+            default:
+                break;
+            }
+
+
+
+
+
+            std::string nextLmpFile = lump_patch_path(file_path, i+1); //Is next file lump present?
+            std::error_code existsError;
+            if (!std::filesystem::exists(nextLmpFile, existsError)) {
+                break; // file not present. We're finished
+            }
+        }
+        //Patched planes, leaves or nodes leave the links and trace nodes pointing at the old data,
+        //only the steps whose inputs a patch replaced run again.
+        if( nodesInvalidated ) {
+            run_stage( "link_nodes", [&] { link_nodes(); } );
+        }
+        if( brushesInvalidated ) {
+            run_stage( "build_brush_planes", [&] { build_brush_planes(); } );
+        }
+        if( surfacesInvalidated ) {
+            run_stage( "parse_polygons", [&] { return parse_polygons( pool ); } );
+        }
+        run_stage( "build_displacements", [&] { return build_displacements(); } );
+        run_stage( "build_entity_index", [&] { build_entity_index(); } );
+        run_stage( "select_backend", [&] { select_backend( options.backend ); } );
+
+        if( is_cancelled( options.cancelled ) ) {
+            return false;
+        }
+
+        if( !baked_file.empty() ) {
+            run_stage( "save_baked", [&] { return save_baked( baked_file ); } );
+        }
+
+        return true;
+    }
+    catch( ... ) {
+        return false;
+    }
+}
+
+bool bsp_map::is_visible(
+    const vector3& origin,
+    const vector3& destination
+) const
+{
+    if( !visibility.can_see( cluster_at( origin ), cluster_at( destination ) ) ) {
+        return false;
+    }
+
+    valve::trace_t trace{};
+    trace_ray( origin, destination, &trace );
+
+    return !( trace.fraction < 1.f );
+}
+
+std::int32_t bsp_map::point_cluster(
+    const vector3& point
+) const
+{
+    return cluster_at( point );
+}
+
+void bsp_map::ray_cast_brushes(
+    const vector3&  origin,
+    const vector3&  destination,
+    valve::trace_t* out
+) const
+{
+    for( auto left_solid = 0.f;; ) {
+        out->clear();
+        out->fraction = 1.0f;
+        out->fraction_left_solid = left_solid;
+        out->start_solid = false;
+        out->all_solid   = false;
+
+        if( _trace_backend == trace_backend::brush_bvh ) {
+            ray_cast_bvh( origin, destination, out );
+        }
+        else {
+            ray_cast_node( 0, 0.f, 1.f, origin, destination, begin_ray( origin, destination ), out );
+        }
+
+        /// a ray stuck in solid stays stuck whatever it meets afterwards
+        if( !( out->fraction_left_solid > left_solid ) || out->fraction_left_solid == 1.f ) {
+            return;
+        }
+        left_solid = out->fraction_left_solid;
+    }
+}
+
+void bsp_map::trace_ray(
+    const vector3&  origin,
+    const vector3&  final,
+    valve::trace_t* out
+) const
+{
+    if( !planes.empty() && out ) {
+
+        ray_cast_brushes( origin, final, out );
+        clip_to_displacements( origin, final, out );
+        clip_to_props( origin, final, vector3( 0.f, 0.f, 0.f ), out );
+
+        if( out->fraction < 1.0f ) {
+            for( std::size_t i = 0; i < 3; ++i ) {
+                out->end_pos( i ) = origin( i ) + out->fraction * ( final( i ) - origin( i ) );
+            }
+        }
+        else {
+            out->end_pos = final;
+        }
+    }
+}
@@ -0,0 +1,451 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include <valve-bsp-parser/bsp_map.hpp>
+#include <valve-bsp-parser/core/simd.hpp>
+
+using namespace rn;
+
+namespace {
+using simd::float_v;
+
+constexpr std::size_t PACKET_WIDTH = float_v::width;
+
+/// <summary>
+/// Pending packet entries, one per split the lanes of a packet take. Deeper
+/// trees finish the remaining lanes with the scalar walk.
+/// </summary>
+constexpr std::size_t PACKET_STACK_SIZE = 64;
+
+using type_lanes = std::array<float, PACKET_WIDTH>;
+
+/// <summary>
+/// Per-lane sub-segment of a packet, structure of arrays so every field loads
+/// as one float_v
+/// </summary>
+struct packet_segment
+{
+    type_lanes                start_fraction;
+    type_lanes                end_fraction;
+    std::array<type_lanes, 3> origin;
+    std::array<type_lanes, 3> destination;
+};
+
+struct packet_entry
+{
+    std::int32_t   node_index;
+    std::uint32_t  lanes;
+    packet_segment segment;
+};
+
+struct packet_segment_v
+{
+    float_v                start_fraction;
+    float_v                end_fraction;
+    std::array<float_v, 3> origin;
+    std::array<float_v, 3> destination;
+
+    static packet_segment_v load(
+        const packet_segment& segment
+    )
+    {
+        packet_segment_v out;
+        out.start_fraction = float_v::load( segment.start_fraction.data() );
+        out.end_fraction   = float_v::load( segment.end_fraction.data() );
+        for( std::size_t i = 0; i < 3; ++i ) {
+            out.origin.at( i )      = float_v::load( segment.origin.at( i ).data() );
+            out.destination.at( i ) = float_v::load( segment.destination.at( i ).data() );
+        }
+        return out;
+    }
+
+    void store(
+        packet_segment& segment
+    ) const
+    {
+        start_fraction.store( segment.start_fraction.data() );
+        end_fraction.store( segment.end_fraction.data() );
+        for( std::size_t i = 0; i < 3; ++i ) {
+            origin.at( i ).store( segment.origin.at( i ).data() );
+            destination.at( i ).store( segment.destination.at( i ).data() );
+        }
+    }
+
+    static packet_segment_v select(
+        const float_v&          mask,
+        const packet_segment_v& if_set,
+        const packet_segment_v& if_clear
+    )
+    {
+        packet_segment_v out;
+        out.start_fraction = simd::select( mask, if_set.start_fraction, if_clear.start_fraction );
+        out.end_fraction   = simd::select( mask, if_set.end_fraction, if_clear.end_fraction );
+        for( std::size_t i = 0; i < 3; ++i ) {
+            out.origin.at( i )      = simd::select( mask, if_set.origin.at( i ), if_clear.origin.at( i ) );
+            out.destination.at( i ) = simd::select( mask, if_set.destination.at( i ), if_clear.destination.at( i ) );
+        }
+        return out;
+    }
+};
+
+vector3 lane_vector(
+    const std::array<type_lanes, 3>& values,
+    const std::size_t                lane
+)
+{
+    return vector3( values.at( 0 ).at( lane ), values.at( 1 ).at( lane ), values.at( 2 ).at( lane ) );
+}
+
+float_v clamp_fraction(
+    const float_v& value
+)
+{
+    const auto zero = float_v::broadcast( 0.f );
+    const auto one  = float_v::broadcast( 1.f );
+
+    const auto out = simd::select( value < zero, zero, value );
+    return simd::select( out > one, one, out );
+}
+
+template<typename callback>
+void for_each_lane(
+    std::uint32_t lanes,
+    callback      fn
+)
+{
+    for( std::size_t lane = 0; lanes; ++lane, lanes >>= 1 ) {
+        if( lanes & 1u ) {
+            fn( lane );
+        }
+    }
+}
+}
+
+void bsp_map::trace_packet(
+    const vector3*    origins,
+    const vector3*    destinations,
+    const std::size_t count,
+    valve::trace_t*   out
+) const
+{
+    static_assert( PACKET_WIDTH <= 32, "lane masks are 32 bit" );
+
+    /// the brush BVH has no packet walk, its rays go one by one
+    if( _trace_backend == trace_backend::brush_bvh ) {
+        for( std::size_t lane = 0; lane < count; ++lane ) {
+            trace_ray( origins[ lane ], destinations[ lane ], &out[ lane ] );
+        }
+        return;
+    }
+
+    packet_entry current{};
+    current.node_index = 0;
+    current.lanes      = 0;
+
+    type_lanes                      fractions{};
+    std::array<ray_t, PACKET_WIDTH> rays;
+    for( std::size_t lane = 0; lane < count; ++lane ) {
+        auto& trace = out[ lane ];
+        trace.clear();
+        trace.fraction            = 1.0f;
+        trace.fraction_left_solid = 0.f;
+        trace.start_solid         = false;
+        trace.all_solid           = false;
+
+        /// one mailbox stamp for the whole packet, every lane marks brushes with its own bit
+        rays.at( lane )       = lane ? rays.at( 0 ) : begin_ray( origins[ lane ], destinations[ lane ] );
+        rays.at( lane ).start = origins[ lane ];
+        rays.at( lane ).end   = destinations[ lane ];
+        rays.at( lane ).lane  = 1u << lane;
+
+        fractions.at( lane ) = trace.fraction;
+        current.lanes |= 1u << lane;
+
+        current.segment.start_fraction.at( lane ) = 0.f;
+        current.segment.end_fraction.at( lane )   = 1.f;
+        for( std::size_t i = 0; i < 3; ++i ) {
+            current.segment.origin.at( i ).at( lane )      = origins[ lane ]( i );
+            current.segment.destination.at( i ).at( lane ) = destinations[ lane ]( i );
+        }
+    }
+
+    std::array<packet_entry, PACKET_STACK_SIZE> stack;
+    std::size_t                                 stack_size = 0;
+
+    for( ;; ) {
+        /// lanes whose trace already ended before this segment starts drop out, like the scalar walk does
+        const auto segment = packet_segment_v::load( current.segment );
+        const auto started = simd::movemask( float_v::load( fractions.data() ) > segment.start_fraction )
+            | simd::movemask( segment.start_fraction <= float_v::broadcast( 0.f ) );
+        const auto lanes   = current.lanes & started;
+
+        if( lanes && !( lanes & ( lanes - 1 ) ) ) {
+            /// a single lane left, nothing to share anymore so the scalar walk takes over
+            for_each_lane( lanes, [&]( const std::size_t lane )
+            {
+                ray_cast_node( current.node_index,
+                               current.segment.start_fraction.at( lane ),
+                               current.segment.end_fraction.at( lane ),
+                               lane_vector( current.segment.origin, lane ),
+                               lane_vector( current.segment.destination, lane ),
+                               rays.at( lane ),
+                               &out[ lane ] );
+                fractions.at( lane ) = out[ lane ].fraction;
+            } );
+        }
+        else if( lanes && current.node_index < 0 ) {
+            const auto leaf_index = static_cast<std::size_t>( -current.node_index - 1 );
+            for_each_lane( lanes, [&]( const std::size_t lane )
+            {
+                ray_cast_leaf( leaf_index, rays.at( lane ), &out[ lane ] );
+                fractions.at( lane ) = out[ lane ].fraction;
+            } );
+        }
+        else if( lanes ) {
+            /// one node fetch for the whole packet
+            const auto& node     = trace_nodes.at( static_cast<std::size_t>( current.node_index ) );
+            const auto  distance = float_v::broadcast( node.distance );
+
+            float_v start_distance, end_distance;
+
+            if( node.type < 3 ) {
+                start_distance = segment.origin.at( node.type ) - distance;
+                end_distance   = segment.destination.at( node.type ) - distance;
+            }
+            else {
+                auto start_dot = float_v::broadcast( 0.f );
+                auto end_dot   = float_v::broadcast( 0.f );
+                for( std::size_t i = 0; i < 3; ++i ) {
+                    const auto normal = float_v::broadcast( node.normal( i ) );
+                    start_dot = start_dot + segment.origin.at( i ) * normal;
+                    end_dot   = end_dot + segment.destination.at( i ) * normal;
+                }
+                start_distance = start_dot - distance;
+                end_distance   = end_dot - distance;
+            }
+
+            const auto epsilon    = float_v::broadcast( valve::DIST_EPSILON );
+            const auto front_mask = ( start_distance >= epsilon ) & ( end_distance >= epsilon );
+            const auto back_mask  = ( start_distance < float_v::broadcast( -valve::DIST_EPSILON ) ) & ( end_distance < float_v::broadcast( -valve::DIST_EPSILON ) );
+            const auto front      = lanes & simd::movemask( front_mask );
+            const auto back       = lanes & simd::movemask( back_mask );
+            const auto split      = lanes & ~front & ~back;
+
+            const auto child_front = node.children.at( 0 );
+            const auto child_back  = node.children.at( 1 );
+
+            if( !split ) {
+                /// nobody crosses the plane, lanes only part ways
+                if( front && back ) {
+                    if( stack_size < stack.size() ) {
+                        auto& entry = stack.at( stack_size++ );
+                        entry.node_index = child_back;
+                        entry.lanes      = back;
+                        entry.segment    = current.segment;
+
+                        current.node_index = child_front;
+                        current.lanes      = front;
+                        continue;
+                    }
+                    for_each_lane( back, [&]( const std::size_t lane )
+                    {
+                        ray_cast_node( child_back,
+                                       current.segment.start_fraction.at( lane ),
+                                       current.segment.end_fraction.at( lane ),
+                                       lane_vector( current.segment.origin, lane ),
+                                       lane_vector( current.segment.destination, lane ),
+                                       rays.at( lane ),
+                                       &out[ lane ] );
+                        fractions.at( lane ) = out[ lane ].fraction;
+                    } );
+                }
+                current.node_index = front ? child_front : child_back;
+                current.lanes      = front ? front : back;
+                continue;
+            }
+
+            /// same math as split_segment, lane by lane
+            const auto back_first_mask  = start_distance < end_distance;
+            const auto front_first_mask = end_distance < start_distance;
+            const auto inversed         = float_v::broadcast( 1.f ) / ( start_distance - end_distance );
+            const auto fraction_plus    = ( start_distance + epsilon ) * inversed;
+            const auto fraction_minus   = ( start_distance - epsilon ) * inversed;
+
+            const auto fraction_first = clamp_fraction(
+                simd::select( back_first_mask, fraction_minus,
+                    simd::select( front_first_mask, fraction_plus, float_v::broadcast( 1.f ) ) ) );
+            const auto fraction_second = clamp_fraction(
+                simd::select( back_first_mask, fraction_plus,
+                    simd::select( front_first_mask, fraction_minus, float_v::broadcast( 0.f ) ) ) );
+
+            const auto fraction_range = segment.end_fraction - segment.start_fraction;
+
+            packet_segment_v near_segment, far_segment;
+            near_segment.start_fraction = segment.start_fraction;
+            near_segment.end_fraction   = segment.start_fraction + fraction_range * fraction_first;
+            far_segment.start_fraction  = segment.start_fraction + fraction_range * fraction_second;
+            far_segment.end_fraction    = segment.end_fraction;
+            for( std::size_t i = 0; i < 3; ++i ) {
+                const auto delta = segment.destination.at( i ) - segment.origin.at( i );
+
+                near_segment.origin.at( i )      = segment.origin.at( i );
+                near_segment.destination.at( i ) = segment.origin.at( i ) + fraction_first * delta;
+                far_segment.origin.at( i )       = segment.origin.at( i ) + fraction_second * delta;
+                far_segment.destination.at( i )  = segment.destination.at( i );
+            }
+
+            const auto split_back_first  = split & simd::movemask( back_first_mask );
+            const auto split_front_first = split & ~split_back_first;
+
+            if( stack_size + 2 > stack.size() ) {
+                /// out of stack space, every lane finishes this node on the scalar walk
+                packet_segment near_lanes, far_lanes;
+                near_segment.store( near_lanes );
+                far_segment.store( far_lanes );
+
+                for_each_lane( lanes, [&]( const std::size_t lane )
+                {
+                    const auto bit   = 1u << lane;
+                    auto*      trace = &out[ lane ];
+                    if( ( front | back ) & bit ) {
+                        ray_cast_node( ( front & bit ) ? child_front : child_back,
+                                       current.segment.start_fraction.at( lane ),
+                                       current.segment.end_fraction.at( lane ),
+                                       lane_vector( current.segment.origin, lane ),
+                                       lane_vector( current.segment.destination, lane ),
+                                       rays.at( lane ),
+                                       trace );
+                    }
+                    else {
+                        const auto side_id = ( split_back_first & bit ) ? 1 : 0;
+                        ray_cast_node( node.children.at( side_id ),
+                                       near_lanes.start_fraction.at( lane ), near_lanes.end_fraction.at( lane ),
+                                       lane_vector( near_lanes.origin, lane ), lane_vector( near_lanes.destination, lane ),
+                                       rays.at( lane ), trace );
+                        ray_cast_node( node.children.at( !side_id ),
+                                       far_lanes.start_fraction.at( lane ), far_lanes.end_fraction.at( lane ),
+                                       lane_vector( far_lanes.origin, lane ), lane_vector( far_lanes.destination, lane ),
+                                       rays.at( lane ), trace );
+                    }
+                    fractions.at( lane ) = trace->fraction;
+                } );
+            }
+            else {
+                /// Every lane has to see its children in the same order as the scalar walk:
+                /// front-first lanes take the front child now and the back child next,
+                /// back-first lanes take the back child next and the front child last.
+                if( split_back_first ) {
+                    auto& entry = stack.at( stack_size++ );
+                    entry.node_index = child_front;
+                    entry.lanes      = split_back_first;
+                    far_segment.store( entry.segment );
+                }
+
+                const auto back_lanes = back | split;
+                const auto front_lanes = front | split_front_first;
+                if( back_lanes ) {
+                    auto& entry = stack.at( stack_size++ );
+                    entry.node_index = child_back;
+                    entry.lanes      = back_lanes;
+                    packet_segment_v::select( back_mask, segment,
+                        packet_segment_v::select( back_first_mask, near_segment, far_segment ) ).store( entry.segment );
+                }
+
+                if( front_lanes ) {
+                    current.node_index = child_front;
+                    current.lanes      = front_lanes;
+                    packet_segment_v::select( front_mask, segment, near_segment ).store( current.segment );
+                    continue;
+                }
+            }
+        }
+
+        if( !stack_size ) {
+            break;
+        }
+        current = stack.at( --stack_size );
+    }
+
+    for( std::size_t lane = 0; lane < count; ++lane ) {
+        auto& trace = out[ lane ];
+        /// rays that started in solid need the repeated pass, see ray_cast_brushes
+        if( trace.fraction_left_solid > 0.f ) {
+            ray_cast_brushes( origins[ lane ], destinations[ lane ], &trace );
+        }
+        clip_to_displacements( origins[ lane ], destinations[ lane ], &trace );
+        clip_to_props( origins[ lane ], destinations[ lane ], vector3( 0.f, 0.f, 0.f ), &trace );
+
+        if( trace.fraction < 1.0f ) {
+            for( std::size_t i = 0; i < 3; ++i ) {
+                trace.end_pos( i ) = origins[ lane ]( i ) + trace.fraction * ( destinations[ lane ]( i ) - origins[ lane ]( i ) );
+            }
+        }
+        else {
+            trace.end_pos = destinations[ lane ];
+        }
+    }
+}
+
+void bsp_map::trace_rays(
+    const vector3*    origins,
+    const vector3*    destinations,
+    const std::size_t count,
+    valve::trace_t*   out
+) const
+{
+    if( planes.empty() || !out ) {
+        return;
+    }
+
+    for( std::size_t i = 0; i < count; i += PACKET_WIDTH ) {
+        trace_packet( origins + i, destinations + i, std::min( PACKET_WIDTH, count - i ), out + i );
+    }
+}
+
+void bsp_map::is_visible_batch(
+    const vector3*    origins,
+    const vector3*    destinations,
+    const std::size_t count,
+    bool*             out
+) const
+{
+    /// rays the PVS rejects never make it into a packet, the rest are packed densely
+    std::array<vector3, PACKET_WIDTH>        packet_origins;
+    std::array<vector3, PACKET_WIDTH>        packet_destinations;
+    std::array<std::size_t, PACKET_WIDTH>    packet_rays;
+    std::array<valve::trace_t, PACKET_WIDTH> traces;
+    std::size_t                              num_rays = 0;
+
+    auto flush = [&]
+    {
+        traces.fill( valve::trace_t{} );
+        if( !planes.empty() ) {
+            trace_packet( packet_origins.data(), packet_destinations.data(), num_rays, traces.data() );
+        }
+
+        for( std::size_t j = 0; j < num_rays; ++j ) {
+            out[ packet_rays.at( j ) ] = !( traces.at( j ).fraction < 1.f );
+        }
+        num_rays = 0;
+    };
+
+    for( std::size_t i = 0; i < count; ++i ) {
+        if( !visibility.can_see( cluster_at( origins[ i ] ), cluster_at( destinations[ i ] ) ) ) {
+            out[ i ] = false;
+            continue;
+        }
+
+        packet_origins.at( num_rays )      = origins[ i ];
+        packet_destinations.at( num_rays ) = destinations[ i ];
+        packet_rays.at( num_rays )         = i;
+        if( ++num_rays == PACKET_WIDTH ) {
+            flush();
+        }
+    }
+
+    if( num_rays ) {
+        flush();
+    }
+}
@@ -0,0 +1,439 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include <valve-bsp-parser/bsp_map.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace rn;
+
+namespace {
+/// <summary>
+/// Pending BVH nodes clip_to_props keeps around
+/// </summary>
+constexpr std::size_t PROP_BVH_STACK_SIZE = 64;
+
+static_assert( PROP_BVH_STACK_SIZE > valve::MAX_BVH_DEPTH, "a walk keeps at most MAX_BVH_DEPTH + 1 nodes pending" );
+
+constexpr float DEGREES_TO_RADIANS = 3.14159265358979323846f / 180.f;
+
+/// <summary>
+/// Leading part of a sprp entry as stored, every version starts with it.
+/// Trivially copyable so it can be read straight out of the lump,
+/// valve::static_prop_t is built from it.
+/// </summary>
+struct raw_static_prop
+{
+    std::array<float, 3> origin;      // 0x00
+    std::array<float, 3> angles;      // 0x0C
+    std::uint16_t        model_index; // 0x18
+    std::uint16_t        first_leaf;  // 0x1A
+    std::uint16_t        leaf_count;  // 0x1C
+    std::uint8_t         solid;       // 0x1E
+    std::uint8_t         flags;       // 0x1F
+};//Size=0x20
+
+static_assert( sizeof( raw_static_prop ) == 0x20, "raw_static_prop is copied straight out of the sprp lump" );
+
+/// <summary>
+/// Reads a T at offset out of data, false if it doesn't fit
+/// </summary>
+template<typename type>
+bool read_value(
+    const std::vector<std::uint8_t>& data,
+    const std::size_t                offset,
+    type&                            out
+)
+{
+    if( offset > data.size() || data.size() - offset < sizeof( type ) ) {
+        return false;
+    }
+
+    std::memcpy( &out, data.data() + offset, sizeof( type ) );
+    return true;
+}
+
+/// <summary>
+/// Local x, y and z of a prop rotated by angles (pitch, yaw, roll), the
+/// columns of the engine's AngleMatrix
+/// </summary>
+std::array<vector3, 3> angle_axes(
+    const vector3& angles
+)
+{
+    const auto pitch = angles( 0 ) * DEGREES_TO_RADIANS;
+    const auto yaw   = angles( 1 ) * DEGREES_TO_RADIANS;
+    const auto roll  = angles( 2 ) * DEGREES_TO_RADIANS;
+
+    const auto sp = std::sin( pitch ), cp = std::cos( pitch );
+    const auto sy = std::sin( yaw ), cy = std::cos( yaw );
+    const auto sr = std::sin( roll ), cr = std::cos( roll );
+
+    return {
+        vector3( cp * cy, cp * sy, -sp ),
+        vector3( sr * sp * cy - cr * sy, sr * sp * sy + cr * cy, sr * cp ),
+        vector3( cr * sp * cy + sr * sy, cr * sp * sy - sr * cy, cr * cp )
+    };
+}
+
+/// <summary>
+/// Narrows [enter, leave] to the part of origin + t * delta inside the slab
+/// [min, max], false once nothing is left
+/// </summary>
+bool clip_slab(
+    const float origin,
+    const float delta,
+    const float min,
+    const float max,
+    float&      enter,
+    float&      leave
+)
+{
+    if( delta == 0.f ) {
+        return origin >= min && origin <= max;
+    }
+
+    const auto inversed_delta = 1.f / delta;
+
+    auto near_fraction = ( min - origin ) * inversed_delta;
+    auto far_fraction  = ( max - origin ) * inversed_delta;
+    if( near_fraction > far_fraction ) {
+        std::swap( near_fraction, far_fraction );
+    }
+
+    enter = std::max( enter, near_fraction );
+    leave = std::min( leave, far_fraction );
+    return enter <= leave;
+}
+}
+
+bool bsp_map::parse_game_lump(
+    const file_view& file
+)
+{
+    game_lumps.clear();
+
+    const auto& lump = bsp_header.lumps.at( static_cast<std::size_t>( valve::lump_index::game_lump ) );
+    if( lump.file_size < static_cast<std::int32_t>( sizeof( std::int32_t ) ) ) {
+        return true;
+    }
+
+    auto* const profiled  = lump_timer::current();
+    auto        timestamp = profiled ? load_profile::clock::now() : load_profile::clock::time_point{};
+
+    std::int32_t num_lumps = 0;
+    if( !file.read_object( static_cast<std::size_t>( lump.file_offset ), num_lumps ) ) {
+        return false;
+    }
+
+    const auto directory_size = static_cast<std::size_t>( num_lumps ) * sizeof( valve::dgamelump_t );
+    if( num_lumps < 0
+        || static_cast<std::size_t>( num_lumps ) > valve::MAX_MAP_GAMELUMPS
+        || directory_size > static_cast<std::size_t>( lump.file_size ) - sizeof( std::int32_t ) ) {
+        return false;
+    }
+
+    game_lumps.resize( static_cast<std::size_t>( num_lumps ) );
+    if( !file.copy( static_cast<std::size_t>( lump.file_offset ) + sizeof( std::int32_t ), directory_size, game_lumps.data() ) ) {
+        game_lumps.clear();
+        return false;
+    }
+    if( profiled ) {
+        profiled->compressed_bytes   += sizeof( std::int32_t ) + directory_size;
+        profiled->uncompressed_bytes += sizeof( std::int32_t ) + directory_size;
+        profiled->read_ns            += load_profile::lap( timestamp );
+    }
+
+    return true;
+}
+
+bool bsp_map::read_game_lump(
+    const file_view&           file,
+    const std::int32_t         id,
+    std::vector<std::uint8_t>& out
+) const
+{
+    using valve::lzma_header_t;
+
+    const auto entry = std::find_if( game_lumps.begin(), game_lumps.end(), [id]( const valve::dgamelump_t& lump )
+    {
+        return lump.id == id;
+    } );
+    if( entry == game_lumps.end() || entry->fileofs < 0 || entry->filelen <= 0 ) {
+        return false;
+    }
+
+    const auto offset = static_cast<std::size_t>( entry->fileofs );
+
+    auto* const profiled  = lump_timer::current();
+    auto        timestamp = profiled ? load_profile::clock::now() : load_profile::clock::time_point{};
+
+    //Every game lump is compressed on its own, the game lump as a whole never is.
+    if( !( entry->flags & valve::GAMELUMP_COMPRESSED ) ) {
+        out.resize( static_cast<std::size_t>( entry->filelen ) );
+        if( !file.copy( offset, out.size(), out.data() ) ) {
+            return false;
+        }
+        if( profiled ) {
+            profiled->compressed_bytes   += out.size();
+            profiled->uncompressed_bytes += out.size();
+            profiled->read_ns            += load_profile::lap( timestamp );
+        }
+        return true;
+    }
+
+    lzma_header_t lzma_header{};
+    if( !file.read_object( offset, lzma_header ) || !valve::has_valid_lzma_ident( lzma_header.id ) ) {
+        return false;
+    }
+
+    //The compressed stream has to fit in the sub-lump behind its header, a larger lzmaSize reads past it.
+    if( lzma_header.actualSize <= 0 || lzma_header.lzmaSize <= 0
+        || static_cast<std::size_t>( lzma_header.actualSize ) > valve::MAX_LUMP_UNCOMPRESSED_SIZE
+        || static_cast<std::size_t>( entry->filelen ) < sizeof( lzma_header_t )
+        || static_cast<std::size_t>( lzma_header.lzmaSize ) > static_cast<std::size_t>( entry->filelen ) - sizeof( lzma_header_t ) ) {
+        return false;
+    }
+
+    const auto compressed_size = static_cast<std::size_t>( lzma_header.lzmaSize );
+    const auto actual_size     = static_cast<std::size_t>( lzma_header.actualSize );
+
+    auto&       compressed_buffer = read_scratch();
+    const auto* compressed        = file.read( offset + sizeof( lzma_header_t ), compressed_size, compressed_buffer );
+    if( !compressed ) {
+        return false;
+    }
+    if( profiled ) {
+        profiled->compressed_bytes += static_cast<std::size_t>( entry->filelen );
+        profiled->read_ns          += load_profile::lap( timestamp );
+    }
+
+    out.resize( actual_size );
+
+    std::size_t src_len  = compressed_size;
+    std::size_t dest_len = actual_size;
+    const auto  result   = LzmaUncompress( out.data(),
+                                           &dest_len,
+                                           compressed,
+                                           &src_len,
+                                           reinterpret_cast<const unsigned char*>( lzma_header.properties.data() ),
+                                           LZMA_PROPS_SIZE );
+    if( result != SZ_OK || dest_len != actual_size ) {
+        out.clear();
+        return false;
+    }
+    if( profiled ) {
+        profiled->uncompressed_bytes += actual_size;
+        profiled->decompress_ns      += load_profile::lap( timestamp );
+    }
+
+    return true;
+}
+
+bool bsp_map::parse_static_props(
+    const file_view&    file,
+    const load_options& options
+)
+{
+    static_prop_models.clear();
+    static_props.clear();
+    prop_boxes.clear();
+    prop_bvh.clear();
+
+    if( !parse_game_lump( file ) ) {
+        return false;
+    }
+
+    std::vector<std::uint8_t> data;
+    if( !read_game_lump( file, valve::GAMELUMP_STATIC_PROPS, data ) ) {
+        return true;
+    }
+
+    std::size_t  offset     = 0;
+    std::int32_t num_models = 0;
+    if( !read_value( data, offset, num_models ) || num_models < 0
+        || static_cast<std::size_t>( num_models ) > ( data.size() - sizeof( num_models ) ) / valve::STATIC_PROP_NAME_LENGTH ) {
+        return false;
+    }
+    offset += sizeof( num_models );
+
+    static_prop_models.reserve( static_cast<std::size_t>( num_models ) );
+    for( std::int32_t i = 0; i < num_models; ++i ) {
+        const auto* name = reinterpret_cast<const char*>( data.data() + offset );
+        static_prop_models.emplace_back( name, strnlen( name, valve::STATIC_PROP_NAME_LENGTH ) );
+        offset += valve::STATIC_PROP_NAME_LENGTH;
+    }
+
+    //The leaves every prop touches, the BVH below replaces them.
+    std::int32_t num_leaves = 0;
+    if( !read_value( data, offset, num_leaves ) || num_leaves < 0 ) {
+        return false;
+    }
+    offset += sizeof( num_leaves ) + static_cast<std::size_t>( num_leaves ) * sizeof( std::uint16_t );
+
+    std::int32_t num_props = 0;
+    if( !read_value( data, offset, num_props ) || num_props < 0 ) {
+        return false;
+    }
+    offset += sizeof( num_props );
+
+    if( !num_props ) {
+        return true;
+    }
+
+    //The prop size differs per version, the props fill the rest of the lump so the stride falls out of that.
+    const auto remaining = data.size() - std::min( offset, data.size() );
+    const auto stride    = remaining / static_cast<std::size_t>( num_props );
+    if( stride < sizeof( raw_static_prop ) || remaining % static_cast<std::size_t>( num_props ) ) {
+        return false;
+    }
+
+    static_props.resize( static_cast<std::size_t>( num_props ) );
+    for( std::size_t i = 0; i < static_props.size(); ++i ) {
+        raw_static_prop raw{};
+        if( !read_value( data, offset + i * stride, raw ) ) {
+            static_props.clear();
+            return false;
+        }
+
+        auto& prop       = static_props.at( i );
+        prop.origin      = vector3( raw.origin.at( 0 ), raw.origin.at( 1 ), raw.origin.at( 2 ) );
+        prop.angles      = vector3( raw.angles.at( 0 ), raw.angles.at( 1 ), raw.angles.at( 2 ) );
+        prop.model_index = raw.model_index;
+        prop.first_leaf  = raw.first_leaf;
+        prop.leaf_count  = raw.leaf_count;
+        prop.solid       = raw.solid;
+        prop.flags       = raw.flags;
+    }
+
+    if( !options.prop_bounds ) {
+        return true;
+    }
+
+    for( std::size_t i = 0; i < static_props.size(); ++i ) {
+        const auto& prop = static_props.at( i );
+        if( prop.solid == valve::SOLID_NONE || prop.model_index >= static_prop_models.size() ) {
+            continue;
+        }
+
+        valve::prop_box_t box{};
+        if( !options.prop_bounds( static_prop_models.at( prop.model_index ), box.mins, box.maxs ) ) {
+            continue;
+        }
+
+        box.origin     = prop.origin;
+        box.axes       = angle_axes( prop.angles );
+        box.prop_index = static_cast<std::int32_t>( i );
+        prop_boxes.push_back( box );
+    }
+
+    build_prop_bvh();
+    return true;
+}
+
+void bsp_map::build_prop_bvh()
+{
+    prop_bvh.clear();
+    if( prop_boxes.empty() ) {
+        return;
+    }
+
+    std::vector<vector3> box_mins( prop_boxes.size() ), box_maxs( prop_boxes.size() );
+    for( std::size_t i = 0; i < prop_boxes.size(); ++i ) {
+        auto& box = prop_boxes.at( i );
+        for( std::size_t k = 0; k < 3; ++k ) {
+            auto center = box.origin( k );
+            auto extent = 0.f;
+            for( std::size_t j = 0; j < 3; ++j ) {
+                center += box.axes.at( j )( k ) * ( box.mins( j ) + box.maxs( j ) ) * 0.5f;
+                extent += std::abs( box.axes.at( j )( k ) ) * ( box.maxs( j ) - box.mins( j ) ) * 0.5f;
+            }
+            box.world_mins( k ) = center - extent;
+            box.world_maxs( k ) = center + extent;
+        }
+        box_mins.at( i ) = box.world_mins;
+        box_maxs.at( i ) = box.world_maxs;
+    }
+
+    const auto order = build_bvh( box_mins, box_maxs, prop_bvh );
+
+    std::vector<valve::prop_box_t> ordered;
+    ordered.reserve( prop_boxes.size() );
+    for( const auto box : order ) {
+        ordered.push_back( prop_boxes.at( box ) );
+    }
+    prop_boxes = std::move( ordered );
+}
+
+void bsp_map::clip_to_props(
+    const vector3&  origin,
+    const vector3&  destination,
+    const vector3&  extents,
+    valve::trace_t* out
+) const
+{
+    if( prop_bvh.empty() ) {
+        return;
+    }
+
+    vector3 delta;
+    for( std::size_t k = 0; k < 3; ++k ) {
+        delta( k ) = destination( k ) - origin( k );
+    }
+
+    std::array<std::int32_t, PROP_BVH_STACK_SIZE> stack;
+    std::size_t                                   stack_size = 0;
+
+    stack.at( stack_size++ ) = 0;
+    while( stack_size ) {
+        const auto& node = prop_bvh.at( static_cast<std::size_t>( stack.at( --stack_size ) ) );
+
+        auto enter = 0.f;
+        auto leave = out->fraction;
+        if( !clip_to_box( origin, delta, extents, node.mins, node.maxs, enter, leave ) ) {
+            continue;
+        }
+
+        if( !node.num_boxes ) {
+            stack.at( stack_size++ ) = node.first;
+            stack.at( stack_size++ ) = static_cast<std::int32_t>( &node - prop_bvh.data() ) + 1;
+            continue;
+        }
+
+        for( auto i = node.first; i < node.first + node.num_boxes; ++i ) {
+            const auto& box = prop_boxes.at( static_cast<std::size_t>( i ) );
+
+            /// separating axes of the swept box against the prop: the world axes first, then the
+            /// prop's own axes where the swept box grows by its reach along each of them
+            auto box_enter = -std::numeric_limits<float>::max();
+            auto box_leave = std::numeric_limits<float>::max();
+            auto box_hit   = clip_to_box( origin, delta, extents, box.world_mins, box.world_maxs, box_enter, box_leave );
+            for( std::size_t j = 0; j < 3 && box_hit; ++j ) {
+                const auto& axis = box.axes.at( j );
+
+                const auto local_origin = ( origin( 0 ) - box.origin( 0 ) ) * axis( 0 )
+                    + ( origin( 1 ) - box.origin( 1 ) ) * axis( 1 )
+                    + ( origin( 2 ) - box.origin( 2 ) ) * axis( 2 );
+                const auto local_delta = delta.dot( axis );
+                const auto reach       = std::abs( axis( 0 ) ) * extents( 0 ) + std::abs( axis( 1 ) ) * extents( 1 ) + std::abs( axis( 2 ) ) * extents( 2 );
+
+                box_hit = clip_slab( local_origin, local_delta, box.mins( j ) - reach, box.maxs( j ) + reach, box_enter, box_leave );
+            }
+
+            if( !box_hit || box_enter <= 0.f || box_enter >= out->fraction ) {
+                continue;
+            }
+
+            out->fraction        = box_enter;
+            out->contents        = valve::CONTENTS_SOLID;
+            out->brush           = nullptr;
+            out->num_brush_sides = 0;
+            out->static_prop     = box.prop_index;
+            out->displacement    = -1;
+            out->surface         = -1;
+        }
+    }
+}
@@ -0,0 +1,104 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include <valve-bsp-parser/core/entity_reader.hpp>
+
+using namespace rn;
+
+entity_reader::entity_reader(
+    char*             text,
+    const std::size_t size
+)
+    : _cursor( text )
+    , _end( text + size )
+{ }
+
+bool entity_reader::read_entity(
+    std::vector<valve::entity_keyvalue_t>& keyvalues
+)
+{
+    std::string_view token;
+
+    const auto opening = read_token( token );
+    if( opening != token_type::open_brace ) {
+        _failed = opening != token_type::end;
+        return false;
+    }
+
+    for( ;; ) {
+        valve::entity_keyvalue_t keyvalue;
+
+        const auto key = read_token( keyvalue.key );
+        if( key == token_type::close_brace ) {
+            return true;
+        }
+        if( key != token_type::string || read_token( keyvalue.value ) != token_type::string ) {
+            _failed = true;
+            return false;
+        }
+
+        keyvalues.push_back( keyvalue );
+    }
+}
+
+entity_reader::token_type entity_reader::read_token(
+    std::string_view& token
+)
+{
+    for( ;; ) {
+        /// the lump ends with a terminating zero, anything after it is padding
+        while( _cursor != _end && *_cursor != '\0' && static_cast<unsigned char>( *_cursor ) <= ' ' ) {
+            ++_cursor;
+        }
+        if( _cursor == _end || *_cursor == '\0' ) {
+            return token_type::end;
+        }
+
+        if( *_cursor != '/' || _end - _cursor < 2 || _cursor[ 1 ] != '/' ) {
+            break;
+        }
+        while( _cursor != _end && *_cursor != '\n' ) {
+            ++_cursor;
+        }
+    }
+
+    switch( *_cursor ) {
+    case '{':
+        ++_cursor;
+        return token_type::open_brace;
+    case '}':
+        ++_cursor;
+        return token_type::close_brace;
+    case '"': {
+        /// escapes shrink the string, so it is decoded over itself
+        auto* first  = ++_cursor;
+        auto* output = first;
+        for( ; _cursor != _end && *_cursor != '"'; ++_cursor ) {
+            if( *_cursor == '\\' && _end - _cursor > 1 && ( _cursor[ 1 ] == '"' || _cursor[ 1 ] == '\\' ) ) {
+                ++_cursor;
+            }
+            *output++ = *_cursor;
+        }
+        if( _cursor == _end ) {
+            return token_type::end;
+        }
+
+        ++_cursor;
+        token = std::string_view( first, static_cast<std::size_t>( output - first ) );
+        return token_type::string;
+    }
+    default: {
+        /// unquoted tokens run up to the next blank, brace or quote
+        auto* first = _cursor;
+        while( _cursor != _end && static_cast<unsigned char>( *_cursor ) > ' '
+            && *_cursor != '{' && *_cursor != '}' && *_cursor != '"' ) {
+            ++_cursor;
+        }
+
+        token = std::string_view( first, static_cast<std::size_t>( _cursor - first ) );
+        return token_type::string;
+    }
+    }
+}
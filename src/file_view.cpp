@@ -0,0 +1,240 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include <valve-bsp-parser/core/file_view.hpp>
+
+#if defined(_WIN32)
+    #if !defined(WIN32_LEAN_AND_MEAN)
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <Windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+using namespace rn;
+
+file_view::~file_view()
+{
+    close();
+}
+
+file_view::file_view(
+    file_view&& rhs
+) noexcept
+{
+    *this = std::move( rhs );
+}
+
+file_view& file_view::operator = (
+    file_view&& rhs
+) noexcept
+{
+    if( this == &rhs ) {
+        return *this;
+    }
+
+    close();
+
+    std::lock_guard<std::mutex> lock( rhs._stream_mutex );
+
+    _access  = rhs._access;
+    _size    = rhs._size;
+    _mapping = rhs._mapping;
+    _stream  = std::move( rhs._stream );
+#if defined(_WIN32)
+    _file_handle    = rhs._file_handle;
+    _mapping_handle = rhs._mapping_handle;
+
+    rhs._file_handle    = nullptr;
+    rhs._mapping_handle = nullptr;
+#endif
+
+    rhs._size    = 0;
+    rhs._mapping = nullptr;
+
+    return *this;
+}
+
+bool file_view::open(
+    const std::string& file_path,
+    const file_access  access
+)
+{
+    close();
+
+    if( access == file_access::memory_mapped ) {
+    #if defined(_WIN32)
+        auto* file = CreateFileA( file_path.data(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr );
+        if( file != INVALID_HANDLE_VALUE ) {
+            LARGE_INTEGER file_size{};
+            if( GetFileSizeEx( file, &file_size ) && file_size.QuadPart > 0 ) {
+                auto* mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+                if( mapping ) {
+                    auto* view = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+                    if( view ) {
+                        _access         = file_access::memory_mapped;
+                        _size           = static_cast<std::size_t>( file_size.QuadPart );
+                        _mapping        = static_cast<const std::uint8_t*>( view );
+                        _file_handle    = file;
+                        _mapping_handle = mapping;
+                        return true;
+                    }
+                    CloseHandle( mapping );
+                }
+            }
+            CloseHandle( file );
+        }
+    #else
+        const auto fd = ::open( file_path.data(), O_RDONLY );
+        if( fd >= 0 ) {
+            struct stat file_stat{};
+            if( ::fstat( fd, &file_stat ) == 0 && file_stat.st_size > 0 ) {
+                const auto file_size = static_cast<std::size_t>( file_stat.st_size );
+                auto* view = ::mmap( nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+                if( view != MAP_FAILED ) {
+                    /// lumps are scattered all over the file, don't let the kernel
+                    /// read ahead into the pakfile or lighting data we never touch
+                    ::madvise( view, file_size, MADV_RANDOM );
+                    ::close( fd );
+
+                    _access  = file_access::memory_mapped;
+                    _size    = file_size;
+                    _mapping = static_cast<const std::uint8_t*>( view );
+                    return true;
+                }
+            }
+            ::close( fd );
+        }
+    #endif
+    #if defined(RN_BSP_PARSER_MESSAGES)
+        std::printf( "[!] failed to map %s, falling back to buffered reads\n", file_path.data() );
+    #endif
+    }
+
+    std::lock_guard<std::mutex> lock( _stream_mutex );
+
+    _stream.open( file_path, std::ios_base::binary | std::ios_base::ate );
+    if( !_stream ) {
+        return false;
+    }
+
+    const auto file_size = static_cast<std::streamoff>( _stream.tellg() );
+    if( file_size <= 0 ) {
+        _stream.close();
+        return false;
+    }
+
+    _access = file_access::copy_on_demand;
+    _size   = static_cast<std::size_t>( file_size );
+    return true;
+}
+
+void file_view::close()
+{
+    if( _mapping ) {
+    #if defined(_WIN32)
+        UnmapViewOfFile( _mapping );
+        CloseHandle( _mapping_handle );
+        CloseHandle( _file_handle );
+
+        _mapping_handle = nullptr;
+        _file_handle    = nullptr;
+    #else
+        ::munmap( const_cast<std::uint8_t*>( _mapping ), _size );
+    #endif
+        _mapping = nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock( _stream_mutex );
+    if( _stream.is_open() ) {
+        _stream.close();
+    }
+
+    _size = 0;
+}
+
+void file_view::prefetch(
+    const std::size_t offset,
+    const std::size_t size
+) const
+{
+#if !defined(_WIN32)
+    if( !_mapping || offset >= _size || !size ) {
+        return;
+    }
+
+    /// madvise wants a page aligned address
+    static const auto page_size = static_cast<std::size_t>( ::sysconf( _SC_PAGESIZE ) );
+
+    const auto begin = offset & ~( page_size - 1 );
+    const auto end   = std::min( offset + size, _size );
+    ::madvise( const_cast<std::uint8_t*>( _mapping ) + begin, end - begin, MADV_WILLNEED );
+#else
+    ( void )offset;
+    ( void )size;
+#endif
+}
+
+const std::uint8_t* file_view::read(
+    const std::size_t          offset,
+    const std::size_t          size,
+    std::vector<std::uint8_t>& buffer
+) const
+{
+    if( offset > _size || size > _size - offset ) {
+        return nullptr;
+    }
+
+    if( _mapping ) {
+        return _mapping + offset;
+    }
+
+    buffer.resize( size );
+    if( !size ) {
+        return buffer.data();
+    }
+
+    std::lock_guard<std::mutex> lock( _stream_mutex );
+
+    _stream.clear();
+    _stream.seekg( static_cast<std::streamoff>( offset ) );
+    _stream.read( reinterpret_cast<char*>( buffer.data() ), static_cast<std::streamsize>( size ) );
+
+    return _stream.gcount() == static_cast<std::streamsize>( size )
+        ? buffer.data()
+        : nullptr;
+}
+
+bool file_view::copy(
+    const std::size_t offset,
+    const std::size_t size,
+    void*             destination
+) const
+{
+    if( offset > _size || size > _size - offset ) {
+        return false;
+    }
+    if( !size ) {
+        return true;
+    }
+
+    if( _mapping ) {
+        std::memcpy( destination, _mapping + offset, size );
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock( _stream_mutex );
+
+    _stream.clear();
+    _stream.seekg( static_cast<std::streamoff>( offset ) );
+    _stream.read( static_cast<char*>( destination ), static_cast<std::streamsize>( size ) );
+
+    return _stream.gcount() == static_cast<std::streamsize>( size );
+}
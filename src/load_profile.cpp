@@ -0,0 +1,378 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include <valve-bsp-parser/core/load_profile.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+using namespace rn;
+
+namespace {
+/// <summary>
+/// Name of the lumps bsp_map reads, nullptr for the rest
+/// </summary>
+const char* lump_name(
+    const valve::lump_index lump
+)
+{
+    switch( lump ) {
+    case valve::lump_index::entities:     return "entities";
+    case valve::lump_index::planes:       return "planes";
+    case valve::lump_index::vertices:     return "vertices";
+    case valve::lump_index::visibility:   return "visibility";
+    case valve::lump_index::nodes:        return "nodes";
+    case valve::lump_index::tex_info:     return "tex_info";
+    case valve::lump_index::faces:        return "faces";
+    case valve::lump_index::leafs:        return "leafs";
+    case valve::lump_index::edges:        return "edges";
+    case valve::lump_index::surfedges:    return "surfedges";
+    case valve::lump_index::models:       return "models";
+    case valve::lump_index::leaf_faces:   return "leaf_faces";
+    case valve::lump_index::leaf_brushes: return "leaf_brushes";
+    case valve::lump_index::brushes:      return "brushes";
+    case valve::lump_index::brush_sides:  return "brush_sides";
+    case valve::lump_index::disp_info:    return "disp_info";
+    case valve::lump_index::disp_verts:   return "disp_verts";
+    case valve::lump_index::game_lump:    return "game_lump";
+    default:                              return nullptr;
+    }
+}
+
+std::string lump_label(
+    const lump_profile& lump
+)
+{
+    std::array<char, 64> buffer;
+    const auto*          name = lump_name( lump.lump );
+    if( name ) {
+        std::snprintf( buffer.data(), buffer.size(), "%s", name );
+    }
+    else {
+        std::snprintf( buffer.data(), buffer.size(), "lump %zu", static_cast<std::size_t>( lump.lump ) );
+    }
+    return buffer.data();
+}
+
+double to_ms(
+    const std::uint64_t ns
+)
+{
+    return static_cast<double>( ns ) / 1e6;
+}
+
+double to_us(
+    const std::uint64_t ns
+)
+{
+    return static_cast<double>( ns ) / 1e3;
+}
+
+double to_kib(
+    const std::uint64_t bytes
+)
+{
+    return static_cast<double>( bytes ) / 1024.0;
+}
+
+/// <summary>
+/// Uncompressed per stored byte, 1 for lumps stored raw
+/// </summary>
+double ratio(
+    const lump_profile& lump
+)
+{
+    return lump.compressed_bytes
+        ? static_cast<double>( lump.uncompressed_bytes ) / static_cast<double>( lump.compressed_bytes )
+        : 1.0;
+}
+
+/// <summary>
+/// Appends printf formatted text to out
+/// </summary>
+template<typename... args_t>
+void append(
+    std::string& out,
+    const char*  format,
+    args_t...    args
+)
+{
+    std::array<char, 256> buffer;
+    const auto            length = std::snprintf( buffer.data(), buffer.size(), format, args... );
+    if( length > 0 ) {
+        out.append( buffer.data(), std::min( static_cast<std::size_t>( length ), buffer.size() - 1 ) );
+    }
+}
+}
+
+lump_profile load_profile::totals() const
+{
+    lump_profile total;
+    for( const auto& lump : lumps ) {
+        total.compressed_bytes   += lump.compressed_bytes;
+        total.uncompressed_bytes += lump.uncompressed_bytes;
+        total.read_ns            += lump.read_ns;
+        total.decompress_ns      += lump.decompress_ns;
+        total.process_ns         += lump.process_ns;
+    }
+    return total;
+}
+
+std::string load_profile::summary() const
+{
+    //Records are pushed as steps finish, list them in the order they started.
+    auto sorted_lumps = lumps;
+    std::sort( sorted_lumps.begin(), sorted_lumps.end(), []( const lump_profile& lhs, const lump_profile& rhs )
+    {
+        return lhs.start_ns < rhs.start_ns;
+    } );
+    auto sorted_stages = stages;
+    std::sort( sorted_stages.begin(), sorted_stages.end(), []( const stage_profile& lhs, const stage_profile& rhs )
+    {
+        return lhs.start_ns < rhs.start_ns;
+    } );
+
+    std::string out;
+    append( out, "%-14s %5s %12s %12s %7s %9s %9s %9s %9s\n",
+            "lump", "patch", "stored KiB", "size KiB", "ratio", "read ms", "decomp ms", "proc ms", "total ms" );
+
+    auto append_lump = [&out]( const char* label, const char* patch, const lump_profile& lump )
+    {
+        append( out, "%-14s %5s %12.1f %12.1f %7.2f %9.3f %9.3f %9.3f %9.3f\n",
+                label, patch,
+                to_kib( lump.compressed_bytes ), to_kib( lump.uncompressed_bytes ), ratio( lump ),
+                to_ms( lump.read_ns ), to_ms( lump.decompress_ns ), to_ms( lump.process_ns ), to_ms( lump.total_ns() ) );
+    };
+
+    for( const auto& lump : sorted_lumps ) {
+        std::array<char, 16> patch;
+        if( lump.patch < 0 ) {
+            std::snprintf( patch.data(), patch.size(), "-" );
+        }
+        else {
+            std::snprintf( patch.data(), patch.size(), "%d", lump.patch );
+        }
+        append_lump( lump_label( lump ).data(), patch.data(), lump );
+    }
+    append_lump( "all lumps", "", totals() );
+
+    append( out, "\n%-24s %10s %12s\n", "stage", "start ms", "duration ms" );
+    for( const auto& stage : sorted_stages ) {
+        append( out, "%-24s %10.3f %12.3f\n", stage.name.data(), to_ms( stage.start_ns ), to_ms( stage.duration_ns ) );
+    }
+
+    append( out, "\nload %.3f ms, %s%s\n",
+            to_ms( total_ns ),
+            cache_hit ? "baked cache hit" : "parsed from lumps",
+            succeeded ? "" : ", failed" );
+    return out;
+}
+
+bool load_profile::write_chrome_trace(
+    const std::string& file_path
+) const
+{
+    std::ofstream file( file_path, std::ios_base::binary | std::ios_base::trunc );
+    if( !file.good() ) {
+        return false;
+    }
+
+    //Trace viewers want small integer thread ids, number them as they show up.
+    std::vector<std::thread::id> threads;
+    auto thread_index = [&threads]( const std::thread::id thread )
+    {
+        const auto it = std::find( threads.begin(), threads.end(), thread );
+        if( it != threads.end() ) {
+            return static_cast<std::size_t>( it - threads.begin() ) + 1;
+        }
+        threads.push_back( thread );
+        return threads.size();
+    };
+
+    std::string out = "{\"traceEvents\":[\n";
+    auto first      = true;
+
+    auto append_event = [&]( const char* name, const char* category, const std::uint64_t start_ns,
+                             const std::uint64_t duration_ns, const std::size_t thread, const std::string& args )
+    {
+        append( out, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%zu",
+                first ? "" : ",\n", name, category, to_us( start_ns ), to_us( duration_ns ), thread );
+        if( !args.empty() ) {
+            out += ",\"args\":{";
+            out += args;
+            out += '}';
+        }
+        out += '}';
+        first = false;
+    };
+
+    append_event( "load", "load", 0, total_ns, thread_index( _thread ), {} );
+
+    for( const auto& stage : stages ) {
+        append_event( stage.name.data(), "stage", stage.start_ns, stage.duration_ns, thread_index( stage.thread ), {} );
+    }
+
+    for( const auto& lump : lumps ) {
+        const auto thread = thread_index( lump.thread );
+        const auto label  = lump_label( lump );
+
+        std::string args;
+        append( args, "\"patch\":%d,\"compressed_bytes\":%llu,\"uncompressed_bytes\":%llu,\"ratio\":%.3f",
+                lump.patch,
+                static_cast<unsigned long long>( lump.compressed_bytes ),
+                static_cast<unsigned long long>( lump.uncompressed_bytes ),
+                ratio( lump ) );
+
+        append_event( label.data(), lump.patch < 0 ? "lump" : "lmp patch", lump.start_ns, lump.total_ns(), thread, args );
+
+        auto start = lump.start_ns;
+        if( lump.read_ns ) {
+            append_event( "read", "read", start, lump.read_ns, thread, {} );
+        }
+        start += lump.read_ns;
+        if( lump.decompress_ns ) {
+            append_event( "decompress", "decompress", start, lump.decompress_ns, thread, {} );
+        }
+        start += lump.decompress_ns;
+        if( lump.process_ns ) {
+            append_event( "process", "process", start, lump.process_ns, thread, {} );
+        }
+    }
+    out += "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    file.write( out.data(), static_cast<std::streamsize>( out.size() ) );
+    return file.good();
+}
+
+void load_profile::begin()
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    lumps.clear();
+    stages.clear();
+    total_ns  = 0;
+    cache_hit = false;
+    succeeded = false;
+    _thread   = std::this_thread::get_id();
+    _start    = clock::now();
+}
+
+void load_profile::finish(
+    const bool result
+)
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    total_ns  = elapsed_ns( clock::now() );
+    succeeded = result;
+}
+
+void load_profile::add_lump(
+    const lump_profile& lump
+)
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    lumps.push_back( lump );
+}
+
+void load_profile::add_stage(
+    const char*             name,
+    const clock::time_point start,
+    const clock::time_point end
+)
+{
+    stage_profile stage;
+    stage.name        = name;
+    stage.start_ns    = elapsed_ns( start );
+    stage.duration_ns = static_cast<std::uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>( end - start ).count() );
+    stage.thread      = std::this_thread::get_id();
+
+    std::lock_guard<std::mutex> lock( _mutex );
+    stages.push_back( std::move( stage ) );
+}
+
+std::uint64_t load_profile::elapsed_ns(
+    const clock::time_point time
+) const
+{
+    if( time <= _start ) {
+        return 0;
+    }
+    return static_cast<std::uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>( time - _start ).count() );
+}
+
+std::uint64_t load_profile::lap(
+    clock::time_point& since
+)
+{
+    const auto now     = clock::now();
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( now - since ).count();
+    since              = now;
+    return static_cast<std::uint64_t>( std::max<std::int64_t>( elapsed, 0 ) );
+}
+
+lump_timer::lump_timer(
+    load_profile*           profile,
+    const valve::lump_index lump,
+    const std::int32_t      patch
+)
+    : _profile( profile )
+{
+    if( !_profile ) {
+        return;
+    }
+
+    _start           = load_profile::clock::now();
+    _record.lump     = lump;
+    _record.patch    = patch;
+    _record.start_ns = _profile->elapsed_ns( _start );
+    _record.thread   = std::this_thread::get_id();
+
+    _previous      = current_slot();
+    current_slot() = &_record;
+}
+
+lump_timer::~lump_timer()
+{
+    if( !_profile ) {
+        return;
+    }
+
+    current_slot() = _previous;
+
+    //Whatever parse_lump didn't spend reading or decompressing went into converting the lump.
+    const auto total    = load_profile::lap( _start );
+    const auto measured = _record.read_ns + _record.decompress_ns;
+    _record.process_ns  = total > measured ? total - measured : 0;
+    _profile->add_lump( _record );
+}
+
+lump_profile* lump_timer::current()
+{
+    return current_slot();
+}
+
+lump_profile*& lump_timer::current_slot()
+{
+    thread_local lump_profile* record = nullptr;
+    return record;
+}
+
+stage_timer::stage_timer(
+    load_profile* profile,
+    const char*   name
+)
+    : _profile( profile )
+    , _name( name )
+{
+    if( _profile ) {
+        _start = load_profile::clock::now();
+    }
+}
+
+stage_timer::~stage_timer()
+{
+    if( _profile ) {
+        _profile->add_stage( _name, _start, load_profile::clock::now() );
+    }
+}
@@ -0,0 +1,169 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include <valve-bsp-parser/map_registry.hpp>
+
+using namespace rn;
+
+map_registry::map_registry(
+    const std::size_t memory_budget
+)
+    : _memory_budget( memory_budget )
+{
+}
+
+std::shared_ptr<const bsp_map> map_registry::acquire(
+    const std::string&  directory,
+    const std::string&  map_name,
+    const load_options& options
+)
+{
+    const auto file_path = bsp_map::map_path( directory, map_name );
+    const auto revision  = bsp_map::file_revision( file_path );
+    if( !revision ) {
+        return nullptr;
+    }
+
+    const auto shared_key = bsp_map::load_key( file_path, options );
+    if( !shared_key ) {
+        auto map = std::make_shared<bsp_map>();
+        return map->load( directory, map_name, options ) ? map : nullptr;
+    }
+
+    const auto& key = *shared_key;
+
+    std::promise<std::shared_ptr<const bsp_map>> promise;
+    std::uint64_t                                generation = 0;
+    {
+        std::unique_lock<std::mutex> lock( _mutex );
+
+        auto it = _entries.find( key );
+        if( it != _entries.end() && it->second.revision == revision ) {
+            _lru.splice( _lru.begin(), _lru, it->second.lru );
+            if( it->second.map ) {
+                return it->second.map;
+            }
+
+            const auto pending = it->second.pending;
+            lock.unlock();
+            return pending.get();
+        }
+
+        /// the file changed, whoever still holds the old map keeps it
+        if( it != _entries.end() ) {
+            erase( it );
+        }
+
+        generation = ++_generation;
+        _lru.push_front( key );
+
+        auto& added      = _entries[ key ];
+        added.revision   = revision;
+        added.generation = generation;
+        added.pending    = promise.get_future().share();
+        added.lru        = _lru.begin();
+    }
+
+    std::shared_ptr<const bsp_map> result;
+    try {
+        auto map = std::make_shared<bsp_map>();
+        if( map->load( directory, map_name, options ) ) {
+            result = std::move( map );
+        }
+    }
+    catch( ... ) {
+        result = nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+
+        /// skip entries a newer revision or clear() replaced while loading
+        const auto it = _entries.find( key );
+        if( it != _entries.end() && it->second.generation == generation ) {
+            if( result ) {
+                it->second.map          = result;
+                it->second.memory_usage = result->memory_usage();
+                it->second.pending      = {};
+                _memory_usage          += it->second.memory_usage;
+                evict();
+            }
+            else {
+                erase( it );
+            }
+        }
+    }
+
+    promise.set_value( result );
+    return result;
+}
+
+void map_registry::set_memory_budget(
+    const std::size_t memory_budget
+)
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+
+    _memory_budget = memory_budget;
+    evict();
+}
+
+std::size_t map_registry::memory_budget() const
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+
+    return _memory_budget;
+}
+
+std::size_t map_registry::memory_usage() const
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+
+    return _memory_usage;
+}
+
+std::size_t map_registry::size() const
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+
+    return _entries.size();
+}
+
+void map_registry::clear()
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+
+    _entries.clear();
+    _lru.clear();
+    _memory_usage = 0;
+}
+
+void map_registry::erase(
+    const std::unordered_map<std::string, entry>::iterator it
+)
+{
+    _memory_usage -= it->second.memory_usage;
+    _lru.erase( it->second.lru );
+    _entries.erase( it );
+}
+
+void map_registry::evict()
+{
+    if( !_memory_budget ) {
+        return;
+    }
+
+    auto it = _lru.end();
+    while( it != _lru.begin() && _memory_usage > _memory_budget ) {
+        /// loading maps and maps someone holds wouldn't free anything
+        const auto found = _entries.find( *std::prev( it ) );
+        if( !found->second.map || found->second.map.use_count() > 1 ) {
+            --it;
+            continue;
+        }
+
+        erase( found );
+    }
+}
@@ -0,0 +1,179 @@
+///--------------------------------------------------------------------------------
+///-- Author        ReactiioN
+///-- Copyright     2016-2020, ReactiioN
+///-- License       MIT
+///--------------------------------------------------------------------------------
+#include <valve-bsp-parser/core/thread_pool.hpp>
+
+using namespace rn;
+
+thread_pool::thread_pool(
+    std::size_t num_threads
+)
+{
+    if( !num_threads ) {
+        num_threads = std::max( std::thread::hardware_concurrency(), 1u );
+    }
+
+    _workers.reserve( num_threads );
+    for( std::size_t i = 0; i < num_threads; ++i ) {
+        _workers.emplace_back( &thread_pool::worker, this );
+    }
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _stop = true;
+    }
+    _condition.notify_all();
+
+    for( auto& worker : _workers ) {
+        worker.join();
+    }
+}
+
+thread_pool& thread_pool::shared()
+{
+    static thread_pool pool;
+    return pool;
+}
+
+void thread_pool::enqueue(
+    std::function<void()> task
+)
+{
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _tasks.push_back( std::move( task ) );
+    }
+    _condition.notify_one();
+}
+
+void thread_pool::worker()
+{
+    for( ;; ) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock( _mutex );
+            _condition.wait( lock, [this]
+            {
+                return _stop || !_tasks.empty();
+            } );
+
+            if( _tasks.empty() ) {
+                return;
+            }
+
+            task = std::move( _tasks.front() );
+            _tasks.pop_front();
+        }
+        task();
+    }
+}
+
+task_group::task_group(
+    thread_pool* pool
+)
+    : _pool( pool )
+    , _state( std::make_shared<state>() )
+{ }
+
+task_group::~task_group()
+{
+    try {
+        wait();
+    }
+    catch( ... ) {
+    }
+}
+
+void task_group::run(
+    std::function<void()> task
+)
+{
+    auto item  = std::make_shared<entry>();
+    item->task = std::move( task );
+
+    {
+        std::lock_guard<std::mutex> lock( _state->mutex );
+        _state->entries.push_back( item );
+        ++_state->pending;
+    }
+    _state->condition.notify_all();
+
+    if( _pool ) {
+        _pool->enqueue( [shared = _state, item]
+        {
+            execute( shared, *item );
+        } );
+    }
+}
+
+void task_group::wait()
+{
+    std::unique_lock<std::mutex> lock( _state->mutex );
+
+    for( ;; ) {
+        /// help out with everything nobody has started yet
+        std::shared_ptr<entry> item;
+        for( const auto& candidate : _state->entries ) {
+            if( !candidate->claimed.load( std::memory_order_relaxed ) ) {
+                item = candidate;
+                break;
+            }
+        }
+
+        if( item ) {
+            lock.unlock();
+            execute( _state, *item );
+            lock.lock();
+            continue;
+        }
+
+        if( !_state->pending ) {
+            break;
+        }
+
+        _state->condition.wait( lock );
+    }
+
+    _state->entries.clear();
+
+    if( _state->error ) {
+        auto error = _state->error;
+        _state->error = nullptr;
+        std::rethrow_exception( error );
+    }
+}
+
+void task_group::execute(
+    const std::shared_ptr<state>& shared,
+    entry&                        item
+)
+{
+    if( item.claimed.exchange( true ) ) {
+        return;
+    }
+
+    std::exception_ptr error;
+    try {
+        item.task();
+    }
+    catch( ... ) {
+        error = std::current_exception();
+    }
+
+    /// release captured state before the waiter can observe completion
+    item.task = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock( shared->mutex );
+        if( error && !shared->error ) {
+            shared->error = error;
+        }
+        --shared->pending;
+    }
+    shared->condition.notify_all();
+}